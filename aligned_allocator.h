@@ -0,0 +1,59 @@
+#ifndef ALIGNED_ALLOCATOR_H
+#define ALIGNED_ALLOCATOR_H
+
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+// std::vector allocator that puts the data on a cache line boundary and
+// leaves new elements uninitialised. The second part means whoever writes
+// the memory first (rather than the thread that resized the vector) decides
+// which NUMA node the pages end up on.
+
+template <typename T, size_t ALIGN = 64>
+class aligned_allocator
+{
+    public:
+
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind { typedef aligned_allocator<U, ALIGN> other; };
+
+    aligned_allocator() {};
+
+    template <typename U>
+    aligned_allocator(const aligned_allocator<U, ALIGN>&) {};
+
+    T* allocate(size_t n)
+    {
+        size_t bytes = ((n * sizeof(T) + ALIGN - 1) / ALIGN) * ALIGN;
+        void *p = std::aligned_alloc(ALIGN, bytes);
+        if (!p) throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T *p, size_t)
+    {
+        std::free(p);
+    }
+
+    // Default (not value) initialisation, so floats are left alone
+    template <typename U>
+    void construct(U *p)
+    {
+        ::new(static_cast<void*>(p)) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U *p, Args&&... args)
+    {
+        ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+
+    bool operator==(const aligned_allocator&) const { return true; }
+    bool operator!=(const aligned_allocator&) const { return false; }
+};
+
+#endif
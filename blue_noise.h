@@ -0,0 +1,206 @@
+#ifndef BLUE_NOISE_H
+#define BLUE_NOISE_H
+
+#include <glad/glad.h>
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+
+#include "rng.h"
+
+// A tileable blue noise texture, for the camera ray random numbers when
+// rendering with --seed bluenoise (see seed_rand() in testFragment.fs).
+//
+// Blue noise has no low frequencies, so neighbouring pixels get very
+// different values and the error left after a few samples looks like fine
+// grain instead of blotches. The tile is made with void and cluster
+// (Ulichney 1993), which takes a moment, so it's saved as a 16 bit PGM
+// (textures/bluenoise64.pgm) and just loaded on later runs.
+//
+// Every texel holds its rank / (size * size), so each value turns up
+// exactly once per tile.
+
+class blue_noise
+{
+    public:
+
+    int size;
+    std::vector<uint16_t> ranks;  // rank * 65536 / texels
+    unsigned int tex;
+
+    blue_noise() : size{0}, tex{0} {};
+
+    // Loads path, or makes a size x size tile and saves it there
+    void load_or_generate(const std::string &path, int my_size)
+    {
+        if (load(path) && size == my_size) return;
+
+        std::cout << "Generating " << my_size << "x" << my_size << " blue noise..." << std::endl;
+        generate(my_size);
+        if (!save(path)) {
+            std::cerr << "Couldn't save blue noise to " << path << std::endl;
+        }
+    }
+
+    // Value at (x, y), wrapping around, scaled to the full 32 bit range
+    // (what rng_blue_noise() wants)
+    uint32_t at(int x, int y) const
+    {
+        x = ((x % size) + size) % size;
+        y = ((y % size) + size) % size;
+        return uint32_t(ranks[y * size + x]) << 16;
+    }
+
+    // R16 texture, repeating, read with texelFetch
+    void upload()
+    {
+        if (tex == 0) {
+            glGenTextures(1, &tex);
+        }
+        glBindTexture(GL_TEXTURE_2D, tex);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, size, size, 0, GL_RED, GL_UNSIGNED_SHORT, ranks.data());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    }
+
+    bool load(const std::string &path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) return false;
+
+        std::string magic;
+        int w, h, max_value;
+        file >> magic >> w >> h >> max_value;
+        file.get(); // the one whitespace byte before the data
+        if (!file || magic != "P5" || w != h || w <= 0 || max_value != 65535) {
+            std::cerr << path << " isn't a square 16 bit PGM" << std::endl;
+            return false;
+        }
+
+        std::vector<unsigned char> bytes(size_t(w) * h * 2);
+        file.read(reinterpret_cast<char*>(bytes.data()), bytes.size());
+        if (!file) return false;
+
+        // PGM is big endian
+        size = w;
+        ranks.resize(size_t(w) * h);
+        for (size_t i = 0; i < ranks.size(); i++) {
+            ranks[i] = uint16_t((bytes[2*i] << 8) | bytes[2*i + 1]);
+        }
+        return true;
+    }
+
+    bool save(const std::string &path) const
+    {
+        std::ofstream file(path, std::ios::binary);
+        if (!file) return false;
+
+        file << "P5\n" << size << " " << size << "\n65535\n";
+        for (uint16_t r : ranks) {
+            file.put(char(r >> 8));
+            file.put(char(r & 0xFF));
+        }
+        return bool(file);
+    }
+
+    void generate(int my_size)
+    {
+        size = std::max(my_size, 1);
+        int n = size * size;
+
+        // Gaussian energy each point adds to its (wrapped around) surroundings
+        const float SIGMA = 1.5f;
+        std::vector<float> kernel(n);
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                int dx = std::min(x, size - x);
+                int dy = std::min(y, size - y);
+                kernel[y * size + x] = std::exp(-(dx*dx + dy*dy) / (2.0f * SIGMA * SIGMA));
+            }
+        }
+
+        std::vector<char> on(n, 0);
+        std::vector<float> energy(n, 0.0f);
+        auto toggle = [&](int p, bool set) {
+            on[p] = set;
+            float sign = set ? 1.0f : -1.0f;
+            int px = p % size, py = p / size;
+            for (int y = 0; y < size; y++) {
+                int ky = ((y - py + size) % size) * size;
+                for (int x = 0; x < size; x++) {
+                    energy[y * size + x] += sign * kernel[ky + (x - px + size) % size];
+                }
+            }
+        };
+        // Densest point that's on, or emptiest spot that's off
+        auto tightest_cluster = [&]() {
+            int best = -1;
+            for (int p = 0; p < n; p++) {
+                if (on[p] && (best < 0 || energy[p] > energy[best])) best = p;
+            }
+            return best;
+        };
+        auto largest_void = [&]() {
+            int best = -1;
+            for (int p = 0; p < n; p++) {
+                if (!on[p] && (best < 0 || energy[p] < energy[best])) best = p;
+            }
+            return best;
+        };
+
+        // Initial pattern: a random 10% of points, then move points from
+        // clusters into voids until that stops changing anything
+        int num_initial = std::max(1, n / 10);
+        for (uint32_t i = 0, placed = 0; placed < uint32_t(num_initial); i++) {
+            int p = int(pcg_hash(i) % uint32_t(n));
+            if (!on[p]) {
+                toggle(p, true);
+                placed++;
+            }
+        }
+        while (true)
+        {
+            int cluster = tightest_cluster();
+            toggle(cluster, false);
+            int hole = largest_void();
+            toggle(hole, true);
+            if (hole == cluster) break;
+        }
+
+        std::vector<int> rank(n, 0);
+
+        // Ranks below the initial points: take them back out, tightest first
+        std::vector<char> initial = on;
+        std::vector<float> initial_energy = energy;
+        for (int r = num_initial - 1; r >= 0; r--) {
+            int cluster = tightest_cluster();
+            toggle(cluster, false);
+            rank[cluster] = r;
+        }
+
+        // Ranks above: fill the largest void until every point is on
+        on = initial;
+        energy = initial_energy;
+        for (int r = num_initial; r < n; r++) {
+            int hole = largest_void();
+            toggle(hole, true);
+            rank[hole] = r;
+        }
+
+        ranks.resize(n);
+        for (int p = 0; p < n; p++) {
+            ranks[p] = uint16_t(int64_t(rank[p]) * 65536 / n);
+        }
+    }
+};
+
+#endif
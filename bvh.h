@@ -0,0 +1,240 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include "vec3.h"
+#include "sphere.h"
+#include "hittable_list.h"
+#include "scene_buffer.h"
+
+// Bounding volume hierarchy over the spheres in a hittable_list.
+//
+// Built on the CPU with a binned SAH split, then flattened in depth first
+// order with a "skip" index per node (where to go if the ray misses the
+// node, i.e. the next node that isn't a child of it). That lets the shader
+// walk the tree with no stack: on a hit go to i+1, on a miss go to skip.
+//
+// Building reorders the list's objects so every leaf is a contiguous run.
+
+struct aabb {
+    vec3 min;
+    vec3 max;
+
+    aabb() : min{vec3(1e30f, 1e30f, 1e30f)}, max{vec3(-1e30f, -1e30f, -1e30f)} {};
+
+    void grow(const vec3 &p)
+    {
+        for (int a = 0; a < 3; a++) {
+            min[a] = std::min(min[a], p[a]);
+            max[a] = std::max(max[a], p[a]);
+        }
+    }
+
+    void grow(const aabb &b)
+    {
+        for (int a = 0; a < 3; a++) {
+            min[a] = std::min(min[a], b.min[a]);
+            max[a] = std::max(max[a], b.max[a]);
+        }
+    }
+
+    float area() const
+    {
+        vec3 d = max - min;
+        if (d[0] < 0) return 0.0f;
+        return 2.0f * (d[0]*d[1] + d[1]*d[2] + d[2]*d[0]);
+    }
+};
+
+inline aabb sphere_bounds(const sphere &s)
+{
+    aabb b;
+    b.grow(s.origin - vec3(s.radius, s.radius, s.radius));
+    b.grow(s.origin + vec3(s.radius, s.radius, s.radius));
+    return b;
+}
+
+struct bvh_node {
+    aabb bounds;
+    int skip;  // next node to visit if the ray misses this one
+    int start; // first object (leaves only)
+    int count; // number of objects, 0 for interior nodes
+};
+
+class bvh
+{
+    public:
+
+    // Leaves hold at most this many spheres (the count is packed into 2 bits)
+    static const int MAX_LEAF_SIZE = 4;
+    static const int NUM_BINS = 12;
+
+    std::vector<bvh_node> nodes;
+    scene_buffer buffer;
+    int depth;
+
+    bvh() : depth{0} {};
+
+    bvh(hittable_list &list) : depth{0}
+    {
+        build(list);
+    }
+
+    void build(hittable_list &list)
+    {
+        nodes.clear();
+        depth = 0;
+        if (list.objects.empty()) return;
+
+        std::vector<aabb> bounds;
+        std::vector<vec3> centroids;
+        std::vector<int> order;
+        for (size_t i = 0; i < list.objects.size(); i++) {
+            bounds.push_back(sphere_bounds(list.objects[i]));
+            centroids.push_back(list.objects[i].origin);
+            order.push_back(int(i));
+        }
+
+        nodes.reserve(2 * list.objects.size());
+        build_recursive(bounds, centroids, order, 0, int(order.size()), 1);
+
+        // Put the objects in leaf order
+        std::vector<sphere> sorted;
+        sorted.reserve(order.size());
+        for (int i : order) {
+            sorted.push_back(list.objects[i]);
+        }
+        list.objects = sorted;
+    }
+
+    // Two vec4s per node: (min, skip), (max, leaf) where leaf is -1 for
+    // interior nodes and start*4 + (count-1) for leaves. skip and leaf are
+    // ints stored bit for bit (see int_bits()).
+    void upload()
+    {
+        std::vector<float> data;
+        data.reserve(nodes.size() * 8);
+        for (const bvh_node &n : nodes) {
+            int leaf = (n.count > 0) ? n.start * 4 + (n.count - 1) : -1;
+            data.insert(data.end(), {n.bounds.min[0], n.bounds.min[1], n.bounds.min[2], int_bits(n.skip)});
+            data.insert(data.end(), {n.bounds.max[0], n.bounds.max[1], n.bounds.max[2], int_bits(leaf)});
+        }
+        buffer.upload(data);
+    }
+
+    private:
+
+    // Builds the subtree over order[begin, end) and returns its node index
+    int build_recursive(const std::vector<aabb> &bounds, const std::vector<vec3> &centroids,
+                        std::vector<int> &order, int begin, int end, int level)
+    {
+        depth = std::max(depth, level);
+
+        int index = int(nodes.size());
+        nodes.push_back(bvh_node());
+
+        aabb node_bounds, centroid_bounds;
+        for (int i = begin; i < end; i++) {
+            node_bounds.grow(bounds[order[i]]);
+            centroid_bounds.grow(centroids[order[i]]);
+        }
+
+        int count = end - begin;
+        int mid = -1;
+
+        if (count > MAX_LEAF_SIZE) {
+            mid = split(bounds, centroids, centroid_bounds, order, begin, end);
+        }
+
+        if (mid < 0) {
+            nodes[index].bounds = node_bounds;
+            nodes[index].start = begin;
+            nodes[index].count = count;
+            nodes[index].skip = index + 1;
+            return index;
+        }
+
+        build_recursive(bounds, centroids, order, begin, mid, level + 1);
+        build_recursive(bounds, centroids, order, mid, end, level + 1);
+
+        nodes[index].bounds = node_bounds;
+        nodes[index].start = 0;
+        nodes[index].count = 0;
+        nodes[index].skip = int(nodes.size()); // past the end of this subtree
+        return index;
+    }
+
+    // Binned SAH: partitions order[begin, end) and returns the split point
+    int split(const std::vector<aabb> &bounds, const std::vector<vec3> &centroids,
+              const aabb &centroid_bounds, std::vector<int> &order, int begin, int end)
+    {
+        int count = end - begin;
+
+        // Split along the longest axis of the centroids
+        vec3 extent = centroid_bounds.max - centroid_bounds.min;
+        int axis = 0;
+        if (extent[1] > extent[axis]) axis = 1;
+        if (extent[2] > extent[axis]) axis = 2;
+
+        if (extent[axis] <= 0.0f) {
+            // All centroids in the same place, just cut the list in half
+            return begin + count / 2;
+        }
+
+        aabb bin_bounds[NUM_BINS];
+        int bin_count[NUM_BINS] = {0};
+        float scale = NUM_BINS / extent[axis];
+
+        auto bin_of = [&](int obj) {
+            int b = int((centroids[obj][axis] - centroid_bounds.min[axis]) * scale);
+            return std::min(b, NUM_BINS - 1);
+        };
+
+        for (int i = begin; i < end; i++) {
+            int b = bin_of(order[i]);
+            bin_bounds[b].grow(bounds[order[i]]);
+            bin_count[b] += 1;
+        }
+
+        // Sweep from the right to get the cost of everything right of each plane
+        float right_area[NUM_BINS];
+        int right_count[NUM_BINS];
+        aabb acc;
+        int n = 0;
+        for (int b = NUM_BINS - 1; b > 0; b--) {
+            acc.grow(bin_bounds[b]);
+            n += bin_count[b];
+            right_area[b] = acc.area();
+            right_count[b] = n;
+        }
+
+        float best_cost = 1e30f;
+        int best_plane = -1;
+        acc = aabb();
+        n = 0;
+        for (int b = 0; b < NUM_BINS - 1; b++) {
+            acc.grow(bin_bounds[b]);
+            n += bin_count[b];
+            if (n == 0 || right_count[b + 1] == 0) continue;
+
+            float cost = acc.area() * n + right_area[b + 1] * right_count[b + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_plane = b;
+            }
+        }
+
+        if (best_plane < 0) {
+            return begin + count / 2;
+        }
+
+        auto mid_it = std::partition(order.begin() + begin, order.begin() + end,
+                                     [&](int obj) { return bin_of(obj) <= best_plane; });
+        return int(mid_it - order.begin());
+    }
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include <cmath>
+
+#include "vec3.h"
+
+struct Camera {
+    point3 lookfrom;
+    point3 lookat;
+    vec3 vup;
+    float vfov;
+    float defocus_angle;
+    float focus_dist;
+
+    vec3 delta_u;
+    vec3 delta_v;
+
+    vec3 viewport_top_left;
+
+    float defocus_radius;
+    vec3 defocus_disc_u;
+    vec3 defocus_disc_v;
+};
+
+// Work out the viewport (and defocus disc) from lookfrom/lookat/vup/vfov
+// for an image of width x height pixels
+void camera_setup(Camera &cam, int width, int height)
+{
+    vec3 u, v, w;
+
+    point3 camera_origin = cam.lookfrom;
+
+    auto theta = degrees_to_radians(cam.vfov);
+    auto h = std::tan(theta / 2);
+    auto viewport_height = 2*h*cam.focus_dist;
+    auto viewport_width = (double(width) / double(height)) * viewport_height;
+
+    w = unit_vector(cam.lookfrom - cam.lookat);
+    u = unit_vector(cross(cam.vup, w));
+    v = cross(w, u);
+
+    vec3 viewport_u = viewport_width * u;
+    vec3 viewport_v = viewport_height * -v;
+
+    cam.delta_u = viewport_u / width;
+    cam.delta_v = viewport_v / height;
+
+    cam.viewport_top_left = camera_origin - (cam.focus_dist*w)
+                                    - viewport_u/2
+                                    - viewport_v/2;
+
+    cam.defocus_radius = cam.focus_dist * std::tan(degrees_to_radians(cam.defocus_angle / 2));
+    cam.defocus_disc_u = u * cam.defocus_radius;
+    cam.defocus_disc_v = v * cam.defocus_radius; 
+}
+
+// Rotate v by angle degrees around the unit vector axis (Rodrigues)
+vec3 rotate(const vec3 &v, const vec3 &axis, float angle)
+{
+    float a = degrees_to_radians(angle);
+    return v * std::cos(a) + cross(axis, v) * std::sin(a) + axis * dot(axis, v) * (1.0f - std::cos(a));
+}
+
+// Move the camera (lookat along with it) by fractions of the distance
+// between them, along the view direction, to the right and up. Call
+// camera_setup() afterwards.
+void camera_move(Camera &cam, float forward, float right, float up)
+{
+    vec3 view = cam.lookat - cam.lookfrom;
+    float distance = view.length();
+    vec3 w = view / distance;
+    vec3 u = unit_vector(cross(w, cam.vup));
+    vec3 v = cross(u, w);
+
+    vec3 offset = distance * (forward * w + right * u + up * v);
+    cam.lookfrom += offset;
+    cam.lookat += offset;
+}
+
+// Turn the camera in place, yaw degrees to the left around vup and pitch
+// degrees up. Call camera_setup() afterwards.
+void camera_turn(Camera &cam, float yaw, float pitch)
+{
+    vec3 view = cam.lookat - cam.lookfrom;
+    vec3 u = unit_vector(cross(view, cam.vup));
+
+    view = rotate(view, unit_vector(cam.vup), yaw);
+    view = rotate(view, rotate(u, unit_vector(cam.vup), yaw), pitch);
+
+    // (stop short of looking straight up or down, where u flips)
+    if (std::fabs(dot(unit_vector(view), unit_vector(cam.vup))) < 0.99f) {
+        cam.lookat = cam.lookfrom + view;
+    }
+}
+
+#endif
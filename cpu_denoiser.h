@@ -0,0 +1,177 @@
+#ifndef CPU_DENOISER_H
+#define CPU_DENOISER_H
+
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+
+#include "denoise.h"
+
+// CPU version of shaders/denoise.fs, for the CPU renderer (no GPU to run
+// the shader on a headless machine). Same filter from denoise.h, split
+// into bands of rows over num_threads threads, one iteration at a time.
+//
+// Takes the buffers as cpu_renderer keeps them (RGBA accum, albedo + depth
+// and normal sums, two moments per pixel, rows stride pixels apart) and
+// leaves gamma corrected RGB in out, bottom row first with no padding,
+// ready to upload to the screen texture.
+
+class cpu_denoiser
+{
+    public:
+
+    int width;
+    int height;
+    int num_threads;
+
+    std::vector<float> out;
+
+    cpu_denoiser(int my_width, int my_height, int my_num_threads)
+        : width{my_width}, height{my_height}, num_threads{std::max(1, my_num_threads)}
+    {
+        size_t n = size_t(width) * height;
+        out.resize(n * 3);
+        albedo.resize(n * 3);
+        normal.resize(n * 3);
+        depth.resize(n);
+        buffer[0].resize(n * 4);
+        buffer[1].resize(n * 4);
+    }
+
+    void run(const float *accum, const float *moments, const float *albedo_sums, const float *normal_sums, int stride)
+    {
+        for_rows([&](int y_begin, int y_end) { load(accum, moments, albedo_sums, normal_sums, stride, y_begin, y_end); });
+
+        for (int i = 0; i < DENOISE_ITERATIONS; i++)
+        {
+            const std::vector<float> &src = buffer[i % 2];
+            std::vector<float> &dst = buffer[1 - i % 2];
+            for_rows([&](int y_begin, int y_end) { iterate(1 << i, src, dst, y_begin, y_end); });
+        }
+
+        // Put the albedo back and gamma correct, like the last iteration of the shader
+        const std::vector<float> &result = buffer[DENOISE_ITERATIONS % 2];
+        for_rows([&](int y_begin, int y_end) {
+            for (size_t p = size_t(y_begin) * width; p < size_t(y_end) * width; p++) {
+                for (int c = 0; c < 3; c++) {
+                    out[p * 3 + c] = std::pow(std::max(0.0f, result[p * 4 + c] * albedo[p * 3 + c]), 1.0f / 2.2f);
+                }
+            }
+        });
+    }
+
+    private:
+
+    // Guides, averaged (normalized for the normals)
+    std::vector<float> albedo;
+    std::vector<float> normal;
+    std::vector<float> depth;
+
+    // (illumination, variance), ping-ponged between iterations
+    std::vector<float> buffer[2];
+
+    template <typename F>
+    void for_rows(F f)
+    {
+        std::vector<std::thread> threads;
+        int rows = (height + num_threads - 1) / num_threads;
+        for (int y = 0; y < height; y += rows) {
+            threads.emplace_back(f, y, std::min(y + rows, height));
+        }
+        for (std::thread &t : threads) {
+            t.join();
+        }
+    }
+
+    // The guides, and the first iteration's input (what the shader's
+    // load_guide() and load_input() work out on the fly)
+    void load(const float *accum, const float *moments, const float *albedo_sums, const float *normal_sums,
+              int stride, int y_begin, int y_end)
+    {
+        for (size_t p = size_t(y_begin) * width; p < size_t(y_end) * width; p++)
+        {
+            // (the same pixel in the renderer's padded rows)
+            size_t q = (p / width) * stride + p % width;
+            float n = std::max(accum[q * 4 + 3], 1.0f);
+
+            for (int c = 0; c < 3; c++) {
+                albedo[p * 3 + c] = std::max(albedo_sums[q * 4 + c] / n, DENOISE_MIN_ALBEDO);
+            }
+            depth[p] = albedo_sums[q * 4 + 3] / n;
+
+            float nx = normal_sums[q * 4], ny = normal_sums[q * 4 + 1], nz = normal_sums[q * 4 + 2];
+            float length = std::sqrt(nx*nx + ny*ny + nz*nz);
+            float scale = length > 0.0f ? 1.0f / length : 0.0f;
+            normal[p * 3] = nx * scale;
+            normal[p * 3 + 1] = ny * scale;
+            normal[p * 3 + 2] = nz * scale;
+
+            const float *a = &albedo[p * 3];
+            float *b = &buffer[0][p * 4];
+            for (int c = 0; c < 3; c++) {
+                b[c] = accum[q * 4 + c] / n / a[c];
+            }
+            b[3] = denoise_mean_variance(moments[q * 2], moments[q * 2 + 1], n, denoise_luminance(a[0], a[1], a[2]));
+        }
+    }
+
+    void iterate(int step, const std::vector<float> &src, std::vector<float> &dst, int y_begin, int y_end) const
+    {
+        for (int y = y_begin; y < y_end; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                size_t p = size_t(y) * width + x;
+                const float *centre = &src[p * 4];
+                float lum_c = denoise_luminance(centre[0], centre[1], centre[2]);
+
+                float variance = 0.0f;
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int qx = std::min(std::max(x + dx, 0), width - 1);
+                        int qy = std::min(std::max(y + dy, 0), height - 1);
+                        variance += denoise_variance_kernel(dx, dy) * src[(size_t(qy) * width + qx) * 4 + 3];
+                    }
+                }
+
+                float sum[3] = {0.0f, 0.0f, 0.0f};
+                float weight_sum = 0.0f;
+                float variance_sum = 0.0f;
+                for (int dy = -2; dy <= 2; dy++)
+                {
+                    for (int dx = -2; dx <= 2; dx++)
+                    {
+                        int qx = x + dx * step, qy = y + dy * step;
+                        if (qx < 0 || qy < 0 || qx >= width || qy >= height) continue;
+
+                        size_t q = size_t(qy) * width + qx;
+                        const float *s = &src[q * 4];
+                        float cos_n = normal[p * 3] * normal[q * 3] + normal[p * 3 + 1] * normal[q * 3 + 1]
+                                    + normal[p * 3 + 2] * normal[q * 3 + 2];
+                        float w = atrous_weight(dx, dy, step, cos_n, depth[p], depth[q],
+                                                lum_c, denoise_luminance(s[0], s[1], s[2]), variance);
+
+                        sum[0] += w * s[0];
+                        sum[1] += w * s[1];
+                        sum[2] += w * s[2];
+                        weight_sum += w;
+                        variance_sum += w * w * s[3];
+                    }
+                }
+
+                float *d = &dst[p * 4];
+                if (weight_sum > 0.0f) {
+                    d[0] = sum[0] / weight_sum;
+                    d[1] = sum[1] / weight_sum;
+                    d[2] = sum[2] / weight_sum;
+                    d[3] = variance_sum / (weight_sum * weight_sum);
+                } else {
+                    std::copy(centre, centre + 4, d);
+                }
+            }
+        }
+    }
+};
+
+#endif
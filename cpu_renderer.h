@@ -0,0 +1,1031 @@
+#ifndef CPU_RENDERER_H
+#define CPU_RENDERER_H
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "vec3.h"
+#include "camera.h"
+#include "sphere.h"
+#include "material.h"
+#include "hittable_list.h"
+#include "material_list.h"
+#include "bvh.h"
+#include "sphere_soa.h"
+#include "ray_packet.h"
+#include "wide_bvh.h"
+#include "ray_queue.h"
+#include "work_queue.h"
+#include "aligned_allocator.h"
+#include "blue_noise.h"
+#include "sampler.h"
+#include "warp.h"
+#include "denoise.h"
+
+// CPU version of testFragment.fs, for machines without a (useful) GPU.
+//
+// Does the same thing as the shader (same materials, bounce limit, defocus
+// and sky) so the images match within noise, but spreads the work over a
+// pool of threads, one tile at a time. Passes run in the background: call
+// start_pass() then poll pass_done(), and the main loop keeps running.
+//
+// Tiles are handed out in Morton order through a work_queue, so each
+// thread starts on its own compact patch of the image and threads that
+// finish early steal from the others. Threads are pinned to a core each
+// (on Linux), and touch their patch of accum first so it's allocated on
+// their NUMA node.
+//
+// Camera rays are traced RAY_PACKET_SIZE pixels at a time (see ray_packet.h),
+// then each ray carries on by itself from its first hit.
+//
+// In wavefront mode a tile's paths are instead all kept in a ray_queue and
+// advanced one bounce at a time: trace everything, shade grouped by
+// material type, drop the dead rays and group the rest by direction octant
+// for the next trace. That keeps packets coherent and the shading
+// branches predictable when paths diverge (lots of glass, deep bounces).
+//
+// Past rr_depth bounces paths go through Russian roulette (see roulette()),
+// and lambertian hits sample a light picked by the light tree (see
+// sample_light() and light_tree.h), same as the shader.
+//
+// Jitter, lens and scatter directions use the quasi random points from
+// sampler.h, shifted by a blue_noise tile if there is one, like the shader
+// with SEED_BLUE_NOISE (see sample_2d()).
+//
+// accum is laid out like the GL accumulation buffer (RGBA, rgb = sum of
+// samples, a = sample count, bottom row first) so it can be uploaded as is,
+// except that rows are stride pixels apart (see row_stride()). moments,
+// albedo and normals are its other attachments (luminance sums, and the
+// denoiser's guides, only filled in with features set), laid out the same
+// way.
+
+class cpu_renderer
+{
+    public:
+
+    int width;
+    int height;
+    int stride; // pixels from one row of the buffers to the next
+    int num_samples;
+    uint32_t bounce_limit;
+    uint32_t rr_depth;
+    int num_threads;
+    bool wavefront;
+    bool features; // follow denoiser guides (set before start_pass())
+
+    std::vector<float, aligned_allocator<float>> accum;
+    std::vector<float, aligned_allocator<float>> moments; // sum of luminance, sum of its square
+    std::vector<float, aligned_allocator<float>> albedo;  // sum of albedo, sum of depth
+    std::vector<float, aligned_allocator<float>> normals; // sum of normals, sum of the camera ray's hit distance
+
+    // Stats from the last finished pass
+    uint64_t pass_rays;
+    uint64_t pass_terminated; // paths Russian roulette stopped
+    uint64_t pass_survived;   // and ones it let carry on
+    double pass_ms;
+
+    static const int TILE_SIZE = 16;
+
+    // Rows are padded to a multiple of 8 pixels (64 bytes of moments, 128
+    // of the RGBA buffers). TILE_SIZE is a multiple of 8 too, so each
+    // tile's part of a row starts on a cache line of its own, and threads
+    // on neighbouring tiles never write the same one.
+    static int row_stride(int width)
+    {
+        return (width + 7) / 8 * 8;
+    }
+
+    // Scenes this small skip the BVH and test every sphere (it's only a
+    // few SIMD iterations)
+    static const int BRUTE_FORCE_LIMIT = 64;
+
+    // Wavefront shading groups, one per MATERIAL_TYPE
+    static const int NUM_MATERIAL_GROUPS = 5;
+
+    cpu_renderer(const hittable_list &my_objects, const material_list &my_materials, const bvh &my_tree,
+                 const Camera &my_cam, int my_width, int my_height, int my_num_samples,
+                 uint32_t my_bounce_limit, uint32_t my_rr_depth, int my_num_threads, bool my_wavefront,
+                 const blue_noise *my_seed_noise = NULL)
+        : width{my_width}, height{my_height}, stride{row_stride(my_width)}, num_samples{my_num_samples}, bounce_limit{my_bounce_limit},
+          rr_depth{my_rr_depth}, num_threads{my_num_threads}, wavefront{my_wavefront}, features{false},
+          pass_rays{0}, pass_terminated{0}, pass_survived{0}, pass_ms{0.0},
+          objects{my_objects}, materials{my_materials}, tree{my_tree}, spheres{my_objects}, wide{my_tree}, cam{my_cam},
+          seed_noise{my_seed_noise},
+          frame_index{0}, generation{0}, working{0}, done{true}, quit{false},
+          rays{0}, terminated{0}, survived{0}
+    {
+        int num_cores = int(std::max(1u, std::thread::hardware_concurrency()));
+        if (num_threads <= 0) {
+            num_threads = num_cores;
+        }
+        pin_threads = num_threads <= num_cores;
+
+        tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+        tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+        tile_order = morton_order(tiles_x, tiles_y);
+        tiles.reset(new work_queue(num_threads));
+        tiles->reset(int(tile_order.size()));
+
+        // Left uninitialised, the workers zero their own tiles (see worker())
+        accum.resize(size_t(stride) * height * 4);
+        moments.resize(size_t(stride) * height * 2);
+        albedo.resize(size_t(stride) * height * 4);
+        normals.resize(size_t(stride) * height * 4);
+
+        // (the zeroing pass finishes like any other, see finish_work())
+        working = num_threads;
+        done = false;
+        pass_start = std::chrono::steady_clock::now();
+        for (int i = 0; i < num_threads; i++) {
+            workers.emplace_back(&cpu_renderer::worker, this, i);
+        }
+        wait();
+    }
+
+    ~cpu_renderer()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            quit = true;
+        }
+        start_cv.notify_all();
+        for (std::thread &t : workers) {
+            t.join();
+        }
+    }
+
+    // Kick off another pass of num_samples per pixel on the worker threads
+    void start_pass(uint32_t my_frame_index)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        frame_index = my_frame_index;
+        tiles->reset(int(tile_order.size()));
+        rays = 0;
+        terminated = 0;
+        survived = 0;
+        working = num_threads;
+        done = false;
+        pass_start = std::chrono::steady_clock::now();
+        generation++;
+        start_cv.notify_all();
+    }
+
+    // Only between passes (after wait())
+    void set_camera(const Camera &my_cam)
+    {
+        cam = my_cam;
+    }
+
+    bool pass_done()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        return done;
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [this] { return done; });
+    }
+
+    private:
+
+    const hittable_list &objects;
+    const material_list &materials;
+    const bvh &tree;
+    sphere_soa spheres;
+    wide_bvh wide;
+    Camera cam;
+    const blue_noise *seed_noise; // NULL to scramble the samples per pixel instead
+
+    uint32_t frame_index;
+    int tiles_x;
+    int tiles_y;
+    std::vector<int> tile_order; // tile indexes in Morton order
+    std::unique_ptr<work_queue> tiles;
+    bool pin_threads;
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    uint64_t generation;
+    int working;
+    bool done;
+    bool quit;
+    std::atomic<uint64_t> rays;
+    std::atomic<uint64_t> terminated;
+    std::atomic<uint64_t> survived;
+    std::chrono::steady_clock::time_point pass_start;
+
+    struct hit {
+        point3 point;
+        vec3 normal;
+        bool hit;
+        bool interior;
+        int mat;
+        int sphere;
+    };
+
+    // Denoiser guides, for a sample or summed over a pixel's (see
+    // follow_features())
+    struct denoise_features {
+        colour albedo;
+        float depth;
+        vec3 normal;
+        float hit_depth; // the camera ray's own hit, for reprojection
+    };
+
+    struct ray {
+        point3 origin;
+        vec3 dir;
+        bool bounce;
+        uint32_t count;
+        colour albedo;
+        float weight; // Russian roulette compensation
+        colour light; // from emissive spheres so far
+        float pdf;    // of the last bounce direction, 0 if it wasn't sampled
+        vec3 normal;  // where that bounce left from (for the light tree's pmf)
+        denoise_features *features; // while follow_features() still has work, else NULL
+    };
+
+    // What a worker counts while rendering, added to the totals at the end
+    struct path_counts {
+        uint64_t rays;
+        uint64_t terminated;
+        uint64_t survived;
+    };
+
+    // Per thread queues for wavefront mode, kept between tiles
+    struct wavefront_buffers {
+        ray_queue queue;
+        ray_queue scratch;
+        std::vector<int> offsets;
+        std::vector<colour> tile; // per sample
+        std::vector<denoise_features> features; // per sample
+        std::vector<uint8_t> following; // per sample, if its features are still being followed
+    };
+
+    void worker(int id)
+    {
+        if (pin_threads) {
+            pin_to_core(id);
+        }
+
+        // First touch: zero the tiles this thread starts each pass with, so
+        // on a NUMA machine their pages end up on this thread's node
+        for (int k = tiles->first(id); k < tiles->first(id + 1); k++)
+        {
+            int tx = tile_order[k] % tiles_x, ty = tile_order[k] / tiles_x;
+            int x_end = std::min((tx + 1) * TILE_SIZE, width);
+            int y_end = std::min((ty + 1) * TILE_SIZE, height);
+            for (int y = ty * TILE_SIZE; y < y_end; y++) {
+                size_t first = size_t(height - 1 - y) * stride + tx * TILE_SIZE;
+                size_t n = x_end - tx * TILE_SIZE;
+                std::fill(&accum[first * 4], &accum[first * 4] + n * 4, 0.0f);
+                std::fill(&moments[first * 2], &moments[first * 2] + n * 2, 0.0f);
+                std::fill(&albedo[first * 4], &albedo[first * 4] + n * 4, 0.0f);
+                std::fill(&normals[first * 4], &normals[first * 4] + n * 4, 0.0f);
+            }
+        }
+        finish_work();
+
+        wavefront_buffers wb;
+        uint64_t seen = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                start_cv.wait(lock, [&] { return quit || generation != seen; });
+                if (quit) return;
+                seen = generation;
+            }
+
+            path_counts counts = {0, 0, 0};
+            while (true)
+            {
+                int k = tiles->pop(id);
+                if (k < 0) k = tiles->steal(id);
+                if (k < 0) break;
+
+                int t = tile_order[k];
+                if (wavefront) {
+                    render_tile_wavefront(t % tiles_x, t / tiles_x, counts, wb);
+                } else {
+                    render_tile(t % tiles_x, t / tiles_x, counts);
+                }
+            }
+            rays += counts.rays;
+            terminated += counts.terminated;
+            survived += counts.survived;
+
+            finish_work();
+        }
+    }
+
+    // Called by each worker when it's done, the last one finishes the pass
+    void finish_work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        working -= 1;
+        if (working == 0) {
+            pass_rays = rays;
+            pass_terminated = terminated;
+            pass_survived = survived;
+            pass_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - pass_start).count();
+            done = true;
+            done_cv.notify_all();
+        }
+    }
+
+    static void pin_to_core(int core)
+    {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+        (void)core;
+#endif
+    }
+
+    // Tile indexes (ty * tiles_x + tx) sorted along a Z curve, so runs of
+    // the list are compact blocks of the image rather than strips
+    static std::vector<int> morton_order(int tiles_x, int tiles_y)
+    {
+        std::vector<std::pair<uint32_t, int>> keyed;
+        for (int ty = 0; ty < tiles_y; ty++) {
+            for (int tx = 0; tx < tiles_x; tx++) {
+                keyed.push_back({spread_bits(uint32_t(tx)) | (spread_bits(uint32_t(ty)) << 1), ty * tiles_x + tx});
+            }
+        }
+        std::sort(keyed.begin(), keyed.end());
+
+        std::vector<int> order;
+        for (const auto &k : keyed) {
+            order.push_back(k.second);
+        }
+        return order;
+    }
+
+    // 0b1011 -> 0b1000101 (16 bit input)
+    static uint32_t spread_bits(uint32_t x)
+    {
+        x &= 0xFFFFu;
+        x = (x | (x << 8)) & 0x00FF00FFu;
+        x = (x | (x << 4)) & 0x0F0F0F0Fu;
+        x = (x | (x << 2)) & 0x33333333u;
+        x = (x | (x << 1)) & 0x55555555u;
+        return x;
+    }
+
+    // x, y are pixel coordinates with y = 0 at the top (like gl_FragCoord in the shader)
+    void render_tile(int tx, int ty, path_counts &counts)
+    {
+        int x_end = std::min((tx + 1) * TILE_SIZE, width);
+        int y_end = std::min((ty + 1) * TILE_SIZE, height);
+
+        for (int y = ty * TILE_SIZE; y < y_end; y++)
+        {
+            for (int x0 = tx * TILE_SIZE; x0 < x_end; x0 += RAY_PACKET_SIZE)
+            {
+                int n = std::min(RAY_PACKET_SIZE, x_end - x0);
+
+                rng_state state[RAY_PACKET_SIZE];
+                colour pixel_colour[RAY_PACKET_SIZE];
+                float pixel_moments[RAY_PACKET_SIZE][2];
+                denoise_features pixel_features[RAY_PACKET_SIZE];
+                for (int l = 0; l < n; l++) {
+                    pixel_colour[l] = colour(0, 0, 0);
+                    pixel_moments[l][0] = pixel_moments[l][1] = 0.0f;
+                    pixel_features[l] = {colour(0, 0, 0), 0.0f, vec3(0, 0, 0), 0.0f};
+                }
+
+                for (int i = 0; i < num_samples; i++)
+                {
+                    ray_packet p;
+                    for (int l = 0; l < n; l++)
+                    {
+                        state[l] = rng_init(x0 + l, y, frame_index * num_samples + i);
+                        float jitter_x, jitter_y;
+                        sample_2d(state[l], SAMPLE_JITTER, jitter_x, jitter_y);
+                        jitter_x -= 0.5f;
+                        jitter_y -= 0.5f;
+                        point3 frag_loc = cam.viewport_top_left + (x0 + l + jitter_x)*cam.delta_u
+                                                                + (y + jitter_y)*cam.delta_v;
+
+                        point3 ray_origin = cam.lookfrom;
+                        if (cam.defocus_angle > 0) {
+                            vec3 rand_disk = random_unit_disk(state[l]);
+                            ray_origin = cam.lookfrom + rand_disk[0] * cam.defocus_disc_u + rand_disk[1] * cam.defocus_disc_v;
+                        }
+
+                        p.set(l, ray_origin, frag_loc - ray_origin);
+                    }
+
+                    if (bounce_limit > 0) {
+                        hit_packet(p);
+                        counts.rays += n;
+                    }
+
+                    for (int l = 0; l < n; l++)
+                    {
+                        ray r;
+                        r.count = 0;
+                        r.origin = point3(p.ox[l], p.oy[l], p.oz[l]);
+                        r.dir = vec3(p.dx[l], p.dy[l], p.dz[l]);
+                        r.albedo = colour(1, 1, 1);
+                        r.weight = 1.0f;
+                        r.light = colour(0, 0, 0);
+                        r.pdf = 0.0f;
+                        r.normal = vec3(0, 0, 0);
+                        r.bounce = true;
+
+                        denoise_features f = start_features(r.dir);
+                        r.features = features ? &f : NULL;
+
+                        if (bounce_limit > 0) {
+                            hit h = make_hit(r.origin, r.dir, p.t[l], p.hit[l]);
+                            shade(h, r, state[l], counts);
+                        }
+
+                        while (r.bounce) {
+                            bounce(r, state[l], counts);
+                        }
+                        colour c = r.albedo + r.light;
+                        pixel_colour[l] += c;
+                        add_moments(c, pixel_moments[l]);
+                        add_features(f, pixel_features[l]);
+                    }
+                }
+
+                for (int l = 0; l < n; l++)
+                {
+                    size_t px = size_t(height - 1 - y) * stride + x0 + l;
+                    accum[px * 4] += pixel_colour[l][0];
+                    accum[px * 4 + 1] += pixel_colour[l][1];
+                    accum[px * 4 + 2] += pixel_colour[l][2];
+                    accum[px * 4 + 3] += float(num_samples);
+                    store_extras(px, pixel_moments[l], pixel_features[l]);
+                }
+            }
+        }
+    }
+
+    void render_tile_wavefront(int tx, int ty, path_counts &counts, wavefront_buffers &wb)
+    {
+        int x_begin = tx * TILE_SIZE;
+        int y_begin = ty * TILE_SIZE;
+        int w = std::min(x_begin + TILE_SIZE, width) - x_begin;
+        int h = std::min(y_begin + TILE_SIZE, height) - y_begin;
+
+        ray_queue &q = wb.queue;
+        if (int(q.ox.size()) < TILE_SIZE * TILE_SIZE * num_samples) {
+            q.reserve(TILE_SIZE * TILE_SIZE * num_samples);
+        }
+        wb.tile.assign(size_t(w) * h * num_samples, colour(0, 0, 0));
+        wb.features.resize(size_t(w) * h * num_samples);
+        wb.following.assign(size_t(w) * h * num_samples, features);
+
+        // Same random numbers as render_tile(), they only depend on the
+        // pixel, sample and bounce
+        int n = 0;
+        for (int y = y_begin; y < y_begin + h; y++)
+        {
+            for (int x = x_begin; x < x_begin + w; x++)
+            {
+                for (int i = 0; i < num_samples; i++, n++)
+                {
+                    rng_state state = rng_init(x, y, frame_index * num_samples + i);
+                    float jitter_x, jitter_y;
+                    sample_2d(state, SAMPLE_JITTER, jitter_x, jitter_y);
+                    jitter_x -= 0.5f;
+                    jitter_y -= 0.5f;
+                    point3 frag_loc = cam.viewport_top_left + (x + jitter_x)*cam.delta_u
+                                                            + (y + jitter_y)*cam.delta_v;
+
+                    point3 ray_origin = cam.lookfrom;
+                    if (cam.defocus_angle > 0) {
+                        vec3 rand_disk = random_unit_disk(state);
+                        ray_origin = cam.lookfrom + rand_disk[0] * cam.defocus_disc_u + rand_disk[1] * cam.defocus_disc_v;
+                    }
+                    vec3 dir = frag_loc - ray_origin;
+
+                    q.ox[n] = ray_origin[0];
+                    q.oy[n] = ray_origin[1];
+                    q.oz[n] = ray_origin[2];
+                    q.dx[n] = dir[0];
+                    q.dy[n] = dir[1];
+                    q.dz[n] = dir[2];
+                    q.r[n] = q.g[n] = q.b[n] = 1.0f;
+                    q.weight[n] = 1.0f;
+                    q.pdf[n] = 0.0f;
+                    q.nx[n] = q.ny[n] = q.nz[n] = 0.0f;
+                    q.pixel[n] = n; // (sample slot, pixel = n / num_samples)
+                    wb.features[n] = start_features(dir);
+                    q.count[n] = 0;
+                    q.state[n] = state;
+                }
+            }
+        }
+        q.size = (bounce_limit > 0) ? n : 0;
+
+        while (q.size > 0)
+        {
+            // Trace everything that's left, a packet at a time
+            for (int i = 0; i < q.size; i += RAY_PACKET_SIZE)
+            {
+                int num = std::min(RAY_PACKET_SIZE, q.size - i);
+                ray_packet p;
+                for (int l = 0; l < num; l++) {
+                    p.set(l, point3(q.ox[i + l], q.oy[i + l], q.oz[i + l]), vec3(q.dx[i + l], q.dy[i + l], q.dz[i + l]));
+                }
+                hit_packet(p);
+                for (int l = 0; l < num; l++) {
+                    q.t[i + l] = p.t[l];
+                    q.hit[i + l] = p.hit[l];
+                }
+            }
+            counts.rays += q.size;
+
+            // Misses pick up the sky and finish, hits get grouped by material
+            for (int i = 0; i < q.size; i++)
+            {
+                if (q.hit[i] < 0) {
+                    vec3 dir(q.dx[i], q.dy[i], q.dz[i]);
+                    colour albedo(q.r[i], q.g[i], q.b[i]);
+                    wb.tile[q.pixel[i]] += q.weight[i] * albedo * shade_sky(dir, albedo); // (as the shader does)
+                    if (wb.following[q.pixel[i]]) {
+                        wb.features[q.pixel[i]] = sky_features(wb.features[q.pixel[i]], dir);
+                    }
+                    q.key[i] = ray_queue::DEAD;
+                } else {
+                    int type = materials.materials[spheres.mat[q.hit[i]]].type;
+                    q.key[i] = uint8_t(std::min(std::max(type, 0), NUM_MATERIAL_GROUPS - 1));
+                }
+            }
+            q.sort(NUM_MATERIAL_GROUPS, wb.offsets, wb.scratch);
+
+            // Shade, then drop dead rays and group the rest by direction
+            for (int i = 0; i < q.size; i++)
+            {
+                ray r;
+                r.origin = point3(q.ox[i], q.oy[i], q.oz[i]);
+                r.dir = vec3(q.dx[i], q.dy[i], q.dz[i]);
+                r.albedo = colour(q.r[i], q.g[i], q.b[i]);
+                r.count = q.count[i];
+                r.weight = q.weight[i];
+                r.light = colour(0, 0, 0);
+                r.pdf = q.pdf[i];
+                r.normal = vec3(q.nx[i], q.ny[i], q.nz[i]);
+                r.bounce = true;
+                r.features = wb.following[q.pixel[i]] ? &wb.features[q.pixel[i]] : NULL;
+
+                hit hr = make_hit(r.origin, r.dir, q.t[i], q.hit[i]);
+                shade(hr, r, q.state[i], counts);
+                wb.following[q.pixel[i]] = r.features != NULL;
+
+                q.ox[i] = r.origin[0];
+                q.oy[i] = r.origin[1];
+                q.oz[i] = r.origin[2];
+                q.dx[i] = r.dir[0];
+                q.dy[i] = r.dir[1];
+                q.dz[i] = r.dir[2];
+                q.r[i] = r.albedo[0];
+                q.g[i] = r.albedo[1];
+                q.b[i] = r.albedo[2];
+                q.count[i] = r.count;
+                q.weight[i] = r.weight;
+                q.pdf[i] = r.pdf;
+                q.nx[i] = r.normal[0];
+                q.ny[i] = r.normal[1];
+                q.nz[i] = r.normal[2];
+                wb.tile[q.pixel[i]] += r.light;
+
+                if (!r.bounce) {
+                    wb.tile[q.pixel[i]] += r.albedo;
+                    q.key[i] = ray_queue::DEAD;
+                } else if (r.count >= bounce_limit) {
+                    q.key[i] = ray_queue::DEAD; // (black)
+                } else {
+                    q.key[i] = uint8_t((r.dir[0] < 0) | ((r.dir[1] < 0) << 1) | ((r.dir[2] < 0) << 2));
+                }
+            }
+            q.sort(8, wb.offsets, wb.scratch);
+        }
+
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                colour c(0, 0, 0);
+                float pixel_moments[2] = {0.0f, 0.0f};
+                denoise_features f = {colour(0, 0, 0), 0.0f, vec3(0, 0, 0), 0.0f};
+                for (int i = 0; i < num_samples; i++) {
+                    int slot = (y * w + x) * num_samples + i;
+                    c += wb.tile[slot];
+                    add_moments(wb.tile[slot], pixel_moments);
+                    add_features(wb.features[slot], f);
+                }
+
+                size_t px = size_t(height - 1 - (y_begin + y)) * stride + x_begin + x;
+                accum[px * 4] += c[0];
+                accum[px * 4 + 1] += c[1];
+                accum[px * 4 + 2] += c[2];
+                accum[px * 4 + 3] += float(num_samples);
+                store_extras(px, pixel_moments, f);
+            }
+        }
+    }
+
+    // Denoiser guides (see denoise.h): the albedo, normal and distance of
+    // the first diffuse surface or light a sample sees, following mirrors
+    // and glass on the way (and tinted by them) so what's seen in those
+    // keeps its edges. Same as the shader's follow_features().
+    static denoise_features start_features(const vec3 &dir)
+    {
+        return {colour(1, 1, 1), 0.0f, -unit_vector(dir), 0.0f};
+    }
+
+    static denoise_features sky_features(denoise_features f, const vec3 &dir)
+    {
+        f.normal = -unit_vector(dir);
+        f.depth = 0.0f;
+        return f;
+    }
+
+    // At hit h of ray r (before it moves on), clears r.features once done
+    void follow_features(const hit &h, ray &r) const
+    {
+        denoise_features &f = *r.features;
+        if (!h.hit) {
+            f = sky_features(f, r.dir);
+            r.features = NULL;
+            return;
+        }
+
+        const material &m = materials.materials[h.mat];
+        float distance = (h.point - r.origin).length();
+        if (f.hit_depth == 0.0f) {
+            f.hit_depth = distance;
+        }
+        f.normal = h.normal;
+        f.depth += distance;
+
+        if (m.type == METALLIC && m.param1 <= DENOISE_SPECULAR_FUZZ) {
+            f.albedo = f.albedo * m.albedo;
+        } else if (m.type != DIALECTRIC) {
+            if (m.type == LAMBERTIAN || m.type == METALLIC) {
+                f.albedo = f.albedo * m.albedo;
+            }
+            r.features = NULL;
+        }
+    }
+
+    static void add_features(const denoise_features &f, denoise_features &sum)
+    {
+        sum.albedo += f.albedo;
+        sum.depth += f.depth;
+        sum.normal += f.normal;
+        sum.hit_depth += f.hit_depth;
+    }
+
+    static void add_moments(const colour &c, float m[2])
+    {
+        float l = 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+        m[0] += l;
+        m[1] += l * l;
+    }
+
+    // Adds a pixel's moments and features to the buffers next to accum
+    void store_extras(size_t px, const float m[2], const denoise_features &f)
+    {
+        moments[px * 2] += m[0];
+        moments[px * 2 + 1] += m[1];
+        for (int c = 0; c < 3; c++) {
+            albedo[px * 4 + c] += f.albedo[c];
+            normals[px * 4 + c] += f.normal[c];
+        }
+        albedo[px * 4 + 3] += f.depth;
+        normals[px * 4 + 3] += f.hit_depth;
+    }
+
+    void bounce(ray &r, rng_state &state, path_counts &counts)
+    {
+        if (r.count >= bounce_limit) {
+            r.albedo = colour(0, 0, 0);
+            r.bounce = false;
+            return;
+        }
+
+        hit h = hit_any(r.origin, r.dir);
+        counts.rays++;
+        shade(h, r, state, counts);
+    }
+
+    void shade(hit &h, ray &r, rng_state &state, path_counts &counts) const
+    {
+        if (r.features) {
+            follow_features(h, r);
+        }
+
+        if (h.hit && materials.materials[h.mat].type == EMISSIVE) {
+            // Pick up its light and stop there
+            const material &m = materials.materials[h.mat];
+            r.light += r.weight * emitted_weight(h, r) * r.albedo * m.albedo * m.param1;
+            r.albedo = colour(0, 0, 0);
+            r.bounce = false;
+        } else if (h.hit) {
+            r.origin = h.point;
+            r.count += 1;
+            rng_set_bounce(state, r.count);
+            material_shade(h, r, state, counts);
+            if (r.bounce && r.count >= rr_depth) {
+                roulette(r, state, counts);
+            }
+        } else {
+            r.albedo = r.weight * r.albedo * shade_sky(r.dir, r.albedo); // (as the shader does)
+            r.bounce = false;
+        }
+    }
+
+    // MIS weight for a light the last bounce ran into (r.origin and
+    // r.normal are still where it came from). Light sampling could have
+    // found it too if the bounce was lambertian, so that gets the power
+    // heuristic weight, anything else (camera, mirror, glass) can only get
+    // here this way.
+    float emitted_weight(const hit &h, const ray &r) const
+    {
+        if (r.pdf <= 0.0f) return 1.0f;
+        int l = objects.objects[h.sphere].light;
+        if (l < 0) return 1.0f;
+
+        int s = h.sphere;
+        vec3 to_light = point3(spheres.cx[s], spheres.cy[s], spheres.cz[s]) - r.origin;
+        float one_minus_cos = sphere_cone(spheres.r2[s], dot(to_light, to_light));
+        if (one_minus_cos <= 0.0f) return 1.0f;
+
+        float light_pdf = materials.tree.pmf(l, r.origin, r.normal) / (2.0f * WARP_PI * one_minus_cos);
+        return r.pdf * r.pdf / (r.pdf * r.pdf + light_pdf * light_pdf);
+    }
+
+    // Next event estimation at a lambertian hit: pick a light with the
+    // light tree, aim at a point in the cone it covers and check nothing's
+    // in the way with an any hit shadow ray. Returns the light reflected
+    // towards the ray (before the path's throughput), weighted against the
+    // bounce finding the same light (see emitted_weight()).
+    colour sample_light(const hit &h, const material &m, rng_state &state, path_counts &counts) const
+    {
+        if (materials.lights.empty()) return colour(0, 0, 0);
+
+        float pmf;
+        int i = materials.tree.sample(h.point, h.normal, rand_float(state), pmf);
+        if (i < 0) return colour(0, 0, 0);
+        const light &l = materials.lights[i];
+
+        vec3 to_light = l.centre - h.point;
+        float d2 = dot(to_light, to_light);
+        float one_minus_cos = sphere_cone(l.radius * l.radius, d2);
+        if (one_minus_cos <= 0.0f) return colour(0, 0, 0);
+
+        float u, v;
+        sample_2d(state, SAMPLE_LIGHT, u, v);
+        vec3 axis = to_light / std::sqrt(d2);
+        vec3 dir;
+        uniform_cone(axis[0], axis[1], axis[2], one_minus_cos, u, v, dir[0], dir[1], dir[2]);
+
+        float cos_n = dot(dir, h.normal);
+        if (cos_n <= 0.0f) return colour(0, 0, 0);
+
+        // Distance to the light's surface, stop the shadow ray just short of it
+        float b = dot(dir, to_light);
+        float t = b - std::sqrt(std::max(0.0f, b*b - d2 + l.radius*l.radius));
+        counts.rays++;
+        if (hit_shadow(h.point, dir, 0.999f * t)) return colour(0, 0, 0);
+
+        float light_pdf = pmf / (2.0f * WARP_PI * one_minus_cos);
+        float bsdf_pdf = cos_n / WARP_PI;
+        float w = light_pdf * light_pdf / (light_pdf * light_pdf + bsdf_pdf * bsdf_pdf);
+        return (w * cos_n / (WARP_PI * light_pdf)) * m.albedo * l.emit;
+    }
+
+    // Russian roulette: carry on with probability = the path's throughput,
+    // and scale the survivors up by 1 / that so the average stays the same.
+    // The scaling is kept apart from albedo in weight since the sky gets
+    // multiplied by albedo twice (see shade_sky()).
+    static void roulette(ray &r, rng_state &state, path_counts &counts)
+    {
+        float p = std::min(1.0f, r.weight * std::max(r.albedo[0], std::max(r.albedo[1], r.albedo[2])));
+        if (rand_float(state) < p) {
+            r.weight /= p;
+            counts.survived++;
+        } else {
+            r.albedo = colour(0, 0, 0);
+            r.bounce = false;
+            counts.terminated++;
+        }
+    }
+
+    // hit_any() for a whole packet
+    void hit_packet(ray_packet &p) const
+    {
+        if (spheres.count <= BRUTE_FORCE_LIMIT) {
+            p.closest_hit(spheres, 0, spheres.count, p.active);
+        } else {
+            wide.closest_hit(spheres, p);
+        }
+    }
+
+    // Any hit for shadow rays, through the wide BVH like hit_any()
+    bool hit_shadow(const point3 &ray_orig, const vec3 &ray_dir, float t_max) const
+    {
+        if (spheres.count <= BRUTE_FORCE_LIMIT) {
+            return spheres.any_hit(0, spheres.count, ray_orig, ray_dir, t_max);
+        }
+        return wide.any_hit(spheres, ray_orig, ray_dir, t_max);
+    }
+
+    // Closest hit through the wide BVH (the GPU walks the binary one)
+    hit hit_any(const point3 &ray_orig, const vec3 &ray_dir) const
+    {
+        float t = 1e30f;
+        int s = -1;
+
+        if (spheres.count <= BRUTE_FORCE_LIMIT) {
+            s = spheres.closest_hit(0, spheres.count, ray_orig, ray_dir, t);
+        } else {
+            s = wide.closest_hit(spheres, ray_orig, ray_dir, t);
+        }
+
+        return make_hit(ray_orig, ray_dir, t, s);
+    }
+
+    // Fills in the hit record for sphere s at distance t (s < 0 is a miss)
+    hit make_hit(const point3 &ray_orig, const vec3 &ray_dir, float t, int s) const
+    {
+        hit h;
+        h.hit = false;
+        h.interior = false;
+        h.mat = 0;
+        h.sphere = s;
+
+        if (s >= 0)
+        {
+            point3 centre(spheres.cx[s], spheres.cy[s], spheres.cz[s]);
+            h.point = ray_orig + ray_dir*t;
+            h.normal = (h.point - centre) / spheres.radius[s];
+            if (dot(h.normal, ray_dir) >= 0) {
+                h.normal = -h.normal;
+                h.interior = true;
+            }
+            h.mat = spheres.mat[s];
+            h.hit = true;
+        }
+
+        return h;
+    }
+
+    void material_shade(hit &h, ray &r, rng_state &state, path_counts &counts) const
+    {
+        const material &m = materials.materials[h.mat];
+        r.pdf = 0.0f;
+
+        if (m.type == LAMBERTIAN) {
+            r.light += r.weight * r.albedo * sample_light(h, m, state, counts);
+            r.dir = random_cosine_direction(state, h.normal);
+            r.pdf = dot(r.dir, h.normal) / WARP_PI;
+            r.normal = h.normal;
+            r.bounce = true;
+            r.albedo = r.albedo * m.albedo;
+        } else if (m.type == METALLIC) {
+            r.dir = reflect(r.dir, unit_vector(h.normal));
+            r.dir = unit_vector(r.dir) + (m.param1 * random_unit_vector(state));
+            r.albedo = r.albedo * m.albedo;
+
+            r.bounce = dot(r.dir, h.normal) > 0;
+            if (!r.bounce) {
+                r.albedo = colour(0, 0, 0);
+            }
+        } else if (m.type == DIALECTRIC) {
+            float rel_refract_index = m.param1;
+            if (!h.interior) {
+                rel_refract_index = 1.0f / rel_refract_index;
+            }
+
+            vec3 unit_dir = unit_vector(r.dir);
+            vec3 unit_normal = unit_vector(h.normal);
+
+            float cos_theta = std::min(dot(-unit_dir, h.normal), 1.0f);
+            float sin_theta = std::sqrt(1.0f - cos_theta*cos_theta);
+            bool cannot_refract = rel_refract_index * sin_theta > 1.0f;
+
+            if (cannot_refract || shlick(cos_theta, rel_refract_index) > rand_float(state)) {
+                r.dir = reflect(unit_dir, unit_normal);
+            } else {
+                r.dir = refract(unit_dir, unit_normal, rel_refract_index);
+                // (grazing rays can still round to total internal reflection)
+                if (dot(r.dir, r.dir) == 0.0f) {
+                    r.dir = reflect(unit_dir, unit_normal);
+                }
+            }
+            r.bounce = true;
+        } else {
+            r.albedo = colour(1, 0, 0);
+            r.bounce = false;
+        }
+    }
+
+    static colour shade_sky(const vec3 &dir, const colour &albedo)
+    {
+        float a = 0.5f*(1.0f + unit_vector(dir)[1]);
+        return albedo * ((1.0f - a)*colour(1.0f, 1.0f, 1.0f) + a*colour(0.5f, 0.7f, 1.0f));
+    }
+
+    static float shlick(float cosine, float rel_refract_index)
+    {
+        float r0 = (1 - rel_refract_index) / (1 + rel_refract_index);
+        r0 = r0*r0;
+        return r0 + (1 - r0)*std::pow((1 - cosine), 5.0f);
+    }
+
+    // GLSL's reflect() and refract()
+    static vec3 reflect(const vec3 &i, const vec3 &n)
+    {
+        return i - 2.0f * dot(n, i) * n;
+    }
+
+    static vec3 refract(const vec3 &i, const vec3 &n, float eta)
+    {
+        float d = dot(n, i);
+        float k = 1.0f - eta*eta*(1.0f - d*d);
+        if (k < 0.0f) return vec3(0, 0, 0);
+        return eta*i - (eta*d + std::sqrt(k))*n;
+    }
+
+    // Same random numbers as the shader (see rng.h)
+    static float rand_float(rng_state &state)
+    {
+        return rng_next(state);
+    }
+
+    // Same quasi random points as sample_2d() in the shader
+    void sample_2d(const rng_state &state, uint32_t pair, float &u, float &v) const
+    {
+        uint32_t x, y;
+        if (seed_noise)
+        {
+            sobol_2d(state.sample_index, sampler_seed(state, pair, false), x, y);
+            int px = int(state.pixel & 0xFFFFu), py = int(state.pixel >> 16);
+            int d = int(2 * (state.bounce * SAMPLER_PAIRS + pair));
+            x += seed_noise->at(px + d*23, py + d*41);
+            y += seed_noise->at(px + (d + 1)*23, py + (d + 1)*41);
+        } else {
+            sobol_2d(state.sample_index, sampler_seed(state, pair, true), x, y);
+        }
+        u = rng_to_float(x);
+        v = rng_to_float(y);
+    }
+
+    // Closed form warps of the quasi random points (see warp.h)
+    vec3 random_unit_vector(const rng_state &state) const
+    {
+        float u, v;
+        sample_2d(state, SAMPLE_SCATTER, u, v);
+        vec3 p;
+        uniform_sphere(u, v, p[0], p[1], p[2]);
+        return p;
+    }
+
+    vec3 random_unit_disk(const rng_state &state) const
+    {
+        float u, v;
+        sample_2d(state, SAMPLE_LENS, u, v);
+        vec3 p;
+        concentric_disk(u, v, p[0], p[1]);
+        return p;
+    }
+
+    vec3 random_cosine_direction(const rng_state &state, const vec3 &normal) const
+    {
+        float u, v;
+        sample_2d(state, SAMPLE_SCATTER, u, v);
+        vec3 d;
+        cosine_hemisphere(normal[0], normal[1], normal[2], u, v, d[0], d[1], d[2]);
+        return d;
+    }
+};
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+// Edge avoiding a-trous wavelet filter ("Edge-Avoiding A-Trous Wavelet
+// Transform for fast Global Illumination Filtering", Dammertz et al. 2010,
+// with the variance guided luminance test from SVGF, Schied et al. 2017).
+// Shared by shaders/denoise.fs and cpu_denoiser.h like warp.h, so both
+// filter the same way.
+//
+// The input is the accumulated image divided by the albedo of the first
+// diffuse surface the camera sees (so colours don't get blurred, only the
+// lighting), along with the variance of each pixel's mean. Each iteration
+// is a 5x5 B3 spline kernel with its taps spread 2^i pixels apart, so five iterations
+// cover a 125 pixel wide footprint for 25 taps a pixel each. Taps only
+// count as much as the guides say they belong to the same surface:
+//
+//   - normals: their cosine, to a high power
+//   - depth: relative to the centre's, more allowed further out
+//   - luminance: within a few standard deviations of the centre's mean,
+//     so noisy pixels get smoothed a lot and converged ones hardly at all
+//
+// The variance is filtered along with the colour (with squared weights),
+// so later iterations get more careful as the noise comes down.
+
+#include "rng.h"
+
+#define DENOISE_ITERATIONS 5
+#define DENOISE_NORMAL_POWER 128.0f
+#define DENOISE_DEPTH_SIGMA 0.05f // relative depth change allowed per pixel of offset
+#define DENOISE_LUM_SIGMA 2.0f    // in standard deviations
+#define DENOISE_MIN_ALBEDO 0.01f  // (black surfaces would divide by 0)
+
+// The guides look through mirrors and glass (see follow_features() in
+// testFragment.fs), but metals rougher than this count as a surface
+#define DENOISE_SPECULAR_FUZZ 0.3f
+
+#ifdef __cplusplus
+#include <cmath>
+#define DENOISE_EXP std::exp
+#define DENOISE_POW std::pow
+#define DENOISE_ABS std::fabs
+#define DENOISE_SQRT std::sqrt
+#define DENOISE_MAX denoise_max
+
+inline float denoise_max(float a, float b)
+{
+  return a > b ? a : b;
+}
+#else
+#define DENOISE_EXP exp
+#define DENOISE_POW pow
+#define DENOISE_ABS abs
+#define DENOISE_SQRT sqrt
+#define DENOISE_MAX max
+#endif
+
+RNG_FN float denoise_luminance(float r, float g, float b)
+{
+  return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+// B3 spline taps for offsets -2 to 2
+RNG_FN float atrous_kernel(int i)
+{
+  if (i == 0) return 3.0f / 8.0f;
+  if (i == 1 || i == -1) return 1.0f / 4.0f;
+  return 1.0f / 16.0f;
+}
+
+// Weight of the tap at (dx, dy) * step from the centre pixel. cos_n is the
+// dot product of their normals, variance the centre's (prefiltered, see
+// denoise_variance()).
+RNG_FN float atrous_weight(int dx, int dy, int step, float cos_n, float depth_c, float depth_s,
+                           float lum_c, float lum_s, float variance)
+{
+  float w_n = DENOISE_POW(DENOISE_MAX(0.0f, cos_n), DENOISE_NORMAL_POWER);
+
+  // (the sky has depth 0, so it never mixes with anything else)
+  float offset = float(step) * DENOISE_SQRT(float(dx * dx + dy * dy));
+  float w_z = DENOISE_EXP(-DENOISE_ABS(depth_c - depth_s) / (DENOISE_DEPTH_SIGMA * depth_c * offset + 1e-3f));
+
+  float sigma_l = DENOISE_LUM_SIGMA * DENOISE_SQRT(DENOISE_MAX(0.0f, variance));
+  float w_l = DENOISE_EXP(-DENOISE_ABS(lum_c - lum_s) / (sigma_l + 1e-4f));
+
+  return atrous_kernel(dx) * atrous_kernel(dy) * w_n * w_z * w_l;
+}
+
+// 3x3 Gaussian weight for the variance prefilter (a single pixel's
+// estimate at a few samples is too noisy to steer the luminance test)
+RNG_FN float denoise_variance_kernel(int dx, int dy)
+{
+  float k[2];
+  k[0] = 0.5f;
+  k[1] = 0.25f;
+  return k[dx < 0 ? -dx : dx] * k[dy < 0 ? -dy : dy];
+}
+
+// Variance of the mean of a pixel's demodulated luminance, from the running
+// sums of luminance and its square over n samples
+RNG_FN float denoise_mean_variance(float sum, float sum_sq, float n, float albedo_lum)
+{
+  float mean = sum / n;
+  float variance = DENOISE_MAX(0.0f, sum_sq / n - mean * mean) / n;
+  float a = DENOISE_MAX(albedo_lum, DENOISE_MIN_ALBEDO);
+  return variance / (a * a);
+}
+
+#endif
@@ -2,16 +2,17 @@
 #define HITTABLE_H
 
 #include <iostream>
+#include <vector>
 
 class hittable
 {
     public:
-    int size;
+    int size; // number of floats pack() writes (always a multiple of 4, one vec4 per 4)
 
     hittable() : size{0} {};
     hittable(int my_size) : size{my_size} {};
 
-    virtual void add(unsigned int glBuffer, int offset) const = 0;
+    virtual void pack(std::vector<float> &data) const = 0;
 };
 
-#endif
\ No newline at end of file
+#endif
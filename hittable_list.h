@@ -1,23 +1,42 @@
 #ifndef HITTABLE_LIST_H
 #define HITTABLE_LIST_H
 
+#include <vector>
+
 #include "hittable.h"
+#include "sphere.h"
+#include "scene_buffer.h"
 
 class hittable_list
 {   
     public:
 
     int num;
-    int offset;
+    std::vector<sphere> objects;
+    scene_buffer buffer;
 
-    hittable_list() : num{0}, offset{0} {};
+    hittable_list() : num{0} {};
 
-    void add(unsigned int ubo, hittable &h)
+    // Keeps a copy, so s (and its material) don't need to outlive the list
+    // (the material does need to have been added to a material_list first)
+    void add(const sphere &s)
     {
-        h.add(ubo, offset);
-        offset += h.size;
+        sphere copy = s;
+        copy.mat_id = s.mat->id;
+        copy.mat = nullptr;
+        objects.push_back(copy);
         num += 1;
     }
+
+    // Pack every object and send them to the GPU
+    void upload()
+    {
+        std::vector<float> data;
+        for (const sphere &s : objects) {
+            s.pack(data);
+        }
+        buffer.upload(data);
+    }
 };
 
-#endif
\ No newline at end of file
+#endif
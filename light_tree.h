@@ -0,0 +1,292 @@
+#ifndef LIGHT_TREE_H
+#define LIGHT_TREE_H
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "vec3.h"
+#include "bvh.h"
+#include "scene_buffer.h"
+
+// A sphere with an EMISSIVE material, for sampling lights directly
+struct light {
+    point3 centre;
+    float radius;
+    colour emit; // colour * strength
+    int sphere;  // index in the hittable_list
+};
+
+// Bounding volume hierarchy over the lights, for picking which one to
+// sample at a shading point (after "Importance Sampling of Many Lights
+// with Adaptive Tree Splitting", Conty Estevez & Kulla 2018, without the
+// splitting).
+//
+// Every node has a bounding sphere and the total power of the lights under
+// it. Picking a light walks down from the root, taking each child with a
+// chance proportional to its importance(): power over distance squared,
+// times how far the cone it covers (seen from the shading point) comes up
+// above the surface. Spheres shine every way, so there's no emission cone
+// per node like the paper has, only that one. The chance of the light that
+// comes out is the product of the choices, so far away and back facing
+// lights hardly ever get a shadow ray, and picking one costs the depth of
+// the tree instead of the number of lights.
+//
+// Building reorders the lights so every node covers a contiguous run of
+// them. That's how pmf() finds a given light's chance again: follow
+// whichever child's run has it.
+
+struct light_node {
+    point3 centre; // bounding sphere (the light itself for leaves)
+    float radius;
+    float power;
+    int right;     // second child (the first is the next node), -1 for leaves
+    int first;     // first light under this node
+};
+
+class light_tree
+{
+    public:
+
+    static const int NUM_BINS = 12;
+
+    std::vector<light_node> nodes;
+    scene_buffer buffer;
+    int depth;
+
+    light_tree() : depth{0} {};
+
+    // One leaf per light. Puts lights in leaf order.
+    void build(std::vector<light> &lights)
+    {
+        nodes.clear();
+        depth = 0;
+        if (lights.empty()) return;
+
+        nodes.reserve(2 * lights.size());
+        build_recursive(lights, 0, int(lights.size()), 1);
+    }
+
+    // Two vec4s per node: (centre, radius), (power, right, first, 0), with
+    // right and first stored bit for bit like the BVH's (see int_bits())
+    void upload()
+    {
+        std::vector<float> data;
+        data.reserve(nodes.size() * 8);
+        for (const light_node &n : nodes) {
+            data.insert(data.end(), {n.centre[0], n.centre[1], n.centre[2], n.radius});
+            data.insert(data.end(), {n.power, int_bits(n.right), int_bits(n.first), 0.0f});
+        }
+        buffer.upload(data);
+    }
+
+    // How much light the node could send to point p on a surface facing n,
+    // up to a constant (the shader's light_importance() is the same)
+    static float importance(const light_node &node, const point3 &p, const vec3 &n)
+    {
+        vec3 w = node.centre - p;
+        float d2 = dot(w, w);
+        float r2 = node.radius * node.radius;
+        if (d2 <= r2) return node.power / r2; // inside its bounds, could be anywhere
+
+        // Angle from the normal to the centre, less the cone's half angle
+        float cos_n = dot(n, w) / std::sqrt(d2);
+        float sin2_u = r2 / d2;
+        float cos_u = std::sqrt(1.0f - sin2_u);
+        float cos_term = 1.0f;
+        if (cos_n < cos_u) {
+            float sin_n = std::sqrt(std::max(0.0f, 1.0f - cos_n * cos_n));
+            cos_term = std::max(0.0f, cos_n * cos_u + sin_n * std::sqrt(sin2_u));
+        }
+        return node.power * cos_term / d2;
+    }
+
+    // Picks a light for point p facing n, using u in [0, 1) for every choice
+    // on the way down (rescaled after each one). Returns its index, or -1 if
+    // none of them can reach p, and sets pmf to the chance of picking it.
+    int sample(const point3 &p, const vec3 &n, float u, float &pmf) const
+    {
+        pmf = 1.0f;
+        if (nodes.empty()) return -1;
+
+        int i = 0;
+        while (nodes[i].right >= 0)
+        {
+            float left = importance(nodes[i + 1], p, n);
+            float right = importance(nodes[nodes[i].right], p, n);
+            if (left + right <= 0.0f) return -1;
+
+            float p_left = left / (left + right);
+            if (u < p_left) {
+                u = u / p_left;
+                pmf *= p_left;
+                i = i + 1;
+            } else {
+                u = (u - p_left) / (1.0f - p_left);
+                pmf *= 1.0f - p_left;
+                i = nodes[i].right;
+            }
+            u = std::min(u, 0x1.fffffep-1f);
+        }
+        return nodes[i].first;
+    }
+
+    // The chance sample() picks light l for point p facing n
+    float pmf(int l, const point3 &p, const vec3 &n) const
+    {
+        if (nodes.empty()) return 0.0f;
+
+        float pmf = 1.0f;
+        int i = 0;
+        while (nodes[i].right >= 0)
+        {
+            float left = importance(nodes[i + 1], p, n);
+            float right = importance(nodes[nodes[i].right], p, n);
+            if (left + right <= 0.0f) return 0.0f;
+
+            if (l < nodes[nodes[i].right].first) {
+                pmf *= left / (left + right);
+                i = i + 1;
+            } else {
+                pmf *= right / (left + right);
+                i = nodes[i].right;
+            }
+        }
+        return pmf;
+    }
+
+    private:
+
+    static float power_of(const light &l)
+    {
+        // Seen from far away a sphere sends out radiance * its cross section
+        float luminance = 0.2126f * l.emit[0] + 0.7152f * l.emit[1] + 0.0722f * l.emit[2];
+        return luminance * l.radius * l.radius;
+    }
+
+    static aabb bounds_of(const light &l)
+    {
+        aabb b;
+        b.grow(l.centre - vec3(l.radius, l.radius, l.radius));
+        b.grow(l.centre + vec3(l.radius, l.radius, l.radius));
+        return b;
+    }
+
+    // Builds the subtree over lights[begin, end) and returns its node index
+    int build_recursive(std::vector<light> &lights, int begin, int end, int level)
+    {
+        depth = std::max(depth, level);
+
+        int index = int(nodes.size());
+        nodes.push_back(light_node());
+
+        if (end - begin == 1) {
+            const light &l = lights[begin];
+            nodes[index].centre = l.centre;
+            nodes[index].radius = l.radius;
+            nodes[index].power = power_of(l);
+            nodes[index].right = -1;
+            nodes[index].first = begin;
+            return index;
+        }
+
+        aabb node_bounds;
+        float power = 0.0f;
+        for (int i = begin; i < end; i++) {
+            node_bounds.grow(bounds_of(lights[i]));
+            power += power_of(lights[i]);
+        }
+
+        int mid = split(lights, begin, end);
+        build_recursive(lights, begin, mid, level + 1);
+        int right = build_recursive(lights, mid, end, level + 1);
+
+        nodes[index].centre = 0.5f * (node_bounds.min + node_bounds.max);
+        nodes[index].radius = 0.5f * (node_bounds.max - node_bounds.min).length();
+        nodes[index].power = power;
+        nodes[index].right = right;
+        nodes[index].first = begin;
+        return index;
+    }
+
+    // Binned like bvh::split(), but each side's area is weighted by its
+    // power rather than its count: bright clusters want tight bounds, dim
+    // ones barely matter. Partitions lights[begin, end) and returns the
+    // split point.
+    int split(std::vector<light> &lights, int begin, int end)
+    {
+        int count = end - begin;
+
+        aabb centroid_bounds;
+        for (int i = begin; i < end; i++) {
+            centroid_bounds.grow(lights[i].centre);
+        }
+
+        vec3 extent = centroid_bounds.max - centroid_bounds.min;
+        int axis = 0;
+        if (extent[1] > extent[axis]) axis = 1;
+        if (extent[2] > extent[axis]) axis = 2;
+
+        if (extent[axis] <= 0.0f) {
+            return begin + count / 2;
+        }
+
+        aabb bin_bounds[NUM_BINS];
+        float bin_power[NUM_BINS] = {0.0f};
+        int bin_count[NUM_BINS] = {0};
+        float scale = NUM_BINS / extent[axis];
+
+        auto bin_of = [&](const light &l) {
+            int b = int((l.centre[axis] - centroid_bounds.min[axis]) * scale);
+            return std::min(b, NUM_BINS - 1);
+        };
+
+        for (int i = begin; i < end; i++) {
+            int b = bin_of(lights[i]);
+            bin_bounds[b].grow(bounds_of(lights[i]));
+            bin_power[b] += power_of(lights[i]);
+            bin_count[b] += 1;
+        }
+
+        float right_cost[NUM_BINS];
+        int right_count[NUM_BINS];
+        aabb acc;
+        float acc_power = 0.0f;
+        int n = 0;
+        for (int b = NUM_BINS - 1; b > 0; b--) {
+            acc.grow(bin_bounds[b]);
+            acc_power += bin_power[b];
+            n += bin_count[b];
+            right_cost[b] = acc.area() * acc_power;
+            right_count[b] = n;
+        }
+
+        float best_cost = 1e30f;
+        int best_plane = -1;
+        acc = aabb();
+        acc_power = 0.0f;
+        n = 0;
+        for (int b = 0; b < NUM_BINS - 1; b++) {
+            acc.grow(bin_bounds[b]);
+            acc_power += bin_power[b];
+            n += bin_count[b];
+            if (n == 0 || right_count[b + 1] == 0) continue;
+
+            float cost = acc.area() * acc_power + right_cost[b + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_plane = b;
+            }
+        }
+
+        if (best_plane < 0) {
+            return begin + count / 2;
+        }
+
+        auto mid_it = std::partition(lights.begin() + begin, lights.begin() + end,
+                                     [&](const light &l) { return bin_of(l) <= best_plane; });
+        return int(mid_it - lights.begin());
+    }
+};
+
+#endif
@@ -1,8 +1,7 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
-#include <glad/glad.h>
-#include <SDL2/SDL.h>
+#include <vector>
 
 #include "vec3.h"
 
@@ -10,7 +9,8 @@ enum MATERIAL_TYPE {
   NOTHING,
   LAMBERTIAN,
   METALLIC,
-  DIALECTRIC
+  DIALECTRIC,
+  EMISSIVE
 }; 
 
 class material {
@@ -19,29 +19,17 @@ class material {
     int type;
     vec3 albedo;
     float param1;
-    const int size = 32;
+    const int size = 8; // floats written by pack()
 
     material() : id{0} {std::cout << "ho!" << std::endl;};
     material(int my_type, vec3 my_albedo) : type{my_type}, albedo{my_albedo} {};
     material(int my_type, float my_param) : type{my_type}, param1{my_param} {};
     material(int my_type, vec3 my_albedo, float my_param) : type{my_type}, albedo{my_albedo}, param1{my_param} {};
 
-    void add(unsigned int glBuffer, int offset) {
-        glBindBuffer(GL_UNIFORM_BUFFER, glBuffer);
-        glBufferSubData(GL_UNIFORM_BUFFER, offset, sizeof(int), &id);
-        glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
-        glBindBuffer(GL_UNIFORM_BUFFER, glBuffer);
-        glBufferSubData(GL_UNIFORM_BUFFER, offset + 4, sizeof(int), &type);
-        glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
-        glBindBuffer(GL_UNIFORM_BUFFER, glBuffer);
-        glBufferSubData(GL_UNIFORM_BUFFER, offset + 8, sizeof(float), &param1);
-        glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
-        glBindBuffer(GL_UNIFORM_BUFFER, glBuffer);
-        glBufferSubData(GL_UNIFORM_BUFFER, offset + 16, sizeof(float) * 3, &albedo);
-        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    // Two vec4s: (albedo, param1), (type, id, 0, 0)
+    void pack(std::vector<float> &data) const {
+        data.insert(data.end(), {albedo[0], albedo[1], albedo[2], param1});
+        data.insert(data.end(), {float(type), float(id), 0.0f, 0.0f});
         return;
     }
 };
@@ -64,4 +52,12 @@ class dialectric : public material {
     dialectric(float rel_refract_index) : material(DIALECTRIC, rel_refract_index) {};
 };
 
+// Gives off colour * strength (so colour can stay in 0..1), and doesn't
+// reflect anything
+class emissive : public material {
+    public:
+
+    emissive(vec3 my_colour, float strength) : material(EMISSIVE, my_colour, strength) {};
+};
+
 #endif
\ No newline at end of file
@@ -1,24 +1,80 @@
 #ifndef MATERIAL_LIST_H
 #define MATERIAL_LIST_H
 
+#include <vector>
+
 #include "material.h"
+#include "hittable_list.h"
+#include "light_tree.h"
+#include "scene_buffer.h"
 
 class material_list
 {   
     public:
 
     int num;
-    int offset;
+    std::vector<material> materials;
+    scene_buffer buffer;
+
+    std::vector<light> lights;
+    scene_buffer light_buffer;
+    light_tree tree;
 
-    material_list() : num{0}, offset{0} {};
+    material_list() : num{0} {};
 
-    void add(unsigned int ubo, material &m)
+    void add(material &m)
     {
         m.id = num; // Set material id sequentially (as they are added)
-        m.add(ubo, offset);
-        offset += m.size;
+        materials.push_back(m);
         num += 1;
     }
+
+    // Finds the spheres with emissive materials and builds the light tree
+    // over them, then tells each sphere which light it is. Sphere indexes
+    // have to be final, so call this after the BVH has put them in order
+    // (and before uploading the spheres).
+    void build_lights(hittable_list &objects)
+    {
+        lights.clear();
+        for (int i = 0; i < int(objects.objects.size()); i++)
+        {
+            sphere &s = objects.objects[i];
+            s.light = -1;
+            const material &m = materials[s.mat_id];
+            if (m.type != EMISSIVE) continue;
+
+            light l;
+            l.centre = s.origin;
+            l.radius = s.radius;
+            l.emit = m.albedo * m.param1;
+            l.sphere = i;
+            lights.push_back(l);
+        }
+
+        tree.build(lights);
+        for (int i = 0; i < int(lights.size()); i++) {
+            objects.objects[lights[i].sphere].light = i;
+        }
+    }
+
+    // Pack every material (and light, and the light tree) and send them to the GPU
+    void upload()
+    {
+        std::vector<float> data;
+        for (const material &m : materials) {
+            m.pack(data);
+        }
+        buffer.upload(data);
+
+        // Two vec4s per light: (centre, radius), (emit, sphere)
+        std::vector<float> light_data;
+        for (const light &l : lights) {
+            light_data.insert(light_data.end(), {l.centre[0], l.centre[1], l.centre[2], l.radius});
+            light_data.insert(light_data.end(), {l.emit[0], l.emit[1], l.emit[2], float(l.sphere)});
+        }
+        light_buffer.upload(light_data);
+        tree.upload();
+    }
 };
 
-#endif
\ No newline at end of file
+#endif
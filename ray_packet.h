@@ -0,0 +1,273 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include <cstdint>
+
+#include "vec3.h"
+#include "bvh.h"
+#include "sphere_soa.h"
+
+// A bundle of rays traced together, one per SIMD lane.
+//
+// Camera rays for neighbouring pixels go through the same BVH nodes and hit
+// the same spheres, so rather than test one ray against several spheres
+// (sphere_soa::closest_hit) the packet tests one box or sphere against all
+// of its rays at once. Lanes are switched on and off with a bitmask: empty
+// lanes at the edge of a tile, and rays that missed a node.
+
+#define RAY_PACKET_SIZE SPHERE_SIMD_WIDTH
+
+class ray_packet
+{
+    public:
+
+    alignas(64) float ox[RAY_PACKET_SIZE];
+    alignas(64) float oy[RAY_PACKET_SIZE];
+    alignas(64) float oz[RAY_PACKET_SIZE];
+    alignas(64) float dx[RAY_PACKET_SIZE];
+    alignas(64) float dy[RAY_PACKET_SIZE];
+    alignas(64) float dz[RAY_PACKET_SIZE];
+    alignas(64) float inv_dx[RAY_PACKET_SIZE];
+    alignas(64) float inv_dy[RAY_PACKET_SIZE];
+    alignas(64) float inv_dz[RAY_PACKET_SIZE];
+    alignas(64) float a[RAY_PACKET_SIZE]; // dot(dir, dir)
+    alignas(64) float inv_a[RAY_PACKET_SIZE];
+
+    // Closest hit so far and the sphere it was on (-1 for none)
+    alignas(64) float t[RAY_PACKET_SIZE];
+    alignas(64) int hit[RAY_PACKET_SIZE];
+
+    uint32_t active;
+
+    ray_packet() : active{0}
+    {
+        for (int l = 0; l < RAY_PACKET_SIZE; l++) {
+            ox[l] = oy[l] = oz[l] = 0.0f;
+            dx[l] = dy[l] = dz[l] = 1.0f;
+            inv_dx[l] = inv_dy[l] = inv_dz[l] = 1.0f;
+            a[l] = inv_a[l] = 1.0f;
+            t[l] = 1e30f;
+            hit[l] = -1;
+        }
+    }
+
+    void set(int lane, const point3 &orig, const vec3 &dir)
+    {
+        ox[lane] = orig[0];
+        oy[lane] = orig[1];
+        oz[lane] = orig[2];
+        dx[lane] = dir[0];
+        dy[lane] = dir[1];
+        dz[lane] = dir[2];
+        inv_dx[lane] = 1.0f / dir[0];
+        inv_dy[lane] = 1.0f / dir[1];
+        inv_dz[lane] = 1.0f / dir[2];
+        a[lane] = dot(dir, dir);
+        inv_a[lane] = 1.0f / a[lane];
+        t[lane] = 1e30f;
+        hit[lane] = -1;
+        active |= 1u << lane;
+    }
+
+    // Which of the lanes in mask hit the box at 0.001 < t < (closest hit so far)
+    uint32_t hit_box(const aabb &b, uint32_t mask) const
+    {
+#if RAY_PACKET_SIZE == 16
+        __m512 t_enter = _mm512_set1_ps(0.001f);
+        __m512 t_exit = _mm512_load_ps(t);
+        slab_512(b.min[0], b.max[0], ox, inv_dx, t_enter, t_exit);
+        slab_512(b.min[1], b.max[1], oy, inv_dy, t_enter, t_exit);
+        slab_512(b.min[2], b.max[2], oz, inv_dz, t_enter, t_exit);
+        return mask & _mm512_cmp_ps_mask(t_enter, t_exit, _CMP_LE_OQ);
+#elif RAY_PACKET_SIZE == 8
+        __m256 t_enter = _mm256_set1_ps(0.001f);
+        __m256 t_exit = _mm256_load_ps(t);
+        slab_256(b.min[0], b.max[0], ox, inv_dx, t_enter, t_exit);
+        slab_256(b.min[1], b.max[1], oy, inv_dy, t_enter, t_exit);
+        slab_256(b.min[2], b.max[2], oz, inv_dz, t_enter, t_exit);
+        return mask & uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ)));
+#elif RAY_PACKET_SIZE == 4
+        __m128 t_enter = _mm_set1_ps(0.001f);
+        __m128 t_exit = _mm_load_ps(t);
+        slab_128(b.min[0], b.max[0], ox, inv_dx, t_enter, t_exit);
+        slab_128(b.min[1], b.max[1], oy, inv_dy, t_enter, t_exit);
+        slab_128(b.min[2], b.max[2], oz, inv_dz, t_enter, t_exit);
+        return mask & uint32_t(_mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit)));
+#else
+        uint32_t result = 0;
+        for (int l = 0; l < RAY_PACKET_SIZE; l++) {
+            if (!(mask & (1u << l))) continue;
+            float o[3] = {ox[l], oy[l], oz[l]};
+            float inv[3] = {inv_dx[l], inv_dy[l], inv_dz[l]};
+            float t_enter = 0.001f;
+            float t_exit = t[l];
+            for (int k = 0; k < 3; k++) {
+                float t0 = (b.min[k] - o[k]) * inv[k];
+                float t1 = (b.max[k] - o[k]) * inv[k];
+                t_enter = std::max(t_enter, std::min(t0, t1));
+                t_exit = std::min(t_exit, std::max(t0, t1));
+            }
+            if (t_enter <= t_exit) result |= 1u << l;
+        }
+        return result;
+#endif
+    }
+
+    // Tests the spheres in [begin, end) against the lanes in mask, keeping
+    // the closest hit per lane (same rules as sphere_soa::closest_hit)
+    void closest_hit(const sphere_soa &s, int begin, int end, uint32_t mask)
+    {
+#if RAY_PACKET_SIZE == 16
+        const __m512 vox = _mm512_load_ps(ox), voy = _mm512_load_ps(oy), voz = _mm512_load_ps(oz);
+        const __m512 vdx = _mm512_load_ps(dx), vdy = _mm512_load_ps(dy), vdz = _mm512_load_ps(dz);
+        const __m512 va = _mm512_load_ps(a), vinv_a = _mm512_load_ps(inv_a);
+        const __m512 eps = _mm512_set1_ps(0.001f);
+        const __mmask16 lanes = __mmask16(mask);
+
+        __m512 best_t = _mm512_load_ps(t);
+        __m512i best_i = _mm512_load_si512((const __m512i*)hit);
+
+        for (int j = begin; j < end; j++)
+        {
+            __m512 ocx = _mm512_sub_ps(_mm512_set1_ps(s.cx[j]), vox);
+            __m512 ocy = _mm512_sub_ps(_mm512_set1_ps(s.cy[j]), voy);
+            __m512 ocz = _mm512_sub_ps(_mm512_set1_ps(s.cz[j]), voz);
+
+            __m512 h = _mm512_fmadd_ps(vdx, ocx, _mm512_fmadd_ps(vdy, ocy, _mm512_mul_ps(vdz, ocz)));
+            __m512 c = _mm512_fmadd_ps(ocx, ocx, _mm512_fmadd_ps(ocy, ocy, _mm512_fmsub_ps(ocz, ocz, _mm512_set1_ps(s.r2[j]))));
+            __m512 disc = _mm512_fmsub_ps(h, h, _mm512_mul_ps(va, c));
+
+            __mmask16 valid = lanes & _mm512_cmp_ps_mask(disc, _mm512_setzero_ps(), _CMP_GE_OQ);
+            if (!valid) continue;
+
+            __m512 sq = _mm512_sqrt_ps(_mm512_max_ps(disc, _mm512_setzero_ps()));
+            __m512 t0 = _mm512_mul_ps(_mm512_sub_ps(h, sq), vinv_a);
+            __m512 t1 = _mm512_mul_ps(_mm512_add_ps(h, sq), vinv_a);
+            __m512 tj = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(t0, eps, _CMP_GE_OQ), t1, t0);
+
+            valid &= _mm512_cmp_ps_mask(tj, eps, _CMP_GE_OQ) & _mm512_cmp_ps_mask(tj, best_t, _CMP_LT_OQ);
+
+            best_t = _mm512_mask_blend_ps(valid, best_t, tj);
+            best_i = _mm512_mask_blend_epi32(valid, best_i, _mm512_set1_epi32(j));
+        }
+
+        _mm512_store_ps(t, best_t);
+        _mm512_store_si512((__m512i*)hit, best_i);
+#elif RAY_PACKET_SIZE == 8
+        const __m256 vox = _mm256_load_ps(ox), voy = _mm256_load_ps(oy), voz = _mm256_load_ps(oz);
+        const __m256 vdx = _mm256_load_ps(dx), vdy = _mm256_load_ps(dy), vdz = _mm256_load_ps(dz);
+        const __m256 va = _mm256_load_ps(a), vinv_a = _mm256_load_ps(inv_a);
+        const __m256 eps = _mm256_set1_ps(0.001f);
+        const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+        const __m256 lanes = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(int(mask)), bits), bits));
+
+        __m256 best_t = _mm256_load_ps(t);
+        __m256 best_i = _mm256_castsi256_ps(_mm256_load_si256((const __m256i*)hit));
+
+        for (int j = begin; j < end; j++)
+        {
+            __m256 ocx = _mm256_sub_ps(_mm256_set1_ps(s.cx[j]), vox);
+            __m256 ocy = _mm256_sub_ps(_mm256_set1_ps(s.cy[j]), voy);
+            __m256 ocz = _mm256_sub_ps(_mm256_set1_ps(s.cz[j]), voz);
+
+            __m256 h = _mm256_add_ps(_mm256_mul_ps(vdx, ocx), _mm256_add_ps(_mm256_mul_ps(vdy, ocy), _mm256_mul_ps(vdz, ocz)));
+            __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_add_ps(_mm256_mul_ps(ocy, ocy), _mm256_mul_ps(ocz, ocz))),
+                                     _mm256_set1_ps(s.r2[j]));
+            __m256 disc = _mm256_sub_ps(_mm256_mul_ps(h, h), _mm256_mul_ps(va, c));
+
+            __m256 valid = _mm256_and_ps(lanes, _mm256_cmp_ps(disc, _mm256_setzero_ps(), _CMP_GE_OQ));
+            if (_mm256_testz_ps(valid, valid)) continue;
+
+            __m256 sq = _mm256_sqrt_ps(_mm256_max_ps(disc, _mm256_setzero_ps()));
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(h, sq), vinv_a);
+            __m256 t1 = _mm256_mul_ps(_mm256_add_ps(h, sq), vinv_a);
+            __m256 tj = _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, eps, _CMP_GE_OQ));
+
+            valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(tj, eps, _CMP_GE_OQ), _mm256_cmp_ps(tj, best_t, _CMP_LT_OQ)));
+
+            best_t = _mm256_blendv_ps(best_t, tj, valid);
+            best_i = _mm256_blendv_ps(best_i, _mm256_castsi256_ps(_mm256_set1_epi32(j)), valid);
+        }
+
+        _mm256_store_ps(t, best_t);
+        _mm256_store_si256((__m256i*)hit, _mm256_castps_si256(best_i));
+#elif RAY_PACKET_SIZE == 4
+        const __m128 vox = _mm_load_ps(ox), voy = _mm_load_ps(oy), voz = _mm_load_ps(oz);
+        const __m128 vdx = _mm_load_ps(dx), vdy = _mm_load_ps(dy), vdz = _mm_load_ps(dz);
+        const __m128 va = _mm_load_ps(a), vinv_a = _mm_load_ps(inv_a);
+        const __m128 eps = _mm_set1_ps(0.001f);
+        const __m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+        const __m128 lanes = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(int(mask)), bits), bits));
+
+        __m128 best_t = _mm_load_ps(t);
+        __m128 best_i = _mm_castsi128_ps(_mm_load_si128((const __m128i*)hit));
+
+        for (int j = begin; j < end; j++)
+        {
+            __m128 ocx = _mm_sub_ps(_mm_set1_ps(s.cx[j]), vox);
+            __m128 ocy = _mm_sub_ps(_mm_set1_ps(s.cy[j]), voy);
+            __m128 ocz = _mm_sub_ps(_mm_set1_ps(s.cz[j]), voz);
+
+            __m128 h = _mm_add_ps(_mm_mul_ps(vdx, ocx), _mm_add_ps(_mm_mul_ps(vdy, ocy), _mm_mul_ps(vdz, ocz)));
+            __m128 c = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_add_ps(_mm_mul_ps(ocy, ocy), _mm_mul_ps(ocz, ocz))),
+                                  _mm_set1_ps(s.r2[j]));
+            __m128 disc = _mm_sub_ps(_mm_mul_ps(h, h), _mm_mul_ps(va, c));
+
+            __m128 valid = _mm_and_ps(lanes, _mm_cmpge_ps(disc, _mm_setzero_ps()));
+            if (_mm_movemask_ps(valid) == 0) continue;
+
+            __m128 sq = _mm_sqrt_ps(_mm_max_ps(disc, _mm_setzero_ps()));
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(h, sq), vinv_a);
+            __m128 t1 = _mm_mul_ps(_mm_add_ps(h, sq), vinv_a);
+            __m128 tj = _mm_blendv_ps(t1, t0, _mm_cmpge_ps(t0, eps));
+
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(tj, eps), _mm_cmplt_ps(tj, best_t)));
+
+            best_t = _mm_blendv_ps(best_t, tj, valid);
+            best_i = _mm_blendv_ps(best_i, _mm_castsi128_ps(_mm_set1_epi32(j)), valid);
+        }
+
+        _mm_store_ps(t, best_t);
+        _mm_store_si128((__m128i*)hit, _mm_castps_si128(best_i));
+#else
+        for (int l = 0; l < RAY_PACKET_SIZE; l++) {
+            if (!(mask & (1u << l))) continue;
+            int h = s.closest_hit_scalar(begin, end, point3(ox[l], oy[l], oz[l]), vec3(dx[l], dy[l], dz[l]), t[l]);
+            if (h >= 0) hit[l] = h;
+        }
+#endif
+    }
+
+    private:
+
+#if RAY_PACKET_SIZE == 16
+    static void slab_512(float lo, float hi, const float *o, const float *inv, __m512 &t_enter, __m512 &t_exit)
+    {
+        __m512 vo = _mm512_load_ps(o), vinv = _mm512_load_ps(inv);
+        __m512 t0 = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(lo), vo), vinv);
+        __m512 t1 = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(hi), vo), vinv);
+        t_enter = _mm512_max_ps(t_enter, _mm512_min_ps(t0, t1));
+        t_exit = _mm512_min_ps(t_exit, _mm512_max_ps(t0, t1));
+    }
+#elif RAY_PACKET_SIZE == 8
+    static void slab_256(float lo, float hi, const float *o, const float *inv, __m256 &t_enter, __m256 &t_exit)
+    {
+        __m256 vo = _mm256_load_ps(o), vinv = _mm256_load_ps(inv);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(lo), vo), vinv);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(hi), vo), vinv);
+        t_enter = _mm256_max_ps(t_enter, _mm256_min_ps(t0, t1));
+        t_exit = _mm256_min_ps(t_exit, _mm256_max_ps(t0, t1));
+    }
+#elif RAY_PACKET_SIZE == 4
+    static void slab_128(float lo, float hi, const float *o, const float *inv, __m128 &t_enter, __m128 &t_exit)
+    {
+        __m128 vo = _mm_load_ps(o), vinv = _mm_load_ps(inv);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(lo), vo), vinv);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(hi), vo), vinv);
+        t_enter = _mm_max_ps(t_enter, _mm_min_ps(t0, t1));
+        t_exit = _mm_min_ps(t_exit, _mm_max_ps(t0, t1));
+    }
+#endif
+};
+
+#endif
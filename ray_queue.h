@@ -0,0 +1,124 @@
+#ifndef RAY_QUEUE_H
+#define RAY_QUEUE_H
+
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+#include "rng.h"
+
+// Structure of arrays list of the paths still alive in a wavefront pass.
+//
+// Each bounce the whole queue is traced, then reordered with sort(): rays
+// get a small integer key (material type, direction octant, ...) and come
+// out grouped by key, with dead rays (key == DEAD) dropped on the way.
+// That's a counting sort, so it's linear and keeps the existing order
+// inside each group (which is what keeps neighbouring pixels together).
+
+class ray_queue
+{
+    public:
+
+    static const uint8_t DEAD = 0xFF;
+
+    int size;
+
+    std::vector<float> ox, oy, oz;
+    std::vector<float> dx, dy, dz;
+    std::vector<float> r, g, b;   // throughput so far
+    std::vector<float> weight;    // Russian roulette compensation
+    std::vector<float> pdf;       // of the last bounce direction (for MIS)
+    std::vector<float> nx, ny, nz; // normal it left from (for MIS)
+    std::vector<float> t;         // closest hit from the last trace
+    std::vector<int> hit;         // sphere hit, -1 for a miss
+    std::vector<int> pixel;       // where the result goes
+    std::vector<uint32_t> count;  // bounces so far
+    std::vector<rng_state> state;
+    std::vector<uint8_t> key;
+
+    ray_queue() : size{0} {};
+
+    void reserve(int n)
+    {
+        for (std::vector<float> *v : {&ox, &oy, &oz, &dx, &dy, &dz, &r, &g, &b, &weight, &pdf, &nx, &ny, &nz, &t}) {
+            v->resize(n);
+        }
+        hit.resize(n);
+        pixel.resize(n);
+        count.resize(n);
+        state.resize(n);
+        key.resize(n);
+    }
+
+    // Reorders the queue by key into scratch, then swaps the two over.
+    // offsets gets num_keys + 1 entries, the start of each group.
+    void sort(int num_keys, std::vector<int> &offsets, ray_queue &scratch)
+    {
+        offsets.assign(num_keys + 1, 0);
+        for (int i = 0; i < size; i++) {
+            if (key[i] != DEAD) offsets[key[i] + 1] += 1;
+        }
+        for (int k = 0; k < num_keys; k++) {
+            offsets[k + 1] += offsets[k];
+        }
+
+        if (int(scratch.ox.size()) < size) scratch.reserve(int(ox.size()));
+
+        std::vector<int> next(offsets.begin(), offsets.end() - 1);
+        for (int i = 0; i < size; i++)
+        {
+            if (key[i] == DEAD) continue;
+            int j = next[key[i]]++;
+            scratch.ox[j] = ox[i];
+            scratch.oy[j] = oy[i];
+            scratch.oz[j] = oz[i];
+            scratch.dx[j] = dx[i];
+            scratch.dy[j] = dy[i];
+            scratch.dz[j] = dz[i];
+            scratch.r[j] = r[i];
+            scratch.g[j] = g[i];
+            scratch.b[j] = b[i];
+            scratch.weight[j] = weight[i];
+            scratch.pdf[j] = pdf[i];
+            scratch.nx[j] = nx[i];
+            scratch.ny[j] = ny[i];
+            scratch.nz[j] = nz[i];
+            scratch.t[j] = t[i];
+            scratch.hit[j] = hit[i];
+            scratch.pixel[j] = pixel[i];
+            scratch.count[j] = count[i];
+            scratch.state[j] = state[i];
+            scratch.key[j] = key[i];
+        }
+        scratch.size = offsets[num_keys];
+
+        swap(scratch);
+    }
+
+    void swap(ray_queue &other)
+    {
+        std::swap(size, other.size);
+        ox.swap(other.ox);
+        oy.swap(other.oy);
+        oz.swap(other.oz);
+        dx.swap(other.dx);
+        dy.swap(other.dy);
+        dz.swap(other.dz);
+        r.swap(other.r);
+        g.swap(other.g);
+        b.swap(other.b);
+        weight.swap(other.weight);
+        pdf.swap(other.pdf);
+        nx.swap(other.nx);
+        ny.swap(other.ny);
+        nz.swap(other.nz);
+        t.swap(other.t);
+        hit.swap(other.hit);
+        pixel.swap(other.pixel);
+        count.swap(other.count);
+        state.swap(other.state);
+        key.swap(other.key);
+    }
+};
+
+#endif
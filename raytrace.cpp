@@ -1,58 +1,134 @@
 #include <iostream>
 #include <stdlib.h>
 #include <cmath>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <algorithm>
 
 #include <glad/glad.h>
 #include <SDL2/SDL.h>
 
 #include "shader.h"
 #include "vec3.h"
+#include "camera.h"
 #include "sphere.h"
 #include "hittable_list.h"
 
 #include "material_list.h"
 #include "material.h"
 
+#include "scene_buffer.h"
+#include "scenes.h"
+#include "bvh.h"
+#include "cpu_renderer.h"
+#include "blue_noise.h"
+
+#include "tile_scheduler.h"
+#include "cpu_denoiser.h"
+#include "refine.h"
+
 struct fb_help {
     unsigned int fbo;
     unsigned int rbo;
     unsigned int tex;
+    unsigned int extra[3]; // colour attachments 1-3, if any (see addAttachment())
 };
 
 
-struct Camera {
-    point3 lookfrom;
-    point3 lookat;
-    vec3 vup;
-    float vfov;
-    float defocus_angle;
-    float focus_dist;
-
-    vec3 delta_u;
-    vec3 delta_v;
-
-    vec3 viewport_top_left;
-
-    float defocus_radius;
-    vec3 defocus_disc_u;
-    vec3 defocus_disc_v;
-};
-
 // Start up SDL and create a window
 bool init();
 
 // Code for checking attributes I might not need
 void check_attributes();
 
-// Event polling code contained in here
-void event_handling();
+// Event polling code contained in here, including the camera controls
+// (returns true if they moved cam)
+bool event_handling(Camera &cam);
 
 // Free media and shut down SDL
 void close();
 
-void createFrameBuffer(fb_help &fb);
+// (width and height 0 for the render's size)
+void createFrameBuffer(fb_help &fb, GLint internal_format = GL_RGB, GLenum format = GL_RGB, GLenum type = GL_UNSIGNED_BYTE, int width = 0, int height = 0);
+
+// Add colour attachment index (1-3, in order) to fb and draw to all of them
+void addAttachment(fb_help &fb, int index, GLint internal_format, GLenum format, GLenum type);
+
+// Free fb's framebuffer and textures (nothing for one never created)
+void deleteFrameBuffer(fb_help &fb);
+
+// Create (and clear) every framebuffer that's RENDER_WIDTH x RENDER_HEIGHT,
+// with the attachments the options need (and the ladder's, which is a few
+// pixels bigger, see refine.h)
+void create_render_targets(fb_help &upscalefb, fb_help accumfb[2], fb_help denoisefb[2], fb_help restirfb[2], fb_help &restir_temporal, fb_help &refinefb);
+
+// Dynamic resolution: the width (one of the steps) to render the next pass
+// at, given the last one took pass_ms at width (see TARGET_FPS)
+int pick_render_width(int width, float pass_ms);
+
+// Camera, scene and sampling uniforms shared by the tracing shaders
+void set_scene_uniforms(Shader &shader, Camera &cam, hittable_list &objects, material_list &materials, bvh &tree, uint32_t frame_index);
+
+// One full screen ReSTIR pass (see shaders/restir.glsl): reads the
+// reservoirs in prev, writes new ones into fb
+void restir_pass(Shader &shader, Camera &cam, fb_help &fb, fb_help &prev, hittable_list &objects, material_list &materials, bvh &tree, uint32_t frame_index);
+
+// Copy the pixels of prev that have converged into fb and mark them in
+// fb's stencil, so the next pass's tiles skip them (see shaders/adaptive.fs).
+// Returns how many there were, counted with the occlusion query.
+int adaptive_mask(Shader &shader, fb_help &fb, fb_help &prev, unsigned int query);
+
+// Filter accum (with its moments and first hit features) into out, for
+// the screen, with the a-trous denoiser (shaders/denoise.fs), ping-ponging
+// between the two scratch buffers
+void denoise(Shader &shader, fb_help &out, fb_help scratch[2], fb_help &accum);
+
+// Carry the samples accumulated in prev (seen from prev_cam) over to fb for
+// the view from cam (see shaders/reproject.fs), and clear fb's stencil
+void reproject(Shader &shader, Camera &cam, Camera &prev_cam, fb_help &fb, fb_help &prev);
+
+// Trace the window sized guides for the upscaler into fb, for the view
+// from cam (see GUIDE_PASS in testFragment.fs)
+void guide_pass(Shader &shader, Camera cam, fb_help &fb, hittable_list &objects, material_list &materials, bvh &tree);
+
+// Where in the pixel pass frame_index takes its samples, with
+// --upscale-jitter (a Halton point, from the centre)
+vec2 pixel_jitter(uint32_t frame_index);
+
+// Add the samples the pass frame_index added to accum (over prev) to the
+// window pixels they landed in (see shaders/upscale_history.fs)
+void upscale_history(Shader &shader, fb_help &history, fb_help &accum, fb_help &prev, uint32_t frame_index);
+
+// Reconstruct the window sized image in out from accum (or the denoiser's
+// output in colour) with the guides (see shaders/upscale.fs)
+void upscale(Shader &shader, fb_help &out, fb_help &accum, fb_help &colour, fb_help &guide, fb_help &history);
+
+// Copy the CPU renderer's accumulation buffers into fb's attachments, and
+// back out of them
+void upload_cpu_buffers(cpu_renderer &cpu, fb_help &fb);
+void download_cpu_buffers(cpu_renderer &cpu, fb_help &fb);
+
+// Tiles for ladder level's rectangle of the phase sorted buffer (see refine.h)
+tile_scheduler refine_tiles(int level);
+
+// Show the ladder's pass in refine up to level, filled in, in out for the
+// screen (see shaders/refine.fs)
+void refine_preview(Shader &shader, fb_help &out, fb_help &refine, int level);
+
+// Put the ladder's finished pass in refine in place in fb
+void refine_finish(Shader &shader, fb_help &fb, fb_help &refine);
 
-void shader_chunk_pass(vec2 c_min, vec2 c_max, Shader shader, Camera cam, fb_help fb, fb_help tex, hittable_list objects);
+// True once the render is as good as asked for (--converge, --max-spp)
+bool render_finished(int total_samples, int noisy_pixels);
+
+// Write fb (8 bit RGB, as drawn) to a binary PPM file
+void save_ppm(fb_help &fb, const std::string &path);
+
+// Render one pass of samples into the c_min/c_max rectangle of fb,
+// adding them on top of the last pass (prev). With refine, fb is the
+// ladder's phase sorted buffer (see refine.h).
+void shader_chunk_pass(vec2 c_min, vec2 c_max, Shader &shader, Camera &cam, fb_help &fb, unsigned int seed_tex, fb_help &prev, hittable_list &objects, material_list &materials, bvh &tree, uint32_t frame_index, bool refine = false);
 
 // SDL Objects
 SDL_Window* gWindow = NULL; // Main window
@@ -89,10 +165,116 @@ int RENDER_HEIGHT = 1;
 
 int NUM_SAMPLES = 8;
 uint32_t BOUNCE_LIMIT = 50;
-
-// Other constants
-int MAX_NUM_OBJECTS = 1024;
-int SPHERE_UBO_SIZE = MAX_NUM_OBJECTS*32;
+// Bounces before paths go through Russian roulette (--rr-depth N, anything
+// >= BOUNCE_LIMIT turns it off)
+uint32_t RR_DEPTH = 3;
+// Sample emissive spheres directly at lambertian hits (--no-nee turns it
+// off, so lights are only found by bouncing into them)
+bool LIGHT_SAMPLING = true;
+// Reuse light samples across frames and neighbouring pixels for the
+// direct light at the first hit (--restir, GPU only, see
+// shaders/restir.glsl). Meant for 1 spp a frame, so it sets NUM_SAMPLES.
+bool RESTIR = false;
+// Stop sampling pixels once they've converged (--adaptive, GPU only):
+// the 95% confidence interval of their mean luminance is under
+// ADAPTIVE_ERROR (--target-error E) of the mean itself and they have at
+// least ADAPTIVE_MIN_SAMPLES. The passes then only cost what the noisy
+// pixels do.
+bool ADAPTIVE = false;
+float ADAPTIVE_ERROR = 0.05f;
+int ADAPTIVE_MIN_SAMPLES = 64;
+
+// Run the result through an edge avoiding a-trous filter guided by the
+// first hit's albedo, normal and depth before showing it (--denoise, see
+// denoise.h). On the GPU with shaders/denoise.fs, or with cpu_denoiser on
+// the CPU renderer's threads.
+bool DENOISE = false;
+
+// Keep the accumulated samples when the camera moves (--reproject): each
+// pixel takes over the ones from where its surface was in the last view
+// (found with the guides' depth, see shaders/reproject.fs), pixels that
+// weren't visible then start over, and none keeps more than
+// REPROJECT_HISTORY (--history N) so the new samples blend out what went
+// stale. Without it a move starts the render over.
+bool REPROJECT = false;
+int REPROJECT_HISTORY = 64;
+
+// Reconstruct the window sized image from the render with the guides
+// instead of stretching it (--upscale, GPU only, see shaders/upscale.fs).
+// The window's own guides are traced with UPSCALE_GUIDE_SAMPLES samples a
+// pixel whenever the view changes. --upscale-jitter also moves each pass's
+// samples around inside the render pixels and keeps what lands in each
+// window pixel, so a still view sharpens up to window resolution.
+bool UPSCALE = false;
+bool UPSCALE_JITTER = false;
+int UPSCALE_GUIDE_SAMPLES = 4;
+int UPSCALE_JITTER_PHASES = 16; // passes before the jitter repeats
+
+// Camera controls: WASD moves, Q and E go down and up, the arrow keys turn
+// (steps of CAMERA_STEP of the distance to lookat, and CAMERA_TURN degrees)
+float CAMERA_STEP = 0.02f;
+float CAMERA_TURN = 1.0f;
+
+// Batch rendering: stop adding passes once no more than CONVERGE_FRACTION
+// of the pixels are still noisy, with a relative error over ADAPTIVE_ERROR
+// (--converge F, turns on --adaptive; < 0 is off) or every pixel has
+// MAX_SPP samples (--max-spp N, 0 is off), then save the image to
+// OUTPUT_PATH (--out file.ppm) and quit if there is one
+float CONVERGE_FRACTION = -1.0f;
+int MAX_SPP = 0;
+std::string OUTPUT_PATH;
+
+// Progressive rendering: every loop iteration adds another NUM_SAMPLES
+// per pixel into the accumulation buffers (instead of drawing once)
+bool PROGRESSIVE = true;
+// RGBA16F halves the memory, but the sample count in alpha stops
+// being exact past 2048 so RGBA32F is the default
+GLint ACCUM_FORMAT = GL_RGBA32F;
+
+// Tiled rendering: a pass is split into TILE_SIZE tiles and only as many
+// tiles as fit in FRAME_BUDGET_MS are drawn each frame, so the window
+// stays responsive (and the driver watchdog happy) during long passes.
+// A budget of 0 draws each pass in one go.
+int TILE_SIZE = 64;
+float FRAME_BUDGET_MS = 16.0f;
+
+// Dynamic resolution: between passes, resize the render so a whole pass
+// takes about 1/TARGET_FPS seconds (--target-fps F, 0 is off). Widths go in
+// RESOLUTION_STEPS steps up to the window's, and it only moves up a step
+// with some time to spare, so the buffers aren't reallocated every pass.
+// Only passes that traced every pixel count: with --adaptive the size
+// settles over the first ADAPTIVE_MIN_SAMPLES and then stays, as passes
+// over the few pixels left would look cheap and a resize starts over.
+float TARGET_FPS = 0.0f;
+int RESOLUTION_STEPS = 8;
+
+// Start every fresh render with a refinement ladder (--refine, GPU only,
+// see refine.h): the first pass traces 1 pixel in 16, then 3 more, then
+// the rest, and each level is shown filled in as soon as it's done, so
+// there's a picture long before the whole pass is. It's still one pass's
+// worth of pixels, traced with the same samples.
+bool REFINE = false;
+
+// Which scene from scenes.h to render (--scene N)
+int SCENE = 0;
+// Spheres per side for the sphere field scene (--field N)
+int FIELD_SIZE = 1000;
+// Blocks per side for the city lights scene (--city N)
+int CITY_SIZE = 32;
+
+// Render on the CPU instead of with testFragment.fs (--cpu), with
+// NUM_THREADS threads (--threads N, 0 = one per core)
+bool USE_CPU = false;
+int NUM_THREADS = 0;
+// Advance all of a tile's paths together a bounce at a time (--wavefront)
+bool WAVEFRONT = false;
+
+// How the quasi random samples (sampler.h) differ between pixels (--seed
+// hash|bluenoise): scrambled by a hash of the pixel, or shifted by a blue
+// noise tile that's generated once and then loaded from BLUE_NOISE_PATH
+bool BLUE_NOISE_SEED = false;
+std::string BLUE_NOISE_PATH = "textures/bluenoise64.pgm";
+int BLUE_NOISE_SIZE = 64;
 
 void check_attributes()
 {
@@ -178,14 +360,19 @@ bool init()
             // window size. This could be useful if you wanted to put otherwise 
             // rendered ui or other info around the main display.
             glViewport(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+
+            // Scene data goes in SSBOs if we have them, buffer textures if not
+            USE_SSBO = GLAD_GL_VERSION_4_3;
+            std::cout << "Scene storage: " << (USE_SSBO ? "shader storage buffers" : "buffer textures") << std::endl;
         }
     }
     return success;
 }
 
-void event_handling()
+bool event_handling(Camera &cam)
 {
     SDL_Event e;
+    bool moved = false;
 
     // Poll event, removing it from the queue
     while (SDL_PollEvent(&e))
@@ -206,7 +393,32 @@ void event_handling()
                     break;
             }
         } 
+
+        // Camera controls
+        if (e.type == SDL_KEYDOWN)
+        {
+            float forward = 0.0f, right = 0.0f, up = 0.0f, yaw = 0.0f, pitch = 0.0f;
+            switch (e.key.keysym.sym)
+            {
+                case SDLK_w: forward = CAMERA_STEP; break;
+                case SDLK_s: forward = -CAMERA_STEP; break;
+                case SDLK_d: right = CAMERA_STEP; break;
+                case SDLK_a: right = -CAMERA_STEP; break;
+                case SDLK_e: up = CAMERA_STEP; break;
+                case SDLK_q: up = -CAMERA_STEP; break;
+                case SDLK_LEFT: yaw = CAMERA_TURN; break;
+                case SDLK_RIGHT: yaw = -CAMERA_TURN; break;
+                case SDLK_UP: pitch = CAMERA_TURN; break;
+                case SDLK_DOWN: pitch = -CAMERA_TURN; break;
+                default: continue;
+            }
+            camera_move(cam, forward, right, up);
+            camera_turn(cam, yaw, pitch);
+            camera_setup(cam, RENDER_WIDTH, RENDER_HEIGHT);
+            moved = true;
+        }
     }
+    return moved;
 }
 
 void close()
@@ -221,15 +433,106 @@ void close()
 
 int main(int argc, char* args[])
 {
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = args[i];
+        if (arg == "--scene" && i + 1 < argc) {
+            SCENE = std::atoi(args[++i]);
+        } else if (arg == "--field" && i + 1 < argc) {
+            FIELD_SIZE = std::atoi(args[++i]);
+        } else if (arg == "--city" && i + 1 < argc) {
+            CITY_SIZE = std::atoi(args[++i]);
+        } else if (arg == "--cpu") {
+            USE_CPU = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            NUM_THREADS = std::atoi(args[++i]);
+        } else if (arg == "--wavefront") {
+            WAVEFRONT = true;
+        } else if (arg == "--no-nee") {
+            LIGHT_SAMPLING = false;
+        } else if (arg == "--restir") {
+            RESTIR = true;
+        } else if (arg == "--adaptive") {
+            ADAPTIVE = true;
+        } else if (arg == "--target-error" && i + 1 < argc) {
+            ADAPTIVE_ERROR = float(std::atof(args[++i]));
+        } else if (arg == "--upscale") {
+            UPSCALE = true;
+        } else if (arg == "--upscale-jitter") {
+            UPSCALE = true;
+            UPSCALE_JITTER = true;
+        } else if (arg == "--denoise") {
+            DENOISE = true;
+        } else if (arg == "--reproject") {
+            REPROJECT = true;
+        } else if (arg == "--history" && i + 1 < argc) {
+            REPROJECT_HISTORY = std::atoi(args[++i]);
+        } else if (arg == "--converge" && i + 1 < argc) {
+            CONVERGE_FRACTION = float(std::atof(args[++i]));
+            ADAPTIVE = true;
+        } else if (arg == "--max-spp" && i + 1 < argc) {
+            MAX_SPP = std::atoi(args[++i]);
+        } else if (arg == "--refine") {
+            REFINE = true;
+        } else if (arg == "--target-fps" && i + 1 < argc) {
+            TARGET_FPS = float(std::atof(args[++i]));
+        } else if (arg == "--out" && i + 1 < argc) {
+            OUTPUT_PATH = args[++i];
+        } else if (arg == "--rr-depth" && i + 1 < argc) {
+            RR_DEPTH = uint32_t(std::atoi(args[++i]));
+        } else if (arg == "--seed" && i + 1 < argc) {
+            BLUE_NOISE_SEED = std::string(args[++i]) == "bluenoise";
+        }
+    }
+
+    if (RESTIR && (USE_CPU || !LIGHT_SAMPLING)) {
+        std::cout << "--restir needs the GPU and light sampling, ignoring it" << std::endl;
+        RESTIR = false;
+    }
+    if (RESTIR) {
+        NUM_SAMPLES = 1;
+    }
+    if (UPSCALE && USE_CPU) {
+        std::cout << "--upscale needs the GPU, ignoring it" << std::endl;
+        UPSCALE = false;
+        UPSCALE_JITTER = false;
+    }
+    if (REFINE && USE_CPU) {
+        std::cout << "--refine needs the GPU, ignoring it" << std::endl;
+        REFINE = false;
+    }
+    if (ADAPTIVE && USE_CPU) {
+        std::cout << "--adaptive and --converge need the GPU, ignoring them" << std::endl;
+        ADAPTIVE = false;
+        CONVERGE_FRACTION = -1.0f;
+    }
+
     if(!init())
     {
         exit(1);
     }
 
-    fb_help perlinfb, upscalefb;
-
-    createFrameBuffer(perlinfb);
-    createFrameBuffer(upscalefb);
+    fb_help upscalefb = {};
+    fb_help accumfb[2] = {}; // ping-pong: read the last pass from one, write the next into the other
+    fb_help denoisefb[2] = {}; // (illumination, variance) between iterations
+    fb_help restirfb[2] = {}; // reservoirs, last frame's and this frame's
+    fb_help restir_temporal = {}; // between the temporal and spatial passes
+    fb_help refinefb = {}; // the ladder's pass, sorted by phase
+
+    create_render_targets(upscalefb, accumfb, denoisefb, restirfb, restir_temporal, refinefb);
+
+    // Window sized: the upscaler's output, the guides that steer it and
+    // the samples that landed in each pixel
+    fb_help displayfb = {};
+    fb_help guidefb = {};
+    fb_help historyfb = {};
+    if (UPSCALE)
+    {
+        createFrameBuffer(displayfb, GL_RGB, GL_RGB, GL_UNSIGNED_BYTE, SCREEN_WIDTH, SCREEN_HEIGHT);
+        createFrameBuffer(guidefb, GL_RGBA16F, GL_RGBA, GL_FLOAT, SCREEN_WIDTH, SCREEN_HEIGHT);
+        addAttachment(guidefb, 1, GL_RGBA16F, GL_RGBA, GL_FLOAT);
+        createFrameBuffer(historyfb, GL_RGBA32F, GL_RGBA, GL_FLOAT, SCREEN_WIDTH, SCREEN_HEIGHT);
+    }
 
     // Queries??
     /* Get maximum number of vertex attributes we can pass to a vertex shader (it's 16) */
@@ -243,6 +546,9 @@ int main(int argc, char* args[])
     glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &nrAttributes);
     std::cout << "Maximum Uniform Block Size (bytes): " << nrAttributes << std::endl;
 
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &nrAttributes);
+    std::cout << "Maximum Texture Buffer Size (texels): " << nrAttributes << std::endl;
+
     // Create vertex Array object
     unsigned int VAO;
     glGenVertexArrays(1, &VAO);
@@ -301,245 +607,588 @@ int main(int argc, char* args[])
     glEnableVertexAttribArray(1);
 
     // SHADER CREATION:
-    Shader ourShader("shaders/testVertex.vs", "shaders/testFragment.fs");
-    Shader perlinShader("shaders/testVertex.vs", "shaders/perlin.fs");
+    std::string defines;
+    if (USE_SSBO) defines += "#define SCENE_SSBO\n";
+    if (BLUE_NOISE_SEED) defines += "#define SEED_BLUE_NOISE\n";
+    if (RESTIR) defines += "#define RESTIR\n";
+    if (ADAPTIVE || DENOISE || REPROJECT || UPSCALE) defines += "#define MOMENTS\n";
+    if (DENOISE || REPROJECT || UPSCALE) defines += "#define FEATURES\n";
+    if (UPSCALE_JITTER) defines += "#define UPSCALE_JITTER\n";
+
+    Shader ourShader("shaders/testVertex.vs", "shaders/testFragment.fs", defines);
     Shader texShader("shaders/texVertex.vs", "shaders/texFragment.fs");
+    Shader resolveShader("shaders/testVertex.vs", "shaders/resolve.fs");
+    Shader maskShader("shaders/testVertex.vs", "shaders/adaptive.fs");
+    Shader denoiseShader("shaders/testVertex.vs", "shaders/denoise.fs");
+    Shader reprojectShader("shaders/testVertex.vs", "shaders/reproject.fs");
+    Shader upscaleShader("shaders/testVertex.vs", "shaders/upscale.fs");
+    Shader historyShader("shaders/testVertex.vs", "shaders/upscale_history.fs");
+    Shader refineShader("shaders/testVertex.vs", "shaders/refine.fs");
+    Shader previewShader("shaders/testVertex.vs", "shaders/refine.fs", "#define PREVIEW\n");
+
+    // testFragment.fs again, with the reservoir passes' main()s instead
+    Shader *restirTemporal = NULL;
+    Shader *restirSpatial = NULL;
+    if (RESTIR)
+    {
+        restirTemporal = new Shader("shaders/testVertex.vs", "shaders/testFragment.fs", defines + "#define RESTIR_PASS 1\n");
+        restirSpatial = new Shader("shaders/testVertex.vs", "shaders/testFragment.fs", defines + "#define RESTIR_PASS 2\n");
+    }
 
+    // and with the guide pass's, with only what it needs
+    Shader *guideShader = NULL;
+    if (UPSCALE)
+    {
+        std::string guide_defines = "#define FEATURES\n#define GUIDE_PASS\n";
+        if (USE_SSBO) guide_defines += "#define SCENE_SSBO\n";
+        guideShader = new Shader("shaders/testVertex.vs", "shaders/testFragment.fs", guide_defines);
+    }
 
-    // CREATE PERLIN NOISE TEXTURE
-    glBindFramebuffer(GL_FRAMEBUFFER, perlinfb.fbo);
-    glViewport(0, 0, RENDER_WIDTH, RENDER_HEIGHT);
 
-    glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT);
+    blue_noise seed_noise;
+    if (BLUE_NOISE_SEED)
+    {
+        seed_noise.load_or_generate(BLUE_NOISE_PATH, BLUE_NOISE_SIZE);
+        seed_noise.upload();
+    }
+    std::cout << "Sample decorrelation: " << (BLUE_NOISE_SEED ? "blue noise" : "hash") << std::endl;
 
-    float PERLIN_GRID_SIZE = 400;
-    float PERLIN_CONTRAST = 1.5;
-    int PERLIN_LAYERS = 12;
-    float PERLIN_LACURNITY = 2;
+    // Raytracing setup
 
-    perlinShader.use();
+    Camera cam;
+    hittable_list objects = hittable_list();
+    material_list materials = material_list();
 
-    perlinShader.setFloat("GRID_SIZE", PERLIN_GRID_SIZE);
-    perlinShader.setFloat("CONTRAST", PERLIN_CONTRAST);
-    perlinShader.setInt("LAYERS", PERLIN_LAYERS);
-    perlinShader.setFloat("LACURNITY", PERLIN_CONTRAST);
+    switch (SCENE)
+    {
+        case 1:
+            scene_random_spheres(objects, materials, cam);
+            break;
+        case 2:
+            scene_sphere_field(objects, materials, cam, FIELD_SIZE);
+            break;
+        case 3:
+            scene_lit_interior(objects, materials, cam);
+            break;
+        case 4:
+            scene_city_lights(objects, materials, cam, CITY_SIZE);
+            break;
+        default:
+            scene_default(objects, materials, cam);
+            break;
+    }
 
-    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    camera_setup(cam, RENDER_WIDTH, RENDER_HEIGHT);
 
-    // Raytracing setup
+    std::cout << "RENDER_HEIGHT: " << RENDER_HEIGHT << std::endl;
+    std::cout << "RENDER_WIDTH: " << RENDER_WIDTH << std::endl;
 
-    Camera cam;
+    std::cout << "viewport_top_left: " << cam.viewport_top_left << std::endl;
+    std::cout << "delta_u: " << cam.delta_u << std::endl;
+    std::cout << "delta_v: " << cam.delta_v << std::endl;
 
-    cam.lookfrom = point3(0, 10, 0);
-    cam.lookat = point3(0, -1, 0);
-    cam.vup = vec3(0, 0, 1);
-    cam.vfov = 90.0;
-    cam.defocus_angle = 0.6;
-    cam.focus_dist = 1.0;
+    std::cout << "Spheres: " << objects.num << ", Materials: " << materials.num << std::endl;
 
-    vec3 u, v, w;
+    // Build the BVH (this puts the objects in BVH order, so do it before uploading them)
+    Uint64 bvh_start = SDL_GetPerformanceCounter();
+    bvh tree = bvh(objects);
+    Uint64 bvh_end = SDL_GetPerformanceCounter();
 
-    point3 camera_origin = cam.lookfrom;
+    std::cout << "BVH: " << tree.nodes.size() << " nodes, depth " << tree.depth << ", built in "
+              << 1000.0 * (bvh_end - bvh_start) / SDL_GetPerformanceFrequency() << " ms" << std::endl;
 
-    auto theta = degrees_to_radians(cam.vfov);
-    auto h = std::tan(theta / 2);
-    auto viewport_height = 2*h*cam.focus_dist;
-    auto viewport_width = (double(RENDER_WIDTH) / double(RENDER_HEIGHT)) * viewport_height;
+    // Lights refer to spheres by index, so this has to wait for the BVH
+    if (LIGHT_SAMPLING) {
+        materials.build_lights(objects);
+    }
+    std::cout << "Lights sampled: " << materials.lights.size() << " (light tree: "
+              << materials.tree.nodes.size() << " nodes, depth " << materials.tree.depth << ")" << std::endl;
+
+    // Send the scene to the GPU
+    materials.upload();
+    objects.upload();
+    tree.upload();
+
+    // (the ReSTIR passes trace rays too)
+    std::vector<unsigned int> tracers = {ourShader.ID};
+    if (RESTIR) {
+        tracers.push_back(restirTemporal->ID);
+        tracers.push_back(restirSpatial->ID);
+    }
+    if (UPSCALE) {
+        tracers.push_back(guideShader->ID);
+    }
+    for (unsigned int program : tracers)
+    {
+        objects.buffer.bind(program, "Spheres", 2);
+        materials.buffer.bind(program, "Materials", 3);
+        tree.buffer.bind(program, "Nodes", 4);
+        materials.light_buffer.bind(program, "Lights", 6);
+        materials.tree.buffer.bind(program, "LightNodes", 7);
+
+        // Reservoir targets 0-2 on texture units 8-10
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "reservoirSample"), 8);
+        glUniform1i(glGetUniformLocation(program, "reservoirCount"), 9);
+        glUniform1i(glGetUniformLocation(program, "reservoirSurface"), 10);
+    }
 
-    w = unit_vector(cam.lookfrom - cam.lookat);
-    u = unit_vector(cross(cam.vup, w));
-    v = cross(w, u);
+    // Russian roulette counters, read back and cleared after every pass
+    // (only with SSBOs, GL 3.3 has no atomics to count with)
+    unsigned int rouletteSSBO = 0;
+    const uint32_t roulette_zero[2] = {0, 0};
+    if (USE_SSBO)
+    {
+        glGenBuffers(1, &rouletteSSBO);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, rouletteSSBO);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(roulette_zero), roulette_zero, GL_DYNAMIC_READ);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+        unsigned int block = glGetProgramResourceIndex(ourShader.ID, GL_SHADER_STORAGE_BLOCK, "RouletteStats");
+        glShaderStorageBlockBinding(ourShader.ID, block, 5);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, rouletteSSBO);
+    }
 
-    vec3 viewport_u = viewport_width * u;
-    vec3 viewport_v = viewport_height * -v;
+    // Counts the pixels adaptive_mask() lets through
+    unsigned int maskQuery;
+    glGenQueries(1, &maskQuery);
 
-    cam.delta_u = viewport_u / RENDER_WIDTH;
-    cam.delta_v = viewport_v / RENDER_HEIGHT;
+    ourShader.use();
+    ourShader.setInt("seedTexture", 0);
+    ourShader.setInt("accumTexture", 1);
+    ourShader.setInt("momentsTexture", 11);
+    ourShader.setInt("albedoTexture", 12);
+    ourShader.setInt("normalTexture", 13);
+
+    maskShader.use();
+    maskShader.setInt("accumTexture", 1);
+    maskShader.setInt("momentsTexture", 11);
+    maskShader.setInt("albedoTexture", 12);
+    maskShader.setInt("normalTexture", 13);
+    maskShader.setFloat("target_error", ADAPTIVE_ERROR);
+    maskShader.setFloat("min_samples", float(ADAPTIVE_MIN_SAMPLES));
+
+    denoiseShader.use();
+    denoiseShader.setInt("accumTexture", 1);
+    denoiseShader.setInt("momentsTexture", 11);
+    denoiseShader.setInt("albedoTexture", 12);
+    denoiseShader.setInt("normalTexture", 13);
+    denoiseShader.setInt("filterTexture", 14);
+
+    reprojectShader.use();
+    reprojectShader.setInt("accumTexture", 1);
+    reprojectShader.setInt("momentsTexture", 11);
+    reprojectShader.setInt("albedoTexture", 12);
+    reprojectShader.setInt("normalTexture", 13);
+    reprojectShader.setFloat("max_history", float(REPROJECT_HISTORY));
+
+    // (the window's guides and history on the units the render's moments
+    // and the seeds are on otherwise)
+    upscaleShader.use();
+    upscaleShader.setInt("accumTexture", 1);
+    upscaleShader.setInt("albedoTexture", 12);
+    upscaleShader.setInt("normalTexture", 13);
+    upscaleShader.setInt("colourTexture", 14);
+    upscaleShader.setInt("guideAlbedoTexture", 15);
+    upscaleShader.setInt("guideNormalTexture", 11);
+    upscaleShader.setInt("historyTexture", 0);
+    upscaleShader.setBool("denoised", DENOISE);
+    upscaleShader.setBool("jitter", UPSCALE_JITTER);
+
+    historyShader.use();
+    historyShader.setInt("accumTexture", 1);
+    historyShader.setInt("prevTexture", 14);
+
+    refineShader.use();
+    refineShader.setInt("accumTexture", 1);
+    refineShader.setInt("momentsTexture", 11);
+    refineShader.setInt("albedoTexture", 12);
+    refineShader.setInt("normalTexture", 13);
+
+    previewShader.use();
+    previewShader.setInt("accumTexture", 1);
+
+    tile_scheduler scheduler(RENDER_WIDTH, RENDER_HEIGHT, TILE_SIZE, FRAME_BUDGET_MS);
+
+    cpu_renderer *cpu = NULL;
+    if (USE_CPU)
+    {
+        cpu = new cpu_renderer(objects, materials, tree, cam, RENDER_WIDTH, RENDER_HEIGHT, NUM_SAMPLES, BOUNCE_LIMIT, RR_DEPTH, NUM_THREADS, WAVEFRONT,
+                               BLUE_NOISE_SEED ? &seed_noise : NULL);
+        std::cout << "Rendering on the CPU with " << cpu->num_threads << " threads"
+                  << (WAVEFRONT ? " (wavefront)" : "") << std::endl;
+        cpu->start_pass(0);
+    }
 
-    cam.viewport_top_left = camera_origin - (cam.focus_dist*w)
-                                    - viewport_u/2
-                                    - viewport_v/2;
+    cpu_denoiser *cpu_denoise = NULL;
+    if (USE_CPU && DENOISE) {
+        cpu_denoise = new cpu_denoiser(RENDER_WIDTH, RENDER_HEIGHT, cpu->num_threads);
+    }
+    if (USE_CPU) {
+        cpu->features = DENOISE || REPROJECT;
+    }
 
-    cam.defocus_radius = cam.focus_dist * std::tan(degrees_to_radians(cam.defocus_angle / 2));
-    cam.defocus_disc_u = u * cam.defocus_radius;
-    cam.defocus_disc_v = v * cam.defocus_radius; 
+    int accum_read = 0; // accumfb holding the last finished pass
+    int restir_read = 0; // restirfb holding the reservoirs the current pass uses
+    bool pass_start = true; // nothing of the current pass drawn yet
+    bool denoise_due = true; // a new pass to filter (see denoise())
+    bool upscale_due = true; // and to upscale (see upscale())
+    bool rendering = true; // false once render_finished()
+    bool reported = false;
+    uint32_t frame_index = 0;
+    int total_samples = 0; // per pixel, for the pixels still being sampled
+    int num_pixels = RENDER_WIDTH * RENDER_HEIGHT;
+    int noisy_pixels = num_pixels; // the ones the current pass traces
+    double pixel_samples = 0.0; // over the whole image
+    bool camera_moved = false;
+    Camera prev_cam = cam; // the view accumfb[accum_read] was rendered from
+    int new_width = RENDER_WIDTH; // what pick_render_width() wants next
+    int refine_level = REFINE ? 0 : REFINE_LEVELS; // ladder level being traced (REFINE_LEVELS for none)
+    tile_scheduler refine_scheduler; // its tiles
+    float refine_ms = 0.0f; // the levels so far
+    bool preview_due = false; // a level to show (see refine_preview())
+
+    if (UPSCALE)
+    {
+        guide_pass(*guideShader, cam, guidefb, objects, materials, tree);
+        glBindFramebuffer(GL_FRAMEBUFFER, historyfb.fbo);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
 
-    std::cout << "RENDER_HEIGHT: " << RENDER_HEIGHT << std::endl;
-    std::cout << "RENDER_WIDTH: " << RENDER_WIDTH << std::endl;
+    while (!gQuit)
+    {
+        // Input
 
-    std::cout << "viewport_height: " << viewport_height << std::endl;
-    std::cout << "viewport_width: " << viewport_width << std::endl;
-    std::cout << "viewport_top_left: " << cam.viewport_top_left << std::endl;
-    std::cout << "delta_u: " << cam.delta_u << std::endl;
-    std::cout << "delta_v: " << cam.delta_v << std::endl;
+        // A camera move either carries the samples over to the new view or
+        // starts over. The CPU renderer's pass is waited for and then goes
+        // through the GL buffers to be reprojected too. A new resolution
+        // is handled the same way (it's a new view with different pixels),
+        // reprojecting from the old buffers before they're freed.
+        if (camera_moved || new_width != RENDER_WIDTH)
+        {
+            if (USE_CPU)
+            {
+                cpu->wait();
+                if (REPROJECT) {
+                    upload_cpu_buffers(*cpu, accumfb[accum_read]);
+                }
+            }
 
-    // Set up UBO data
+            fb_help source = accumfb[accum_read];
+            fb_help old_targets[9] = {upscalefb, accumfb[0], accumfb[1], denoisefb[0], denoisefb[1],
+                                      restirfb[0], restirfb[1], restir_temporal, refinefb};
+            bool resized = new_width != RENDER_WIDTH;
+            if (resized)
+            {
+                RENDER_WIDTH = new_width;
+                RENDER_HEIGHT = std::max(1, int(RENDER_WIDTH / aspect_ratio));
+                std::cout << "Render resolution: " << RENDER_WIDTH << "x" << RENDER_HEIGHT << std::endl;
+
+                create_render_targets(upscalefb, accumfb, denoisefb, restirfb, restir_temporal, refinefb);
+                camera_setup(cam, RENDER_WIDTH, RENDER_HEIGHT);
+                scheduler = tile_scheduler(RENDER_WIDTH, RENDER_HEIGHT, TILE_SIZE, FRAME_BUDGET_MS);
+                num_pixels = RENDER_WIDTH * RENDER_HEIGHT;
+
+                if (USE_CPU)
+                {
+                    delete cpu_denoise;
+                    delete cpu;
+                    cpu = new cpu_renderer(objects, materials, tree, cam, RENDER_WIDTH, RENDER_HEIGHT, NUM_SAMPLES, BOUNCE_LIMIT, RR_DEPTH, NUM_THREADS, WAVEFRONT,
+                                           BLUE_NOISE_SEED ? &seed_noise : NULL);
+                    cpu->features = DENOISE || REPROJECT;
+                    cpu_denoise = DENOISE ? new cpu_denoiser(RENDER_WIDTH, RENDER_HEIGHT, cpu->num_threads) : NULL;
+                }
+            }
 
-    // MATERIALS
+            if (REPROJECT)
+            {
+                reproject(reprojectShader, cam, prev_cam, accumfb[1 - accum_read], source);
+                accum_read = 1 - accum_read;
 
-    unsigned int matUBO;
-    glGenBuffers(1, &matUBO);
-    glBindBuffer(GL_UNIFORM_BUFFER, matUBO);
-    glBufferData(GL_UNIFORM_BUFFER, SPHERE_UBO_SIZE, NULL, GL_STATIC_DRAW); // Allocate 4096 bytes for UBO
-    // Note, can hold 128 32byte materials
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+                // (adaptive_mask() may have marked the other one for the old view)
+                glBindFramebuffer(GL_FRAMEBUFFER, accumfb[1 - accum_read].fbo);
+                glClearStencil(0);
+                glClear(GL_STENCIL_BUFFER_BIT);
+            }
+            else
+            {
+                for (int i = 0; i < 2; i++)
+                {
+                    glBindFramebuffer(GL_FRAMEBUFFER, accumfb[i].fbo);
+                    glViewport(0, 0, RENDER_WIDTH, RENDER_HEIGHT);
+                    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+                    glClearStencil(0);
+                    glClear(GL_COLOR_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+                }
+            }
 
-    // Bind UBO in sphere to uboBlock
-    unsigned int uniformBlockIndexMat = glGetUniformBlockIndex(ourShader.ID, "Materials");
-    glUniformBlockBinding(ourShader.ID, uniformBlockIndexMat, 0);
-    glBindBufferRange(GL_UNIFORM_BUFFER, 0, matUBO, 0, SPHERE_UBO_SIZE);
+            if (resized)
+            {
+                for (fb_help &fb : old_targets) {
+                    deleteFrameBuffer(fb);
+                }
+            }
 
-    // Add Materials
-    material_list materials = material_list();
+            // (the window's guides and samples stay put for a new resolution)
+            if (UPSCALE && camera_moved)
+            {
+                guide_pass(*guideShader, cam, guidefb, objects, materials, tree);
+                glBindFramebuffer(GL_FRAMEBUFFER, historyfb.fbo);
+                glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+                glClear(GL_COLOR_BUFFER_BIT);
+            }
+            camera_moved = false;
 
-    lambertian mat_ground = lambertian(vec3(0.8, 0.8, 0.0));
-    lambertian mat_centre = lambertian(vec3(0.1, 0.2, 0.5));
-    dialectric mat_left = dialectric(1.5);
-    dialectric mat_left_bubble = dialectric(1.0/1.5);
-    metallic mat_right = metallic(vec3(0.8, 0.6, 0.2), 0.0);
+            // (a new frame_index too, so the new samples don't repeat the
+            // ones they're added to)
+            frame_index++;
+            if (USE_CPU)
+            {
+                if (REPROJECT) {
+                    download_cpu_buffers(*cpu, accumfb[accum_read]);
+                } else {
+                    std::fill(cpu->accum.begin(), cpu->accum.end(), 0.0f);
+                    std::fill(cpu->moments.begin(), cpu->moments.end(), 0.0f);
+                    std::fill(cpu->albedo.begin(), cpu->albedo.end(), 0.0f);
+                    std::fill(cpu->normals.begin(), cpu->normals.end(), 0.0f);
+                }
+                cpu->set_camera(cam);
+                cpu->start_pass(frame_index);
+            }
+            else
+            {
+                scheduler.begin_pass();
+                pass_start = true;
 
-    lambertian mat_left2 = lambertian(vec3(1.0, 0.0, 0.0));
-    lambertian mat_right2 = lambertian(vec3(0.0, 0.0, 1.0));
+                // (reprojected samples aren't a fresh start)
+                refine_level = (REFINE && !REPROJECT) ? 0 : REFINE_LEVELS;
+            }
 
-    materials.add(matUBO, mat_ground);
-    materials.add(matUBO, mat_centre);
-    materials.add(matUBO, mat_left);
-    materials.add(matUBO, mat_right);
-    materials.add(matUBO, mat_left_bubble);
+            prev_cam = cam;
+            denoise_due = true;
+            upscale_due = true;
+            rendering = true;
+            reported = false;
+            total_samples = 0;
+            noisy_pixels = num_pixels;
+            pixel_samples = 0.0;
+        }
 
-    materials.add(matUBO, mat_left2);
-    materials.add(matUBO, mat_right2);
+        // Rendering
 
-    // SPHERES
+        if (USE_CPU)
+        {
+            // The CPU renders in the background, copy each pass over as it finishes
+            if (rendering && (PROGRESSIVE || frame_index == 0) && cpu->pass_done())
+            {
+                glBindTexture(GL_TEXTURE_2D, accumfb[accum_read].tex);
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, cpu->stride);
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, RENDER_WIDTH, RENDER_HEIGHT, GL_RGBA, GL_FLOAT, cpu->accum.data());
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+                // Denoised straight into the screen texture (no resolve)
+                if (cpu_denoise)
+                {
+                    Uint64 denoise_start = SDL_GetPerformanceCounter();
+                    cpu_denoise->run(cpu->accum.data(), cpu->moments.data(), cpu->albedo.data(), cpu->normals.data(), cpu->stride);
+                    Uint64 denoise_end = SDL_GetPerformanceCounter();
+                    std::cout << "CPU denoise: " << 1000.0 * (denoise_end - denoise_start) / SDL_GetPerformanceFrequency() << " ms" << std::endl;
+
+                    glBindTexture(GL_TEXTURE_2D, upscalefb.tex);
+                    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, RENDER_WIDTH, RENDER_HEIGHT, GL_RGB, GL_FLOAT, cpu_denoise->out.data());
+                }
 
-    unsigned int sphereUBO;
-    glGenBuffers(1, &sphereUBO);
-    glBindBuffer(GL_UNIFORM_BUFFER, sphereUBO);
-    glBufferData(GL_UNIFORM_BUFFER, SPHERE_UBO_SIZE, NULL, GL_STATIC_DRAW); // Allocate 4096 bytes for UBO
-    // Note, can hold 128 32byte spheres
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+                frame_index++;
+                total_samples += NUM_SAMPLES;
+                pixel_samples += double(NUM_SAMPLES) * num_pixels;
+                rendering = !render_finished(total_samples, noisy_pixels);
 
-    // Bind UBO in sphere to uboBlock
-    unsigned int uniformBlockIndexSphere = glGetUniformBlockIndex(ourShader.ID, "Spheres");
-    glUniformBlockBinding(ourShader.ID, uniformBlockIndexSphere, 1);
-    glBindBufferRange(GL_UNIFORM_BUFFER, 1, sphereUBO, 0, SPHERE_UBO_SIZE);
+                std::cout << "CPU pass " << frame_index << ": " << cpu->pass_ms << " ms, "
+                          << cpu->pass_rays / (cpu->pass_ms * 1000.0) << " Mrays/s, roulette stopped "
+                          << cpu->pass_terminated << " paths, " << cpu->pass_survived << " carried on" << std::endl;
 
-    // Add spheres
-    hittable_list objects = hittable_list();
+                std::string title = "LearnOpenGL - " + std::to_string(total_samples) + " spp";
+                SDL_SetWindowTitle(gWindow, title.c_str());
 
-    sphere ground = sphere(100.0, vec3(0.0, -100.5, -1.0), &mat_ground);
-    sphere centre = sphere(0.5, vec3(0.0, 0.0, -1.2), &mat_centre);
-    sphere centre_bubble = sphere(0.4, vec3(0.0, 0.0, -1.2), &mat_left_bubble);
-    sphere left = sphere(0.5, vec3(-1.0, 0.0, -1.0), &mat_left);
-    sphere left_bubble = sphere(0.4, vec3(-1.0, 0.0, -1.0), &mat_left_bubble);
-    sphere right = sphere(0.5, vec3(1.0, 0.0, -1.0), &mat_right);
-
-    auto R = std::cos(pi/4);
-
-    sphere left2 = sphere(R, vec3(-R, 0, -1), &mat_left2);
-    sphere right2 = sphere(R, vec3(R, 0, -1), &mat_right2);
-
-    objects.add(sphereUBO, ground);
-    objects.add(sphereUBO, centre);
-    objects.add(sphereUBO, centre_bubble);
-    objects.add(sphereUBO, left);
-    objects.add(sphereUBO, left_bubble);
-    objects.add(sphereUBO, right);
-
-    //objects.add(sphereUBO, left2);
-    //objects.add(sphereUBO, right2);
-
-   /*
-
-    lambertian ground_material = lambertian(colour(0.5, 0.5, 0.5));
-    sphere ground = sphere(1000, point3(0, -1000, 0), &ground_material);
-    materials.add(matUBO, ground_material);
-    objects.add(sphereUBO, ground);
-
-    dialectric material1 = dialectric(1.5);
-    lambertian material2 = lambertian(colour(0.4, 0.2, 0.1));
-    metallic   material3 = metallic(colour(0.7, 0.6, 0.5), 0.0);
-
-    materials.add(matUBO, material1);
-    materials.add(matUBO, material2);
-    materials.add(matUBO, material3);
-
-    sphere     sphere1 = sphere(1.0, point3(0, 1, 0), &material1);
-    sphere     sphere2 = sphere(1.0, point3(-4, 1, 0), &material2);
-    sphere     sphere3 = sphere(1.0, point3(4, 1, 0), &material3);
-
-    objects.add(sphereUBO, sphere1);
-    objects.add(sphereUBO, sphere2);
-    objects.add(sphereUBO, sphere3);
-
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_float();
-            point3 centre(a + 0.9*random_float(), 0.2, b + 0.9*random_float());
-
-            if ((centre - point3(4, 0.2, 0)).length() > 0.9) {
-
-                if (choose_mat < 0.8) {
-                    auto albedo = colour::random() * colour::random();
-                    lambertian sphere_material = lambertian(albedo);
-                    materials.add(matUBO, sphere_material);
-                    sphere spherex = sphere(0.2, centre, &sphere_material);
-                    objects.add(sphereUBO, spherex);
-                } else if (choose_mat < 0.95) {
-                    auto albedo = colour::random(0.5, 1);
-                    auto fuzz = random_float(0, 0.5);
-                    metallic sphere_material = metallic(albedo, fuzz);
-                    materials.add(matUBO, sphere_material);
-                    sphere spherex = sphere(0.2, centre, &sphere_material);
-                    objects.add(sphereUBO, spherex);
-                } else {
-                    dialectric sphere_material = dialectric(1.5);
-                    materials.add(matUBO, sphere_material);
-                    sphere spherex = sphere(0.2, centre, &sphere_material);
-                    objects.add(sphereUBO, spherex);
+                // (the first pass is the odd one out, the threads are starting up)
+                if (TARGET_FPS > 0.0f && rendering && frame_index > 1) {
+                    new_width = pick_render_width(RENDER_WIDTH, float(cpu->pass_ms));
+                }
+
+                // (a resize starts the next pass itself)
+                if (PROGRESSIVE && rendering && new_width == RENDER_WIDTH) {
+                    cpu->start_pass(frame_index);
                 }
             }
         }
-    }
+        // Add another pass of samples on top of the last one, as many
+        // tiles of it as fit in this frame
+        else if (rendering && (PROGRESSIVE || frame_index == 0))
+        {
+            int accum_write = 1 - accum_read;
 
-    */
+            // Build this pass's reservoirs in one go before its first tile
+            // (the spatial pass reads its neighbours, so it can't be tiled)
+            if (pass_start && RESTIR)
+            {
+                restir_pass(*restirTemporal, cam, restir_temporal, restirfb[restir_read], objects, materials, tree, frame_index);
+                restir_pass(*restirSpatial, cam, restirfb[1 - restir_read], restir_temporal, objects, materials, tree, frame_index);
+                restir_read = 1 - restir_read;
+
+                glActiveTexture(GL_TEXTURE8);
+                glBindTexture(GL_TEXTURE_2D, restirfb[restir_read].tex);
+                glActiveTexture(GL_TEXTURE9);
+                glBindTexture(GL_TEXTURE_2D, restirfb[restir_read].extra[0]);
+                glActiveTexture(GL_TEXTURE10);
+                glBindTexture(GL_TEXTURE_2D, restirfb[restir_read].extra[1]);
+                glActiveTexture(GL_TEXTURE0);
+            }
 
+            // A fresh render's first pass goes through the ladder's buffer
+            // a level at a time (cleared, so the pixels past the edge that
+            // never get traced read as empty)
+            if (pass_start && refine_level == 0)
+            {
+                glBindFramebuffer(GL_FRAMEBUFFER, refinefb.fbo);
+                glViewport(0, 0, REFINE_GRID * refine_block_size(RENDER_WIDTH), REFINE_GRID * refine_block_size(RENDER_HEIGHT));
+                glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+                glClearStencil(0);
+                glClear(GL_COLOR_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+
+                refine_scheduler = refine_tiles(0);
+                refine_ms = 0.0f;
+            }
 
-    // bind frame buffer for offscreen rendering
-    glBindFramebuffer(GL_FRAMEBUFFER, upscalefb.fbo);
-    glViewport(0, 0, RENDER_WIDTH, RENDER_HEIGHT);
-    glBindTexture(GL_TEXTURE_2D, perlinfb.tex);
+            pass_start = false;
 
-    // Clear colour buffer
-    glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT);
+            bool refining = refine_level < REFINE_LEVELS;
+            tile_scheduler &tiles = refining ? refine_scheduler : scheduler;
+            fb_help &target = refining ? refinefb : accumfb[accum_write];
 
-    // Activate shader
-    ourShader.use();
+            tiles.begin_frame();
+            while (tiles.has_time())
+            {
+                const tile &t = tiles.next_tile();
 
-    // Shader uniforms
-    uint32_t timeValue = SDL_GetTicks();
-    ourShader.setUint("time_u32t", timeValue);
-    ourShader.setInt("num_samples", NUM_SAMPLES);
-    ourShader.setUint("bounce_limit", BOUNCE_LIMIT);
-    ourShader.setVec3("delta_u", cam.delta_u);
-    ourShader.setVec3("delta_v", cam.delta_v);
-    ourShader.setVec3("camera_origin", cam.lookat);
-    ourShader.setVec3("viewport_top_left", cam.viewport_top_left);
-    ourShader.setFloat("defocus_angle", cam.defocus_angle);
-    ourShader.setVec3("defocus_disk_u", cam.defocus_disc_u);
-    ourShader.setVec3("defocus_disk_v", cam.defocus_disc_v);
-    ourShader.setInt("num_spheres", objects.num);
+                Uint64 tile_start = SDL_GetPerformanceCounter();
+                shader_chunk_pass(t.c_min, t.c_max, ourShader, cam, target, seed_noise.tex, accumfb[accum_read], objects, materials, tree, frame_index, refining);
+                glFinish(); // wait for the tile so the timing is real
+                Uint64 tile_end = SDL_GetPerformanceCounter();
 
-    // Draw triangles
-    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0); 
+                tiles.finish_tile(1000.0f * (tile_end - tile_start) / SDL_GetPerformanceFrequency());
+            }
 
-    while (!gQuit)
-    {
-        // Input
+            bool pass_done = tiles.pass_done();
+            float pass_ms = tiles.pass_ms;
 
-        // Rendering
+            // Show each of the ladder's levels as it's done, the last one
+            // finishes the pass
+            if (refining && pass_done)
+            {
+                refine_ms += pass_ms;
+                std::cout << "Refine level " << refine_level << ": " << refine_ms << " ms" << std::endl;
+
+                refine_level++;
+                if (refine_level < REFINE_LEVELS)
+                {
+                    refine_scheduler = refine_tiles(refine_level);
+                    preview_due = true;
+                    pass_done = false;
+                }
+                else
+                {
+                    refine_finish(refineShader, accumfb[accum_write], refinefb);
+                    pass_ms = refine_ms;
+                }
+            }
+
+            // Only show a pass once every tile of it is done
+            if (pass_done)
+            {
+                scheduler.begin_pass();
+                accum_read = accum_write;
+                pass_start = true;
+                denoise_due = true;
+                upscale_due = true;
+
+                if (UPSCALE_JITTER) {
+                    upscale_history(historyShader, historyfb, accumfb[accum_read], accumfb[1 - accum_read], frame_index);
+                }
+                frame_index++;
+                total_samples += NUM_SAMPLES;
+                pixel_samples += double(NUM_SAMPLES) * noisy_pixels;
+                bool traced_all = noisy_pixels == num_pixels;
+
+                // Carry converged pixels over to the next pass and stencil
+                // them out of its tiles. This is also the convergence check.
+                if (ADAPTIVE)
+                {
+                    noisy_pixels = num_pixels - adaptive_mask(maskShader, accumfb[1 - accum_read], accumfb[accum_read], maskQuery);
+                }
+                rendering = !render_finished(total_samples, noisy_pixels);
+
+                // (the first pass also waits for the driver to compile the shader)
+                if (TARGET_FPS > 0.0f && rendering && frame_index > 1 && traced_all) {
+                    new_width = pick_render_width(RENDER_WIDTH, pass_ms);
+                }
+
+                if (USE_SSBO)
+                {
+                    uint32_t counts[2];
+                    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+                    glBindBuffer(GL_SHADER_STORAGE_BUFFER, rouletteSSBO);
+                    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counts), counts);
+                    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(roulette_zero), roulette_zero);
+                    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+                    std::cout << "GPU pass " << frame_index << ": roulette stopped "
+                              << counts[0] << " paths, " << counts[1] << " carried on" << std::endl;
+                }
+                if (ADAPTIVE)
+                {
+                    std::cout << "GPU pass " << frame_index << ": " << noisy_pixels << " of "
+                              << num_pixels << " pixels still noisy" << std::endl;
+                }
+
+                std::string title = "LearnOpenGL - " + std::to_string(total_samples) + " spp";
+                SDL_SetWindowTitle(gWindow, title.c_str());
+            }
+        }
+
+        // Resolve: average the accumulated samples and gamma correct (or
+        // denoise, which does that too, once per pass). While the ladder's
+        // going, its levels so far instead.
+        bool previewing = refine_level > 0 && refine_level < REFINE_LEVELS;
+        if (previewing)
+        {
+            if (preview_due) {
+                refine_preview(previewShader, upscalefb, refinefb, refine_level - 1);
+                preview_due = false;
+            }
+        }
+        else if (DENOISE && !USE_CPU)
+        {
+            if (denoise_due) {
+                denoise(denoiseShader, upscalefb, denoisefb, accumfb[accum_read]);
+                denoise_due = false;
+            }
+        }
+        else if (!DENOISE && !UPSCALE)
+        {
+            glBindFramebuffer(GL_FRAMEBUFFER, upscalefb.fbo);
+            glViewport(0, 0, RENDER_WIDTH, RENDER_HEIGHT);
+            resolveShader.use();
+            glBindTexture(GL_TEXTURE_2D, accumfb[accum_read].tex);
+            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+        }
+
+        // (reads the accumulation buffer itself, or the denoiser's output)
+        if (UPSCALE && upscale_due && !previewing)
+        {
+            upscale(upscaleShader, displayfb, accumfb[accum_read], upscalefb, guidefb, historyfb);
+            upscale_due = false;
+        }
 
         // bind back to default frame buffer to display rendered texture
         glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -547,31 +1196,58 @@ int main(int argc, char* args[])
         glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT);
         texShader.use();
-        glBindTexture(GL_TEXTURE_2D, upscalefb.tex);
+        glBindTexture(GL_TEXTURE_2D, (UPSCALE && !previewing) ? displayfb.tex : upscalefb.tex);
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 
+        if (!rendering && !reported)
+        {
+            std::cout << "Finished after " << frame_index << " passes: " << total_samples << " spp, "
+                      << pixel_samples / num_pixels << " spp on average" << std::endl;
+            reported = true;
+            if (!OUTPUT_PATH.empty()) {
+                gQuit = true;
+            }
+        }
 
         // Events
-        event_handling();
+        if (event_handling(cam)) {
+            camera_moved = true;
+        }
 
         // Swap buffers
         SDL_GL_SwapWindow(gWindow);
     }
+
+    if (!OUTPUT_PATH.empty()) {
+        save_ppm(UPSCALE ? displayfb : upscalefb, OUTPUT_PATH);
+    }
+
+    delete cpu_denoise;
+    delete cpu;
+    delete restirTemporal;
+    delete restirSpatial;
+    delete guideShader;
     
     close();
 
     return 0;
 }
 
-void createFrameBuffer(fb_help &fb)
+void createFrameBuffer(fb_help &fb, GLint internal_format, GLenum format, GLenum type, int width, int height)
 {
+    fb = fb_help(); // (no extra attachments yet)
+    if (width == 0) {
+        width = RENDER_WIDTH;
+        height = RENDER_HEIGHT;
+    }
+
     glGenFramebuffers(1, &(fb.fbo));
     glBindFramebuffer(GL_FRAMEBUFFER, fb.fbo);
 
     glGenTextures(1, &(fb.tex));
     glBindTexture(GL_TEXTURE_2D, fb.tex);
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, RENDER_WIDTH, RENDER_HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, type, NULL);
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -580,14 +1256,14 @@ void createFrameBuffer(fb_help &fb)
 
     glGenRenderbuffers(1, &(fb.rbo));
     glBindRenderbuffer(GL_RENDERBUFFER, fb.rbo);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, RENDER_WIDTH, RENDER_HEIGHT);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
     glBindRenderbuffer(GL_RENDERBUFFER, 0);
 
     glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, fb.rbo);
 
-    if(glCheckFramebufferStatus(GL_FRAMEBUFFER == GL_FRAMEBUFFER_COMPLETE))
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
     {
-        std::cout << "Framebuffer is complete!!!" << std::endl;
+        std::cerr << "Framebuffer is not complete!" << std::endl;
     }
 
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -595,36 +1271,509 @@ void createFrameBuffer(fb_help &fb)
     return;
 }
 
-void shader_chunk_pass(vec2 c_min, vec2 c_max, Shader shader, Camera cam, fb_help fb, fb_help tex, hittable_list objects) {
+void addAttachment(fb_help &fb, int index, GLint internal_format, GLenum format, GLenum type)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, fb.fbo);
+
+    // (the same size as the rest)
+    int width, height;
+    glBindTexture(GL_TEXTURE_2D, fb.tex);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+
+    unsigned int &tex = fb.extra[index - 1];
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, type, NULL);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + index, GL_TEXTURE_2D, tex, 0);
+
+    GLenum buffers[4] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3};
+    glDrawBuffers(index + 1, buffers);
+
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        std::cerr << "Framebuffer is not complete!" << std::endl;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void deleteFrameBuffer(fb_help &fb)
+{
+    // (GL skips the 0 names of ones that weren't created)
+    glDeleteFramebuffers(1, &fb.fbo);
+    glDeleteTextures(1, &fb.tex);
+    glDeleteTextures(3, fb.extra);
+    glDeleteRenderbuffers(1, &fb.rbo);
+    fb = fb_help();
+}
+
+void create_render_targets(fb_help &upscalefb, fb_help accumfb[2], fb_help denoisefb[2], fb_help restirfb[2], fb_help &restir_temporal, fb_help &refinefb)
+{
+    createFrameBuffer(upscalefb);
+
+    // rgb = sum of samples, a = sample count, then the luminance moments
+    // for the convergence test and the denoiser, the guides' albedo and
+    // depth, and normal (for the denoiser and reprojection, which carries
+    // the moments along). The ladder's buffer has the same.
+    fb_help *accums[3] = {&accumfb[0], &accumfb[1], &refinefb};
+    for (int i = 0; i < (REFINE ? 3 : 2); i++)
+    {
+        fb_help &fb = *accums[i];
+        if (i < 2) {
+            createFrameBuffer(fb, ACCUM_FORMAT, GL_RGBA, GL_FLOAT);
+        } else {
+            createFrameBuffer(fb, ACCUM_FORMAT, GL_RGBA, GL_FLOAT, REFINE_GRID * refine_block_size(RENDER_WIDTH), REFINE_GRID * refine_block_size(RENDER_HEIGHT));
+        }
+        if (ADAPTIVE || DENOISE || REPROJECT || UPSCALE) {
+            addAttachment(fb, 1, GL_RG32F, GL_RG, GL_FLOAT);
+        }
+        if (DENOISE || REPROJECT || UPSCALE) {
+            addAttachment(fb, 2, GL_RGBA32F, GL_RGBA, GL_FLOAT);
+            addAttachment(fb, 3, GL_RGBA32F, GL_RGBA, GL_FLOAT);
+        }
+    }
+
+    if (DENOISE)
+    {
+        createFrameBuffer(denoisefb[0], GL_RGBA32F, GL_RGBA, GL_FLOAT);
+        createFrameBuffer(denoisefb[1], GL_RGBA32F, GL_RGBA, GL_FLOAT);
+    }
+
+    // (light point, W), (light, M), (surface point, sphere)
+    if (RESTIR)
+    {
+        fb_help *reservoirs[3] = {&restirfb[0], &restirfb[1], &restir_temporal};
+        for (fb_help *fb : reservoirs)
+        {
+            createFrameBuffer(*fb, GL_RGBA32F, GL_RGBA, GL_FLOAT);
+            addAttachment(*fb, 1, GL_RG32F, GL_RG, GL_FLOAT);
+            addAttachment(*fb, 2, GL_RGBA32F, GL_RGBA, GL_FLOAT);
+
+            glBindFramebuffer(GL_FRAMEBUFFER, fb->fbo);
+            glViewport(0, 0, RENDER_WIDTH, RENDER_HEIGHT);
+            glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+            glClear(GL_COLOR_BUFFER_BIT);
+        }
+    }
+
+    // No samples yet, and nothing has converged
+    for (int i = 0; i < 2; i++)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, accumfb[i].fbo);
+        glViewport(0, 0, RENDER_WIDTH, RENDER_HEIGHT);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClearStencil(0);
+        glClear(GL_COLOR_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+int pick_render_width(int width, float pass_ms)
+{
+    float target_ms = 1000.0f / TARGET_FPS;
+
+    // A pass costs about the same per pixel at any size. The largest step
+    // that should fit wins, but going up has to leave a margin so the next
+    // pass doesn't come straight back down.
+    int best = 0;
+    for (int k = 1; k <= RESOLUTION_STEPS; k++)
+    {
+        int w = SCREEN_WIDTH * k / RESOLUTION_STEPS;
+        float scale = float(w) / float(width);
+        float limit = w > width ? 0.8f * target_ms : target_ms;
+        if (pass_ms * scale * scale <= limit) {
+            best = w;
+        }
+    }
+
+    // Stay put until a pass is well over (or there's nothing smaller)
+    if (best < width && pass_ms <= 1.2f * target_ms) {
+        return width;
+    }
+    return best > 0 ? best : SCREEN_WIDTH / RESOLUTION_STEPS;
+}
+
+void shader_chunk_pass(vec2 c_min, vec2 c_max, Shader &shader, Camera &cam, fb_help &fb, unsigned int seed_tex, fb_help &prev, hittable_list &objects, material_list &materials, bvh &tree, uint32_t frame_index, bool refine) {
 
     // bind frame buffer for offscreen rendering
+    vec2 block = refine ? vec2{float(refine_block_size(RENDER_WIDTH)), float(refine_block_size(RENDER_HEIGHT))} : vec2{0.0f, 0.0f};
     glBindFramebuffer(GL_FRAMEBUFFER, fb.fbo);
-    glViewport(0, 0, RENDER_WIDTH, RENDER_HEIGHT);
-    glBindTexture(GL_TEXTURE_2D, tex.tex);
+    if (refine) {
+        glViewport(0, 0, REFINE_GRID * int(block.x), REFINE_GRID * int(block.y));
+    } else {
+        glViewport(0, 0, RENDER_WIDTH, RENDER_HEIGHT);
+    }
+
+    // Only touch pixels inside the chunk
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(int(c_min.x), int(c_min.y), int(c_max.x - c_min.x), int(c_max.y - c_min.y));
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, seed_tex);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, prev.tex);
+    if (ADAPTIVE || DENOISE || REPROJECT || UPSCALE) {
+        glActiveTexture(GL_TEXTURE11);
+        glBindTexture(GL_TEXTURE_2D, prev.extra[0]);
+    }
+    if (DENOISE || REPROJECT || UPSCALE) {
+        glActiveTexture(GL_TEXTURE12);
+        glBindTexture(GL_TEXTURE_2D, prev.extra[1]);
+        glActiveTexture(GL_TEXTURE13);
+        glBindTexture(GL_TEXTURE_2D, prev.extra[2]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    // Skip the pixels adaptive_mask() has marked as done
+    if (ADAPTIVE) {
+        glEnable(GL_STENCIL_TEST);
+        glStencilFunc(GL_EQUAL, 0, 0xFF);
+        glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+    }
 
     // Activate shader
     shader.use();
+    set_scene_uniforms(shader, cam, objects, materials, tree, frame_index);
+    shader.setVec2("refine_block", block);
+
+    // Draw triangles
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0); 
+
+    glDisable(GL_SCISSOR_TEST);
+    glDisable(GL_STENCIL_TEST);
+
+    return;
+}
+
+int adaptive_mask(Shader &shader, fb_help &fb, fb_help &prev, unsigned int query)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, fb.fbo);
+    glViewport(0, 0, RENDER_WIDTH, RENDER_HEIGHT);
+
+    // Every pixel starts unmarked, the ones the shader doesn't discard get 1
+    glClearStencil(0);
+    glClear(GL_STENCIL_BUFFER_BIT);
+    glEnable(GL_STENCIL_TEST);
+    glStencilFunc(GL_ALWAYS, 1, 0xFF);
+    glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, prev.tex);
+    glActiveTexture(GL_TEXTURE11);
+    glBindTexture(GL_TEXTURE_2D, prev.extra[0]);
+    if (DENOISE || REPROJECT || UPSCALE) {
+        glActiveTexture(GL_TEXTURE12);
+        glBindTexture(GL_TEXTURE_2D, prev.extra[1]);
+        glActiveTexture(GL_TEXTURE13);
+        glBindTexture(GL_TEXTURE_2D, prev.extra[2]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    shader.use();
+    glBeginQuery(GL_SAMPLES_PASSED, query);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    glEndQuery(GL_SAMPLES_PASSED);
 
-    // Shader uniforms
+    glDisable(GL_STENCIL_TEST);
+
+    // (waits for the pass, but it's a cheap one)
+    GLuint converged = 0;
+    glGetQueryObjectuiv(query, GL_QUERY_RESULT, &converged);
+    return int(converged);
+}
+
+void denoise(Shader &shader, fb_help &out, fb_help scratch[2], fb_help &accum)
+{
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, accum.tex);
+    for (int i = 0; i < 3; i++) {
+        glActiveTexture(GL_TEXTURE11 + i);
+        glBindTexture(GL_TEXTURE_2D, accum.extra[i]);
+    }
+
+    shader.use();
+    for (int i = 0; i < DENOISE_ITERATIONS; i++)
+    {
+        bool last = i == DENOISE_ITERATIONS - 1;
+        glBindFramebuffer(GL_FRAMEBUFFER, last ? out.fbo : scratch[i % 2].fbo);
+        glViewport(0, 0, RENDER_WIDTH, RENDER_HEIGHT);
+
+        glActiveTexture(GL_TEXTURE14);
+        glBindTexture(GL_TEXTURE_2D, scratch[1 - i % 2].tex); // (unused by the first)
+
+        shader.setInt("step_size", 1 << i);
+        shader.setBool("first", i == 0);
+        shader.setBool("last", last);
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    }
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void reproject(Shader &shader, Camera &cam, Camera &prev_cam, fb_help &fb, fb_help &prev)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, fb.fbo);
+    glViewport(0, 0, RENDER_WIDTH, RENDER_HEIGHT);
+    glClearStencil(0);
+    glClear(GL_STENCIL_BUFFER_BIT);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, prev.tex);
+    for (int i = 0; i < 3; i++) {
+        glActiveTexture(GL_TEXTURE11 + i);
+        glBindTexture(GL_TEXTURE_2D, prev.extra[i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    shader.use();
+    shader.setVec3("camera_origin", cam.lookfrom);
+    shader.setVec3("viewport_top_left", cam.viewport_top_left);
+    shader.setVec3("delta_u", cam.delta_u);
+    shader.setVec3("delta_v", cam.delta_v);
+    shader.setVec3("prev_origin", prev_cam.lookfrom);
+    shader.setVec3("prev_top_left", prev_cam.viewport_top_left);
+    shader.setVec3("prev_delta_u", prev_cam.delta_u);
+    shader.setVec3("prev_delta_v", prev_cam.delta_v);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+}
+
+void guide_pass(Shader &shader, Camera cam, fb_help &fb, hittable_list &objects, material_list &materials, bvh &tree)
+{
+    camera_setup(cam, SCREEN_WIDTH, SCREEN_HEIGHT);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fb.fbo);
+    glViewport(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+
+    shader.use();
+    set_scene_uniforms(shader, cam, objects, materials, tree, 0);
+    shader.setInt("num_samples", UPSCALE_GUIDE_SAMPLES);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+}
+
+vec2 pixel_jitter(uint32_t frame_index)
+{
+    // Radical inverses in bases 2 and 3
+    int index = int(frame_index % UPSCALE_JITTER_PHASES) + 1;
+    float j[2] = {0.0f, 0.0f};
+    int bases[2] = {2, 3};
+    for (int d = 0; d < 2; d++)
+    {
+        float scale = 1.0f / bases[d];
+        for (int i = index; i > 0; i /= bases[d])
+        {
+            j[d] += scale * (i % bases[d]);
+            scale /= bases[d];
+        }
+    }
+    return vec2{j[0] - 0.5f, j[1] - 0.5f};
+}
+
+void upscale_history(Shader &shader, fb_help &history, fb_help &accum, fb_help &prev, uint32_t frame_index)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, history.fbo);
+    glViewport(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, accum.tex);
+    glActiveTexture(GL_TEXTURE14);
+    glBindTexture(GL_TEXTURE_2D, prev.tex);
+    glActiveTexture(GL_TEXTURE0);
+
+    shader.use();
+    shader.setVec2("pixel_jitter", pixel_jitter(frame_index));
+    shader.setVec2("jitter_spread", vec2{float(RENDER_WIDTH) / SCREEN_WIDTH, float(RENDER_HEIGHT) / SCREEN_HEIGHT});
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    glDisable(GL_BLEND);
+}
+
+void upscale(Shader &shader, fb_help &out, fb_help &accum, fb_help &colour, fb_help &guide, fb_help &history)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, out.fbo);
+    glViewport(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, accum.tex);
+    glActiveTexture(GL_TEXTURE12);
+    glBindTexture(GL_TEXTURE_2D, accum.extra[1]);
+    glActiveTexture(GL_TEXTURE13);
+    glBindTexture(GL_TEXTURE_2D, accum.extra[2]);
+    glActiveTexture(GL_TEXTURE14);
+    glBindTexture(GL_TEXTURE_2D, colour.tex);
+    glActiveTexture(GL_TEXTURE15);
+    glBindTexture(GL_TEXTURE_2D, guide.tex);
+    glActiveTexture(GL_TEXTURE11);
+    glBindTexture(GL_TEXTURE_2D, guide.extra[0]);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, history.tex);
+
+    shader.use();
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+}
+
+tile_scheduler refine_tiles(int level)
+{
+    int block_w = refine_block_size(RENDER_WIDTH);
+    int block_h = refine_block_size(RENDER_HEIGHT);
+
+    // Columns x0 to x1 of block rows y0 to y1 (a level is part of one row or
+    // whole rows), and the rows count down from the top
+    int first = refine_first_block(level);
+    int last = refine_first_block(level + 1) - 1;
+    int x0 = first % REFINE_GRID, x1 = last % REFINE_GRID + 1;
+    int y0 = first / REFINE_GRID, y1 = last / REFINE_GRID + 1;
+
+    return tile_scheduler((x1 - x0) * block_w, (y1 - y0) * block_h, TILE_SIZE, FRAME_BUDGET_MS,
+                          x0 * block_w, (REFINE_GRID - y1) * block_h);
+}
+
+void refine_preview(Shader &shader, fb_help &out, fb_help &refine, int level)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, out.fbo);
+    glViewport(0, 0, RENDER_WIDTH, RENDER_HEIGHT);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, refine.tex);
+    glActiveTexture(GL_TEXTURE0);
+
+    shader.use();
+    shader.setInt("level", level);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+}
+
+void refine_finish(Shader &shader, fb_help &fb, fb_help &refine)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, fb.fbo);
+    glViewport(0, 0, RENDER_WIDTH, RENDER_HEIGHT);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, refine.tex);
+    for (int i = 0; i < 3; i++) {
+        glActiveTexture(GL_TEXTURE11 + i);
+        glBindTexture(GL_TEXTURE_2D, refine.extra[i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    shader.use();
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+}
+
+void upload_cpu_buffers(cpu_renderer &cpu, fb_help &fb)
+{
+    // (the CPU's rows are padded, see cpu_renderer::row_stride())
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, cpu.stride);
+    glBindTexture(GL_TEXTURE_2D, fb.tex);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, RENDER_WIDTH, RENDER_HEIGHT, GL_RGBA, GL_FLOAT, cpu.accum.data());
+    glBindTexture(GL_TEXTURE_2D, fb.extra[0]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, RENDER_WIDTH, RENDER_HEIGHT, GL_RG, GL_FLOAT, cpu.moments.data());
+    glBindTexture(GL_TEXTURE_2D, fb.extra[1]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, RENDER_WIDTH, RENDER_HEIGHT, GL_RGBA, GL_FLOAT, cpu.albedo.data());
+    glBindTexture(GL_TEXTURE_2D, fb.extra[2]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, RENDER_WIDTH, RENDER_HEIGHT, GL_RGBA, GL_FLOAT, cpu.normals.data());
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+void download_cpu_buffers(cpu_renderer &cpu, fb_help &fb)
+{
+    glPixelStorei(GL_PACK_ROW_LENGTH, cpu.stride);
+    glBindTexture(GL_TEXTURE_2D, fb.tex);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, cpu.accum.data());
+    glBindTexture(GL_TEXTURE_2D, fb.extra[0]);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RG, GL_FLOAT, cpu.moments.data());
+    glBindTexture(GL_TEXTURE_2D, fb.extra[1]);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, cpu.albedo.data());
+    glBindTexture(GL_TEXTURE_2D, fb.extra[2]);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, cpu.normals.data());
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+}
+
+bool render_finished(int total_samples, int noisy_pixels)
+{
+    int num_pixels = RENDER_WIDTH * RENDER_HEIGHT;
+    if (CONVERGE_FRACTION >= 0.0f && noisy_pixels <= CONVERGE_FRACTION * num_pixels) {
+        return true;
+    }
+    return MAX_SPP > 0 && total_samples >= MAX_SPP;
+}
+
+void save_ppm(fb_help &fb, const std::string &path)
+{
+    int width, height;
+    glBindTexture(GL_TEXTURE_2D, fb.tex);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+
+    std::vector<unsigned char> pixels(width * height * 3);
+    glBindFramebuffer(GL_FRAMEBUFFER, fb.fbo);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) {
+        std::cerr << "Couldn't write " << path << std::endl;
+        return;
+    }
+    fprintf(f, "P6\n%d %d\n255\n", width, height);
+    // GL's rows go bottom to top
+    for (int y = height - 1; y >= 0; y--) {
+        fwrite(&pixels[y * width * 3], 1, width * 3, f);
+    }
+    fclose(f);
+    std::cout << "Saved " << path << std::endl;
+}
+
+void restir_pass(Shader &shader, Camera &cam, fb_help &fb, fb_help &prev, hittable_list &objects, material_list &materials, bvh &tree, uint32_t frame_index)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, fb.fbo);
+    glViewport(0, 0, RENDER_WIDTH, RENDER_HEIGHT);
+
+    glActiveTexture(GL_TEXTURE8);
+    glBindTexture(GL_TEXTURE_2D, prev.tex);
+    glActiveTexture(GL_TEXTURE9);
+    glBindTexture(GL_TEXTURE_2D, prev.extra[0]);
+    glActiveTexture(GL_TEXTURE10);
+    glBindTexture(GL_TEXTURE_2D, prev.extra[1]);
+    glActiveTexture(GL_TEXTURE0);
+
+    shader.use();
+    set_scene_uniforms(shader, cam, objects, materials, tree, frame_index);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+}
+
+void set_scene_uniforms(Shader &shader, Camera &cam, hittable_list &objects, material_list &materials, bvh &tree, uint32_t frame_index)
+{
     uint32_t timeValue = SDL_GetTicks();
     shader.setUint("time_u32t", timeValue);
+    shader.setUint("frame_index", frame_index);
 
     shader.setInt("num_samples", NUM_SAMPLES);
     shader.setUint("bounce_limit", BOUNCE_LIMIT);
+    shader.setUint("rr_depth", RR_DEPTH);
 
     shader.setVec3("delta_u", cam.delta_u);
     shader.setVec3("delta_v", cam.delta_v);
-    shader.setVec3("camera_origin", cam.lookat);
+    shader.setVec3("camera_origin", cam.lookfrom);
     shader.setVec3("viewport_top_left", cam.viewport_top_left);
 
     shader.setFloat("defocus_angle", cam.defocus_angle);
     shader.setVec3("defocus_disk_u", cam.defocus_disc_u);
     shader.setVec3("defocus_disk_v", cam.defocus_disc_v);
 
-    shader.setInt("num_spheres", objects.num);
-
-    // Draw triangles
-    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0); 
+    if (UPSCALE_JITTER)
+    {
+        shader.setVec2("pixel_jitter", pixel_jitter(frame_index));
+        shader.setVec2("jitter_spread", vec2{float(RENDER_WIDTH) / SCREEN_WIDTH, float(RENDER_HEIGHT) / SCREEN_HEIGHT});
+    }
 
-    return;
+    shader.setInt("num_spheres", objects.num);
+    shader.setInt("num_nodes", int(tree.nodes.size()));
+    shader.setInt("num_lights", int(materials.lights.size()));
 }
\ No newline at end of file
@@ -0,0 +1,77 @@
+#ifndef REFINE_H
+#define REFINE_H
+
+// Refinement ladder for the first pass of a fresh render (--refine, see
+// raytrace.cpp). The image is split into REFINE_GRID x REFINE_GRID blocks,
+// and the pixels by where they are in their block (their phase):
+//
+//   level 0: the corner, 1 pixel in 16
+//   level 1: the other ones with both coordinates even, 3 in 16
+//   level 2: the rest, 12 in 16
+//
+// Each level is drawn whole before the next, so after level 0 there's a
+// pixel every 4 to fill the image in from, after level 1 every 2. Every
+// pixel is still traced once.
+//
+// Skipping pixels in a full screen draw would waste the GPU's lanes on
+// them, so the pass is drawn into a buffer sorted by phase instead: a 4x4
+// grid of blocks, one per phase, each about a quarter of the image across
+// (y counted down from the top, like the pixels in testFragment.fs). Block
+// s (in row-major order) is the s-th phase traced, so level 0 is the top
+// left block, level 1 the rest of the top row and level 2 the other three
+// rows, and each level is one rectangle. Shared by raytrace.cpp and the
+// shaders like denoise.h.
+
+#include "rng.h"
+
+#define REFINE_GRID 4
+#define REFINE_LEVELS 3
+
+// Pixels per block side for an image size pixels across (even, so the
+// GPU's 2x2 pixel quads never straddle two blocks or two levels)
+RNG_FN int refine_block_size(int size)
+{
+  return 2 * ((size + 2 * REFINE_GRID - 1) / (2 * REFINE_GRID));
+}
+
+// First block (in row-major order) of level, REFINE_GRID * REFINE_GRID
+// for the one after the last
+RNG_FN int refine_first_block(int level)
+{
+  if (level <= 0) return 0;
+  if (level == 1) return 1;
+  if (level == 2) return 4;
+  return REFINE_GRID * REFINE_GRID;
+}
+
+// Level of the pixel at phase (x, y) in its block
+RNG_FN int refine_level(int x, int y)
+{
+  if (x % 2 != 0 || y % 2 != 0) return 2;
+  return (x == 0 && y == 0) ? 0 : 1;
+}
+
+// Block the phase (x, y) is traced in
+RNG_FN int refine_slot(int x, int y)
+{
+  // Both even: 0 for the corner, then (2, 0), (0, 2), (2, 2)
+  if (x % 2 == 0 && y % 2 == 0) return x / 2 + 2 * (y / 2);
+
+  // The rest in rows, 2 from each even one and 4 from each odd one
+  return 4 + 6 * (y / 2) + (y % 2 != 0 ? 2 + x : x / 2);
+}
+
+// Phase (x, y) of the pixels traced in block s (refine_slot() backwards)
+RNG_FN void refine_phase(int s, RNG_INOUT(int) x, RNG_INOUT(int) y)
+{
+  if (s < 4) {
+    x = 2 * (s % 2);
+    y = 2 * (s / 2);
+    return;
+  }
+  int k = (s - 4) % 6;
+  y = 2 * ((s - 4) / 6) + (k < 2 ? 0 : 1);
+  x = k < 2 ? 2 * k + 1 : k - 2;
+}
+
+#endif
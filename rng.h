@@ -0,0 +1,105 @@
+#ifndef RNG_H
+#define RNG_H
+
+// Counter based random numbers, shared by the C++ side (vec3.h,
+// cpu_renderer.h) and the shaders (testFragment.fs #includes this file, see
+// Shader::resolveIncludes()). So it has to be valid C++ and valid GLSL at
+// the same time, which is what the RNG_ macros are for.
+//
+// There's no sequence to step through: every number is a hash of where
+// it's used, (pixel x, pixel y, sample, bounce, dimension), with the PCG
+// hash from "Hash Functions for GPU Rendering" (Jarzynski & Olano 2020).
+// Threads never share state, and the CPU and GPU get the same numbers for
+// the same pixel and sample.
+//
+// rng_state caches the hash of everything but the dimension, which just
+// counts up as numbers are drawn:
+//
+//   rng_state s = rng_init(x, y, sample);  // (camera ray is bounce 0)
+//   float u = rng_next(s);                  // dimension 0, 1, 2...
+//   rng_set_bounce(s, 1u);                  // back to dimension 0
+//
+// A few of the numbers (camera jitter and lens, scatter directions) come
+// from the quasi random points in sampler.h instead, which is what the
+// pixel, sample and bounce kept in rng_state are for.
+
+#ifdef __cplusplus
+#include <cstdint>
+#define RNG_UINT uint32_t
+#define RNG_FN inline
+#define RNG_INOUT(T) T&
+#else
+#define RNG_UINT uint
+#define RNG_FN
+#define RNG_INOUT(T) inout T
+#endif
+
+struct rng_state
+{
+  RNG_UINT key;        // hash of (x, y, sample)
+  RNG_UINT bounce_key; // ... and the bounce
+  RNG_UINT dim;
+  RNG_UINT pixel;      // x | y << 16
+  RNG_UINT sample_index;
+  RNG_UINT bounce;
+};
+
+RNG_FN RNG_UINT pcg_hash(RNG_UINT v)
+{
+  RNG_UINT state = v * 747796405u + 2891336453u;
+  RNG_UINT word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+
+// Top 24 bits to a float in [0, 1)
+RNG_FN float rng_to_float(RNG_UINT x)
+{
+  return float(x >> 8u) * 5.9604645e-8f;
+}
+
+RNG_FN RNG_UINT rng_bounce_key(RNG_UINT key, RNG_UINT bounce)
+{
+  return pcg_hash(key + bounce * 0x9E3779B9u);
+}
+
+RNG_FN rng_state rng_init(RNG_UINT x, RNG_UINT y, RNG_UINT sample)
+{
+  rng_state s;
+  s.key = pcg_hash(x + pcg_hash(y + pcg_hash(sample)));
+  s.bounce_key = rng_bounce_key(s.key, 0u);
+  s.dim = 0u;
+  s.pixel = x | (y << 16u);
+  s.sample_index = sample;
+  s.bounce = 0u;
+  return s;
+}
+
+RNG_FN void rng_set_bounce(RNG_INOUT(rng_state) s, RNG_UINT bounce)
+{
+  s.bounce_key = rng_bounce_key(s.key, bounce);
+  s.dim = 0u;
+  s.bounce = bounce;
+}
+
+RNG_FN RNG_UINT rng_next_uint(RNG_INOUT(rng_state) s)
+{
+  RNG_UINT x = pcg_hash(s.bounce_key + s.dim * 0x9E3779B9u);
+  s.dim += 1u;
+  return x;
+}
+
+RNG_FN float rng_next(RNG_INOUT(rng_state) s)
+{
+  return rng_to_float(rng_next_uint(s));
+}
+
+// The same number rng_next() would give, from scratch
+RNG_FN float rng_float(RNG_UINT x, RNG_UINT y, RNG_UINT sample, RNG_UINT bounce, RNG_UINT dim)
+{
+  rng_state s = rng_init(x, y, sample);
+  rng_set_bounce(s, bounce);
+  s.dim = dim;
+  return rng_next(s);
+}
+
+#endif
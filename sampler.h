@@ -0,0 +1,94 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+// Quasi Monte Carlo sample points, shared by the shader and the CPU
+// renderer like rng.h (and valid C++ and GLSL for the same reason).
+//
+// The camera ray's jitter and lens position and each bounce's scatter
+// direction and light sample use 2D points from a Sobol sequence (its
+// first two dimensions, which stay well stratified for any power of two
+// number of samples) instead of independent random numbers, so they cover
+// the pixel, disk or sphere evenly and the noise drops off faster than
+// plain Monte Carlo. Everything else (glass reflect or refract choice,
+// Russian roulette, which light to sample) still comes straight from rng.h.
+//
+// Each pair of dimensions (see SAMPLER_PAIRS) gets its own Owen scrambled
+// copy of the sequence, with the sample order shuffled too, using the hash
+// based scrambling from "Practical Hash-based Owen Scrambling" (Burley
+// 2020). The scramble seed is either:
+//
+//   - per pixel, so every pixel gets an independent point set, or
+//   - the same for every pixel (sampler_seed(s, pair, false)), with each
+//     pixel's points then shifted by a blue noise value (a Cranley-Patterson
+//     rotation, done by the caller with blue_noise.h / seedTexture). The
+//     error then ends up as blue noise across the image.
+
+#include "rng.h"
+
+// Dimension pairs per bounce. Bounce 0 is the camera ray, after that it's
+// the scatter direction and the point on a light for next event estimation.
+#define SAMPLER_PAIRS 2u
+#define SAMPLE_JITTER 0u
+#define SAMPLE_LENS 1u
+#define SAMPLE_SCATTER 0u
+#define SAMPLE_LIGHT 1u
+
+RNG_FN RNG_UINT reverse_bits(RNG_UINT x)
+{
+  x = ((x >> 1u) & 0x55555555u) | ((x & 0x55555555u) << 1u);
+  x = ((x >> 2u) & 0x33333333u) | ((x & 0x33333333u) << 2u);
+  x = ((x >> 4u) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4u);
+  // (a byte swap, which compilers spot)
+  return (x >> 24u) | ((x >> 8u) & 0xFF00u) | ((x << 8u) & 0xFF0000u) | (x << 24u);
+}
+
+// Sobol dimension 1, bit reversed (dimension 0 is just reverse_bits(index)).
+// Its generator matrix is Pascal's triangle mod 2, so (Lucas' theorem) bit
+// i of the result is the parity of the index bits j that have all of i's
+// bits set. That's a superset sum, one shift per bit of the bit position.
+RNG_FN RNG_UINT sobol_1_reversed(RNG_UINT index)
+{
+  index ^= (index >> 1u) & 0x55555555u;
+  index ^= (index >> 2u) & 0x33333333u;
+  index ^= (index >> 4u) & 0x0F0F0F0Fu;
+  index ^= (index >> 8u) & 0x00FF00FFu;
+  index ^= (index >> 16u) & 0x0000FFFFu;
+  return index;
+}
+
+// Laine & Karras' hash with Burley's constants. Each bit only depends on
+// the bits below it, so on bit reversed numbers it's an Owen scramble
+RNG_FN RNG_UINT laine_karras(RNG_UINT x, RNG_UINT seed)
+{
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+// Owen scrambling: flips each bit depending on a hash of the bits above it
+RNG_FN RNG_UINT owen_scramble(RNG_UINT x, RNG_UINT seed)
+{
+  return reverse_bits(laine_karras(reverse_bits(x), seed));
+}
+
+RNG_FN RNG_UINT sampler_seed(rng_state s, RNG_UINT pair, bool per_pixel)
+{
+  RNG_UINT id = (s.bounce * SAMPLER_PAIRS + pair) * 0x9E3779B9u;
+  return pcg_hash(per_pixel ? s.pixel + id : id + 0x5bd1e995u);
+}
+
+// Point number index of a shuffled, scrambled 2D Sobol sequence, as 32 bit
+// fixed point (rng_to_float() for [0, 1))
+RNG_FN void sobol_2d(RNG_UINT index, RNG_UINT seed, RNG_INOUT(RNG_UINT) x, RNG_INOUT(RNG_UINT) y)
+{
+  index = owen_scramble(index, seed);
+  // Both dimensions come out of Sobol bit reversed, which is what
+  // owen_scramble() would have reversed them to anyway
+  x = reverse_bits(laine_karras(index, pcg_hash(seed + 1u)));
+  y = reverse_bits(laine_karras(sobol_1_reversed(index), pcg_hash(seed + 2u)));
+}
+
+#endif
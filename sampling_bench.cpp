@@ -0,0 +1,163 @@
+// Time per sample of the direction/disk sampling routines: the old
+// rejection loops against the closed form warps in warp.h.
+//
+// Besides the time, the loops report how many tries they take, on average
+// and for the unluckiest of 32 lanes, which is what a warp running them in
+// lockstep waits for. (The warps always take one.)
+//
+// make bench && ./sampling_bench
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <algorithm>
+
+#include "vec3.h"
+#include "rng.h"
+#include "sampler.h"
+#include "warp.h"
+
+const int NUM_SAMPLES = 1 << 22;
+const int LANES = 32;
+
+volatile float sink;
+
+struct result {
+    float ns;
+    float tries;
+    float worst_tries;
+};
+
+// Same as the old testFragment.fs loops (including only covering the
+// positive octant / quadrant)
+vec3 rejection_unit_vector(rng_state &state, int &tries)
+{
+    while (true)
+    {
+        tries++;
+        vec3 p(rng_next(state), rng_next(state), rng_next(state));
+        float lensq = dot(p, p);
+        if (1e-30f < lensq && lensq <= 1) {
+            return p / std::sqrt(lensq);
+        }
+    }
+}
+
+vec3 rejection_unit_disk(rng_state &state, int &tries)
+{
+    while (true)
+    {
+        tries++;
+        vec3 p(rng_next(state), rng_next(state), 0);
+        if (dot(p, p) <= 1) {
+            return p;
+        }
+    }
+}
+
+vec3 rejection_hemisphere(rng_state &state, const vec3 &normal, int &tries)
+{
+    vec3 v = rejection_unit_vector(state, tries);
+    return normal + (dot(v, normal) >= 0 ? v : -v);
+}
+
+// Runs sample(state, tries) for every sample, one rng_state per sample like
+// the renderer, and sums the results into sink so nothing gets optimised out
+template <typename F>
+result run(F sample)
+{
+    vec3 sum;
+    long total_tries = 0;
+    long worst_tries = 0;
+    int lane_worst = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < NUM_SAMPLES; i++)
+    {
+        rng_state state = rng_init(uint32_t(i % 256), uint32_t(i / 256 % 256), uint32_t(i / 65536));
+        rng_set_bounce(state, 1u);
+        int tries = 0;
+        sum += sample(state, tries);
+
+        total_tries += tries;
+        lane_worst = std::max(lane_worst, tries);
+        if (i % LANES == LANES - 1) {
+            worst_tries += lane_worst;
+            lane_worst = 0;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    sink = sum[0] + sum[1] + sum[2];
+
+    result r;
+    r.ns = std::chrono::duration<float, std::nano>(end - start).count() / NUM_SAMPLES;
+    r.tries = float(total_tries) / NUM_SAMPLES;
+    r.worst_tries = float(worst_tries) / (NUM_SAMPLES / LANES);
+    return r;
+}
+
+void print(const std::string &name, const result &r)
+{
+    std::cout << std::left << std::setw(34) << name << std::right << std::fixed
+              << std::setprecision(2) << std::setw(8) << r.ns
+              << std::setw(10) << r.tries << std::setw(12) << r.worst_tries << std::endl;
+}
+
+int main()
+{
+    const vec3 normal = unit_vector(vec3(0.3f, 0.8f, -0.5f));
+
+    std::cout << std::left << std::setw(34) << "" << std::right << std::setw(8) << "ns"
+              << std::setw(10) << "tries" << std::setw(12) << "worst of " + std::to_string(LANES) << std::endl;
+
+    // Setting up the rng_state and drawing two numbers, which every row
+    // below pays too
+    print("(rng_state and two numbers)", run([](rng_state &s, int &tries) {
+        tries = 1;
+        return vec3(rng_next(s), rng_next(s), 0);
+    }));
+    print("unit vector, rejection", run([](rng_state &s, int &tries) {
+        return rejection_unit_vector(s, tries);
+    }));
+    print("unit vector, uniform_sphere", run([](rng_state &s, int &tries) {
+        tries = 1;
+        vec3 p;
+        uniform_sphere(rng_next(s), rng_next(s), p[0], p[1], p[2]);
+        return p;
+    }));
+
+    print("disk, rejection", run([](rng_state &s, int &tries) {
+        return rejection_unit_disk(s, tries);
+    }));
+    print("disk, concentric_disk", run([](rng_state &s, int &tries) {
+        tries = 1;
+        vec3 p;
+        concentric_disk(rng_next(s), rng_next(s), p[0], p[1]);
+        return p;
+    }));
+
+    print("diffuse bounce, rejection", run([&](rng_state &s, int &tries) {
+        return rejection_hemisphere(s, normal, tries);
+    }));
+    print("diffuse bounce, cosine_hemisphere", run([&](rng_state &s, int &tries) {
+        tries = 1;
+        vec3 d;
+        cosine_hemisphere(normal[0], normal[1], normal[2], rng_next(s), rng_next(s), d[0], d[1], d[2]);
+        return d;
+    }));
+
+    // What the renderer actually pays per bounce: a scrambled Sobol point
+    // and then the warp
+    print("  ... with sampler.h points", run([&](rng_state &s, int &tries) {
+        tries = 1;
+        uint32_t x, y;
+        sobol_2d(s.sample_index, sampler_seed(s, SAMPLE_SCATTER, true), x, y);
+        vec3 d;
+        cosine_hemisphere(normal[0], normal[1], normal[2], rng_to_float(x), rng_to_float(y), d[0], d[1], d[2]);
+        return d;
+    }));
+
+    return 0;
+}
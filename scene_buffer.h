@@ -0,0 +1,97 @@
+#ifndef SCENE_BUFFER_H
+#define SCENE_BUFFER_H
+
+#include <glad/glad.h>
+
+#include <vector>
+#include <iostream>
+#include <cstring>
+
+// GPU storage for scene data (an array of vec4s).
+//
+// On GL 4.3+ this is a shader storage buffer, otherwise it falls back to a
+// buffer texture (GL 3.3), read in the shader with texelFetch. Unlike the old
+// uniform blocks neither of these has a fixed size in the shader, so the
+// only limit is GL_MAX_TEXTURE_BUFFER_SIZE / GL_MAX_SHADER_STORAGE_BLOCK_SIZE.
+
+// Set once GL is loaded (see init())
+bool USE_SSBO = false;
+
+// Integer i stored bit for bit in a float slot, for the shader to read back
+// with floatBitsToInt(). Converted to a float it would only be exact up to
+// 2^24, and indexes into big scenes go past that.
+inline float int_bits(int i)
+{
+    float f;
+    std::memcpy(&f, &i, sizeof(f));
+    return f;
+}
+
+class scene_buffer
+{
+    public:
+    unsigned int buffer;
+    unsigned int tex;
+    int num_texels;
+
+    scene_buffer() : buffer{0}, tex{0}, num_texels{0} {};
+
+    void upload(const std::vector<float> &data)
+    {
+        num_texels = int(data.size() / 4);
+
+        // GL doesn't like zero sized buffers, keep at least one texel around
+        std::vector<float> padded = data;
+        if (padded.empty()) {
+            padded.resize(4, 0.0f);
+        }
+
+        GLenum target = USE_SSBO ? GL_SHADER_STORAGE_BUFFER : GL_TEXTURE_BUFFER;
+
+        if (buffer == 0) {
+            glGenBuffers(1, &buffer);
+        }
+        glBindBuffer(target, buffer);
+        glBufferData(target, padded.size() * sizeof(float), padded.data(), GL_STATIC_DRAW);
+        glBindBuffer(target, 0);
+
+        int max_size;
+        if (USE_SSBO) {
+            glGetIntegerv(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &max_size);
+            if (padded.size() * sizeof(float) > (size_t)max_size) {
+                std::cerr << "Scene buffer (" << padded.size() * sizeof(float) << " bytes) is bigger than GL_MAX_SHADER_STORAGE_BLOCK_SIZE (" << max_size << ")" << std::endl;
+            }
+        } else {
+            glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_size);
+            if (num_texels > max_size) {
+                std::cerr << "Scene buffer (" << num_texels << " texels) is bigger than GL_MAX_TEXTURE_BUFFER_SIZE (" << max_size << ")" << std::endl;
+            }
+
+            if (tex == 0) {
+                glGenTextures(1, &tex);
+            }
+            glBindTexture(GL_TEXTURE_BUFFER, tex);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, buffer);
+            glBindTexture(GL_TEXTURE_BUFFER, 0);
+        }
+    }
+
+    // name is the storage block (SSBO) or samplerBuffer uniform (TBO) in the shader,
+    // unit is the binding point / texture unit to use for it
+    void bind(unsigned int program, const char* name, int unit)
+    {
+        if (USE_SSBO) {
+            unsigned int block = glGetProgramResourceIndex(program, GL_SHADER_STORAGE_BLOCK, name);
+            glShaderStorageBlockBinding(program, block, unit);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, unit, buffer);
+        } else {
+            glUseProgram(program);
+            glUniform1i(glGetUniformLocation(program, name), unit);
+            glActiveTexture(GL_TEXTURE0 + unit);
+            glBindTexture(GL_TEXTURE_BUFFER, tex);
+            glActiveTexture(GL_TEXTURE0);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,271 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include <cmath>
+#include <vector>
+
+#include "vec3.h"
+#include "camera.h"
+#include "sphere.h"
+#include "hittable_list.h"
+#include "material_list.h"
+#include "material.h"
+
+// Scene setup functions. Each one fills in the object and material lists
+// and sets up the camera position (camera_setup() is called afterwards).
+
+void scene_default(hittable_list &objects, material_list &materials, Camera &cam)
+{
+    cam.lookfrom = point3(0, 10, 0);
+    cam.lookat = point3(0, -1, 0);
+    cam.vup = vec3(0, 0, 1);
+    cam.vfov = 90.0;
+    cam.defocus_angle = 0.6;
+    cam.focus_dist = 1.0;
+
+    // Add Materials
+    lambertian mat_ground = lambertian(vec3(0.8, 0.8, 0.0));
+    lambertian mat_centre = lambertian(vec3(0.1, 0.2, 0.5));
+    dialectric mat_left = dialectric(1.5);
+    dialectric mat_left_bubble = dialectric(1.0/1.5);
+    metallic mat_right = metallic(vec3(0.8, 0.6, 0.2), 0.0);
+
+    lambertian mat_left2 = lambertian(vec3(1.0, 0.0, 0.0));
+    lambertian mat_right2 = lambertian(vec3(0.0, 0.0, 1.0));
+
+    materials.add(mat_ground);
+    materials.add(mat_centre);
+    materials.add(mat_left);
+    materials.add(mat_right);
+    materials.add(mat_left_bubble);
+
+    materials.add(mat_left2);
+    materials.add(mat_right2);
+
+    // Add spheres
+    sphere ground = sphere(100.0, vec3(0.0, -100.5, -1.0), &mat_ground);
+    sphere centre = sphere(0.5, vec3(0.0, 0.0, -1.2), &mat_centre);
+    sphere centre_bubble = sphere(0.4, vec3(0.0, 0.0, -1.2), &mat_left_bubble);
+    sphere left = sphere(0.5, vec3(-1.0, 0.0, -1.0), &mat_left);
+    sphere left_bubble = sphere(0.4, vec3(-1.0, 0.0, -1.0), &mat_left_bubble);
+    sphere right = sphere(0.5, vec3(1.0, 0.0, -1.0), &mat_right);
+
+    auto R = std::cos(pi/4);
+
+    sphere left2 = sphere(R, vec3(-R, 0, -1), &mat_left2);
+    sphere right2 = sphere(R, vec3(R, 0, -1), &mat_right2);
+
+    objects.add(ground);
+    objects.add(centre);
+    objects.add(centre_bubble);
+    objects.add(left);
+    objects.add(left_bubble);
+    objects.add(right);
+
+    //objects.add(left2);
+    //objects.add(right2);
+}
+
+// The "random spheres" cover scene (about 480 spheres)
+void scene_random_spheres(hittable_list &objects, material_list &materials, Camera &cam)
+{
+    cam.lookfrom = point3(13, 2, 3);
+    cam.lookat = point3(0, 0, 0);
+    cam.vup = vec3(0, 1, 0);
+    cam.vfov = 20.0;
+    cam.defocus_angle = 0.6;
+    cam.focus_dist = 10.0;
+
+    lambertian ground_material = lambertian(colour(0.5, 0.5, 0.5));
+    materials.add(ground_material);
+    sphere ground = sphere(1000, point3(0, -1000, 0), &ground_material);
+    objects.add(ground);
+
+    dialectric material1 = dialectric(1.5);
+    lambertian material2 = lambertian(colour(0.4, 0.2, 0.1));
+    metallic   material3 = metallic(colour(0.7, 0.6, 0.5), 0.0);
+
+    materials.add(material1);
+    materials.add(material2);
+    materials.add(material3);
+
+    sphere     sphere1 = sphere(1.0, point3(0, 1, 0), &material1);
+    sphere     sphere2 = sphere(1.0, point3(-4, 1, 0), &material2);
+    sphere     sphere3 = sphere(1.0, point3(4, 1, 0), &material3);
+
+    objects.add(sphere1);
+    objects.add(sphere2);
+    objects.add(sphere3);
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_float();
+            point3 centre(a + 0.9*random_float(), 0.2, b + 0.9*random_float());
+
+            if ((centre - point3(4, 0.2, 0)).length() > 0.9) {
+
+                if (choose_mat < 0.8) {
+                    auto albedo = colour::random() * colour::random();
+                    lambertian sphere_material = lambertian(albedo);
+                    materials.add(sphere_material);
+                    sphere spherex = sphere(0.2, centre, &sphere_material);
+                    objects.add(spherex);
+                } else if (choose_mat < 0.95) {
+                    auto albedo = colour::random(0.5, 1);
+                    auto fuzz = random_float(0, 0.5);
+                    metallic sphere_material = metallic(albedo, fuzz);
+                    materials.add(sphere_material);
+                    sphere spherex = sphere(0.2, centre, &sphere_material);
+                    objects.add(spherex);
+                } else {
+                    dialectric sphere_material = dialectric(1.5);
+                    materials.add(sphere_material);
+                    sphere spherex = sphere(0.2, centre, &sphere_material);
+                    objects.add(spherex);
+                }
+            }
+        }
+    }
+}
+
+// A big procedural field of small spheres, n x n of them (plus the ground)
+void scene_sphere_field(hittable_list &objects, material_list &materials, Camera &cam, int n)
+{
+    cam.lookfrom = point3(0, 6, 12);
+    cam.lookat = point3(0, 0, 0);
+    cam.vup = vec3(0, 1, 0);
+    cam.vfov = 40.0;
+    cam.defocus_angle = 0.0;
+    cam.focus_dist = 10.0;
+
+    lambertian ground_material = lambertian(colour(0.5, 0.5, 0.5));
+    materials.add(ground_material);
+    sphere ground = sphere(10000, point3(0, -10000, 0), &ground_material);
+    objects.add(ground);
+
+    // A handful of shared materials, there's no need for one per sphere
+    const int num_palette = 16;
+    std::vector<material> palette;
+    for (int i = 0; i < num_palette; i++) {
+        if (i % 4 == 3) {
+            metallic m = metallic(colour::random(0.5, 1), random_float(0, 0.3));
+            materials.add(m);
+            palette.push_back(m);
+        } else {
+            lambertian m = lambertian(colour::random() * colour::random());
+            materials.add(m);
+            palette.push_back(m);
+        }
+    }
+
+    float spacing = 0.25f;
+    float radius = 0.08f;
+    for (int a = 0; a < n; a++) {
+        for (int b = 0; b < n; b++) {
+            point3 centre((a - n/2) * spacing + 0.1f*random_float(), radius, (b - n/2) * spacing + 0.1f*random_float());
+            sphere spherex = sphere(radius, centre, &palette[int(random_float() * num_palette)]);
+            objects.add(spherex);
+        }
+    }
+}
+
+// A closed room (the inside of a big sphere) lit only by a few small
+// emissive spheres, no sky in sight. Without light sampling hardly any
+// paths find the lights.
+void scene_lit_interior(hittable_list &objects, material_list &materials, Camera &cam)
+{
+    cam.lookfrom = point3(0, 2.5, 7.5);
+    cam.lookat = point3(0, 1, 0);
+    cam.vup = vec3(0, 1, 0);
+    cam.vfov = 45.0;
+    cam.defocus_angle = 0.0;
+    cam.focus_dist = 7.5;
+
+    lambertian mat_walls = lambertian(colour(0.7, 0.7, 0.7));
+    lambertian mat_floor = lambertian(colour(0.6, 0.55, 0.5));
+    dialectric mat_glass = dialectric(1.5);
+    lambertian mat_red = lambertian(colour(0.7, 0.2, 0.2));
+    metallic mat_mirror = metallic(colour(0.8, 0.8, 0.8), 0.05);
+    emissive mat_lamp = emissive(colour(1.0, 0.85, 0.6), 60.0);
+    emissive mat_blue_lamp = emissive(colour(0.6, 0.7, 1.0), 30.0);
+
+    materials.add(mat_walls);
+    materials.add(mat_floor);
+    materials.add(mat_glass);
+    materials.add(mat_red);
+    materials.add(mat_mirror);
+    materials.add(mat_lamp);
+    materials.add(mat_blue_lamp);
+
+    objects.add(sphere(12.0, point3(0, 4, 0), &mat_walls));
+    objects.add(sphere(1000.0, point3(0, -1000, 0), &mat_floor));
+
+    objects.add(sphere(1.0, point3(0, 1, 0), &mat_glass));
+    objects.add(sphere(1.0, point3(-2.2, 1, 0), &mat_red));
+    objects.add(sphere(1.0, point3(2.2, 1, 0), &mat_mirror));
+
+    for (int i = 0; i < 8; i++) {
+        float angle = 2.0f * pi * (i + 0.5f) / 8;
+        lambertian m = lambertian(colour::random(0.2, 0.9));
+        materials.add(m);
+        objects.add(sphere(0.3, point3(4.0f * std::cos(angle), 0.3, 4.0f * std::sin(angle) - 1.0f), &m));
+    }
+
+    objects.add(sphere(0.25, point3(-1.5, 3.2, 1.5), &mat_lamp));
+    objects.add(sphere(0.25, point3(1.8, 2.8, -1.2), &mat_lamp));
+    objects.add(sphere(0.15, point3(0, 0.4, 2.5), &mat_blue_lamp));
+}
+
+// A night time city block grid: n x n round "buildings", each with four
+// street lamps around it, all under a dark dome instead of the sky. With
+// thousands of small lights, most of them far away or round the back of
+// something, picking one uniformly hardly ever finds one that matters.
+void scene_city_lights(hittable_list &objects, material_list &materials, Camera &cam, int n)
+{
+    cam.lookfrom = point3(0.75f, 3.5, 1.5f * n);
+    cam.lookat = point3(0, 0.5, 0);
+    cam.vup = vec3(0, 1, 0);
+    cam.vfov = 40.0;
+    cam.defocus_angle = 0.0;
+    cam.focus_dist = 10.0;
+
+    lambertian mat_night = lambertian(colour(0.02, 0.02, 0.04));
+    lambertian mat_road = lambertian(colour(0.3, 0.3, 0.3));
+    materials.add(mat_night);
+    materials.add(mat_road);
+    objects.add(sphere(5000, point3(0, 0, 0), &mat_night));
+    objects.add(sphere(10000, point3(0, -10000, 0), &mat_road));
+
+    const int num_buildings = 4;
+    std::vector<material> buildings;
+    for (int i = 0; i < num_buildings; i++) {
+        lambertian m = lambertian(colour::random(0.3, 0.8));
+        materials.add(m);
+        buildings.push_back(m);
+    }
+
+    // Mostly sodium orange, some white
+    emissive mat_sodium = emissive(colour(1.0, 0.6, 0.25), 40.0);
+    emissive mat_white = emissive(colour(0.8, 0.85, 1.0), 40.0);
+    materials.add(mat_sodium);
+    materials.add(mat_white);
+
+    float spacing = 3.0f;
+    for (int a = 0; a < n; a++) {
+        for (int b = 0; b < n; b++) {
+            point3 centre((a - n/2) * spacing, 0, (b - n/2) * spacing);
+            float radius = random_float(0.6f, 1.2f);
+            centre[1] = radius * random_float(0.3f, 1.0f);
+            objects.add(sphere(radius, centre, &buildings[int(random_float() * num_buildings)]));
+
+            // Along the streets on its +x and +z sides
+            const float lamps[4][2] = {{1.5f, -1.0f}, {1.5f, 1.0f}, {-1.0f, 1.5f}, {1.0f, 1.5f}};
+            for (int c = 0; c < 4; c++) {
+                point3 lamp = point3(centre[0] + lamps[c][0], 0.6f, centre[2] + lamps[c][1]);
+                objects.add(sphere(0.06, lamp, random_float() < 0.8f ? &mat_sodium : &mat_white));
+            }
+        }
+    }
+}
+
+#endif
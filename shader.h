@@ -16,7 +16,8 @@ public:
     unsigned int ID;
 
     // constructor reads shader from file and builds it
-    Shader(const char* vertexPath, const char* fragmentPath)
+    // (defines are "#define ..." lines inserted after the #version line)
+    Shader(const char* vertexPath, const char* fragmentPath, const std::string &defines = "")
     {
         // 1. Get source code from files
         std::string vertexCode;
@@ -40,10 +41,10 @@ public:
             vShaderFile.close();
             fShaderFile.close();
             // convert stream into string
-            vertexCode = vShaderStream.str();
-            fragmentCode = fShaderStream.str();
+            vertexCode = insertDefines(resolveIncludes(vShaderStream.str(), directory(vertexPath)), defines);
+            fragmentCode = insertDefines(resolveIncludes(fShaderStream.str(), directory(fragmentPath)), defines);
         }
-        catch(std::ifstream::failure e)
+        catch(std::ifstream::failure &e)
         {
             std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
         }
@@ -95,6 +96,53 @@ public:
         glDeleteShader(fragment);
     }
 
+    // #version has to stay the first line, so defines go straight after it
+    static std::string insertDefines(const std::string &code, const std::string &defines)
+    {
+        if (defines.empty()) return code;
+
+        size_t line_end = code.find('\n');
+        if (line_end == std::string::npos) return code + "\n" + defines;
+
+        return code.substr(0, line_end + 1) + defines + code.substr(line_end + 1);
+    }
+
+    // GLSL has no #include, so lines like #include "file" are swapped for
+    // the file's contents (relative to the including file, and included
+    // files can include more, the include guards stop repeats)
+    static std::string resolveIncludes(const std::string &code, const std::string &dir)
+    {
+        std::stringstream in(code);
+        std::string out;
+        std::string line;
+        while (std::getline(in, line))
+        {
+            size_t open = line.find('"');
+            size_t close = line.rfind('"');
+            if (line.compare(0, 8, "#include") != 0 || open == std::string::npos || close <= open) {
+                out += line + "\n";
+                continue;
+            }
+
+            std::string path = dir + line.substr(open + 1, close - open - 1);
+            std::ifstream file(path);
+            if (!file) {
+                std::cout << "ERROR::SHADER::INCLUDE_NOT_FOUND " << path << std::endl;
+                continue;
+            }
+            std::stringstream contents;
+            contents << file.rdbuf();
+            out += resolveIncludes(contents.str(), directory(path)) + "\n";
+        }
+        return out;
+    }
+
+    static std::string directory(const std::string &path)
+    {
+        size_t slash = path.find_last_of('/');
+        return (slash == std::string::npos) ? "" : path.substr(0, slash + 1);
+    }
+
     // use/activate shader
     void use()
     {
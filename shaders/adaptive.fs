@@ -0,0 +1,47 @@
+#version 330 core
+
+// Adaptive sampling mask, drawn over the next pass's accumulation buffer
+// before any of its tiles. Pixels that are done get the last pass copied
+// over and stencil 1, so testFragment.fs (drawn with the stencil test on)
+// skips them. Everything else is left alone for the tiles to fill in.
+
+layout (location = 0) out vec4 FragColour;
+layout (location = 1) out vec2 FragMoments;
+layout (location = 2) out vec4 FragAlbedo; // (only there with --denoise)
+layout (location = 3) out vec4 FragNormal;
+
+in vec2 TexCoords;
+
+uniform sampler2D accumTexture;   // last pass (rgb = sum of samples, a = count)
+uniform sampler2D momentsTexture; // last pass (sum of luminance, sum of luminance squared)
+uniform sampler2D albedoTexture;
+uniform sampler2D normalTexture;
+
+uniform float target_error; // relative to the pixel's mean luminance
+uniform float min_samples;
+
+// Pixels darker than this are held to an error relative to it instead, so
+// near black ones don't need a huge number of samples to get there
+#define ADAPTIVE_MIN_MEAN 0.01f
+
+void main()
+{
+  vec4 accum = texture(accumTexture, TexCoords);
+  vec2 moments = texture(momentsTexture, TexCoords).xy;
+
+  float n = accum.a;
+  if (n < max(min_samples, 2.0f)) discard;
+
+  // 95% confidence interval of the mean luminance
+  float mean = moments.x / n;
+  float variance = max(0.0f, (moments.y - n * mean * mean) / (n - 1.0f));
+  float interval = 1.96f * sqrt(variance / n);
+
+  // ... as a fraction of the mean
+  if (interval > target_error * max(mean, ADAPTIVE_MIN_MEAN)) discard;
+
+  FragColour = accum;
+  FragMoments = moments;
+  FragAlbedo = texture(albedoTexture, TexCoords);
+  FragNormal = texture(normalTexture, TexCoords);
+}
@@ -0,0 +1,109 @@
+#version 330 core
+
+// One iteration of the a-trous denoiser (see denoise.h). The first one
+// reads the accumulation buffers and divides out the albedo, the last
+// one multiplies it back in and gamma corrects (like resolve.fs) for the
+// screen. In between they read and write (illumination, variance).
+
+out vec4 FragColour;
+
+in vec2 TexCoords;
+
+#include "../denoise.h"
+
+uniform sampler2D accumTexture;   // rgb = sum of samples, a = count
+uniform sampler2D momentsTexture; // sum of luminance, sum of luminance squared
+uniform sampler2D albedoTexture;  // sum of guide albedo, sum of depth
+uniform sampler2D normalTexture;  // sum of guide normals (then hit distance, unused)
+uniform sampler2D filterTexture;  // the last iteration's output
+
+uniform int step_size; // 2^iteration
+uniform bool first;
+uniform bool last;
+
+struct guide
+{
+  vec3 albedo;
+  vec3 normal;
+  float depth;
+};
+
+guide load_guide(ivec2 p)
+{
+  float n = max(texelFetch(accumTexture, p, 0).a, 1.0f);
+  vec4 albedo_depth = texelFetch(albedoTexture, p, 0) / n;
+  vec3 normal = texelFetch(normalTexture, p, 0).xyz;
+
+  guide g;
+  g.albedo = max(albedo_depth.rgb, vec3(DENOISE_MIN_ALBEDO));
+  g.normal = dot(normal, normal) > 0.0f ? normalize(normal) : normal;
+  g.depth = albedo_depth.a;
+  return g;
+}
+
+// (illumination, variance of its mean)
+vec4 load_input(ivec2 p, guide g)
+{
+  if (!first) {
+    return texelFetch(filterTexture, p, 0);
+  }
+
+  vec4 accum = texelFetch(accumTexture, p, 0);
+  vec2 moments = texelFetch(momentsTexture, p, 0).xy;
+  float n = max(accum.a, 1.0f);
+
+  float albedo_lum = denoise_luminance(g.albedo.r, g.albedo.g, g.albedo.b);
+  return vec4(accum.rgb / n / g.albedo, denoise_mean_variance(moments.x, moments.y, n, albedo_lum));
+}
+
+void main()
+{
+  ivec2 size = textureSize(accumTexture, 0);
+  ivec2 p = ivec2(gl_FragCoord.xy);
+
+  guide centre_guide = load_guide(p);
+  vec4 centre = load_input(p, centre_guide);
+  float lum_c = denoise_luminance(centre.r, centre.g, centre.b);
+
+  float variance = 0.0f;
+  for (int dy = -1; dy <= 1; dy++) {
+    for (int dx = -1; dx <= 1; dx++) {
+      ivec2 q = clamp(p + ivec2(dx, dy), ivec2(0), size - 1);
+      variance += denoise_variance_kernel(dx, dy) * load_input(q, load_guide(q)).a;
+    }
+  }
+
+  vec3 sum = vec3(0.0f);
+  float weight_sum = 0.0f;
+  float variance_sum = 0.0f;
+  for (int dy = -2; dy <= 2; dy++)
+  {
+    for (int dx = -2; dx <= 2; dx++)
+    {
+      ivec2 q = p + ivec2(dx, dy) * step_size;
+      if (any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size))) continue;
+
+      guide g = load_guide(q);
+      vec4 s = load_input(q, g);
+      float w = atrous_weight(dx, dy, step_size, dot(centre_guide.normal, g.normal), centre_guide.depth, g.depth,
+                              lum_c, denoise_luminance(s.r, s.g, s.b), variance);
+
+      sum += w * s.rgb;
+      weight_sum += w;
+      variance_sum += w * w * s.a;
+    }
+  }
+
+  // (the centre tap only gets nothing with no normal, bounce_limit 0)
+  vec4 filtered = centre;
+  if (weight_sum > 0.0f) {
+    filtered = vec4(sum / weight_sum, variance_sum / (weight_sum * weight_sum));
+  }
+
+  if (last) {
+    float gamma = 2.2;
+    FragColour = vec4(pow(filtered.rgb * centre_guide.albedo, vec3(1.0/gamma)), 1.0);
+  } else {
+    FragColour = filtered;
+  }
+}
@@ -0,0 +1,97 @@
+#version 330 core
+layout(pixel_center_integer, origin_upper_left) in vec4 gl_FragCoord;
+
+// The refinement ladder's pass (see refine.h), which is drawn sorted by
+// phase, back in place in the accumulation buffers once it's done. With
+// PREVIEW, the image so far for the screen instead: pixels of the levels
+// done are averaged and gamma corrected (like resolve.fs), the rest are
+// interpolated from the grid of pixels every 4 (after level 0) or 2 (after
+// level 1) around them.
+
+#include "../refine.h"
+
+in vec2 TexCoords;
+
+uniform sampler2D accumTexture; // the ladder's pass, sorted by phase (rgb = sum of samples, a = count)
+
+#ifdef PREVIEW
+out vec4 FragColour;
+
+uniform int level; // the last one done
+#else
+layout (location = 0) out vec4 FragColour;
+layout (location = 1) out vec2 FragMoments;
+layout (location = 2) out vec4 FragAlbedo; // (only there with the guides)
+layout (location = 3) out vec4 FragNormal;
+
+uniform sampler2D momentsTexture;
+uniform sampler2D albedoTexture;
+uniform sampler2D normalTexture;
+#endif
+
+// Where pixel p (y counted down from the top) is in the sorted buffer
+ivec2 sorted_texel(ivec2 p)
+{
+  ivec2 size = textureSize(accumTexture, 0);
+  ivec2 block = size / REFINE_GRID;
+  ivec2 phase = p % REFINE_GRID;
+  int s = refine_slot(phase.x, phase.y);
+
+  ivec2 f = ivec2(s % REFINE_GRID, s / REFINE_GRID) * block + p / REFINE_GRID;
+  return ivec2(f.x, size.y - 1 - f.y);
+}
+
+#ifdef PREVIEW
+void main()
+{
+  ivec2 p = ivec2(gl_FragCoord.xy);
+  vec3 colour = vec3(0.0f);
+
+  ivec2 phase = p % REFINE_GRID;
+  if (refine_level(phase.x, phase.y) <= level)
+  {
+    vec4 accum = texelFetch(accumTexture, sorted_texel(p), 0);
+    colour = accum.rgb / max(accum.a, 1.0f);
+  }
+  else
+  {
+    // Bilinear between the four grid pixels around p. The ones past the
+    // edge were never traced (the buffer is cleared first), so they don't
+    // count.
+    int step = REFINE_GRID >> level;
+    ivec2 base = (p / step) * step;
+    vec2 f = vec2(p - base) / float(step);
+    ivec2 extent = textureSize(accumTexture, 0);
+
+    float weight_sum = 0.0f;
+    for (int j = 0; j <= 1; j++)
+    {
+      for (int i = 0; i <= 1; i++)
+      {
+        ivec2 q = base + step * ivec2(i, j);
+        if (any(greaterThanEqual(q, extent))) continue;
+
+        vec4 accum = texelFetch(accumTexture, sorted_texel(q), 0);
+        if (accum.a <= 0.0f) continue;
+
+        float w = (i == 1 ? f.x : 1.0f - f.x) * (j == 1 ? f.y : 1.0f - f.y);
+        colour += w * accum.rgb / accum.a;
+        weight_sum += w;
+      }
+    }
+    colour = weight_sum > 0.0f ? colour / weight_sum : colour;
+  }
+
+  float gamma = 2.2;
+  FragColour = vec4(pow(colour, vec3(1.0/gamma)), 1.0);
+}
+#else
+void main()
+{
+  ivec2 t = sorted_texel(ivec2(gl_FragCoord.xy));
+  FragColour = texelFetch(accumTexture, t, 0);
+  FragMoments = texelFetch(momentsTexture, t, 0).xy;
+  FragAlbedo = texelFetch(albedoTexture, t, 0);
+  FragNormal = texelFetch(normalTexture, t, 0);
+}
+#endif
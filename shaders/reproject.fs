@@ -0,0 +1,153 @@
+#version 330 core
+layout(pixel_center_integer, origin_upper_left) in vec4 gl_FragCoord;
+
+// Temporal reprojection, drawn over a fresh accumulation buffer when the
+// camera moves. Each pixel of the new view looks up where its surface was
+// in the old one and takes over the samples (and moments and guides)
+// accumulated there, so they carry on from there instead of starting over.
+//
+// There's no depth for the new view yet, so the old depth at the same
+// pixel is the first guess of how far away the surface is. Projecting
+// that into the old view gives a better guess, and so on for a few
+// iterations. The bilinear taps around where that lands only count if
+// what they saw lands back on this pixel in the new view (pixels that were
+// hidden in the old view land on whatever hid them, which is somewhere
+// else now, so they start over with no samples). The sky has depth 0 and
+// moves by direction only.
+//
+// The depth is the camera ray's own hit (the w of the normal sums), not
+// the guides', which go on through mirrors and glass.
+
+layout (location = 0) out vec4 FragColour;
+layout (location = 1) out vec2 FragMoments;
+layout (location = 2) out vec4 FragAlbedo;
+layout (location = 3) out vec4 FragNormal;
+
+uniform sampler2D accumTexture;   // old view (rgb = sum of samples, a = count)
+uniform sampler2D momentsTexture;
+uniform sampler2D albedoTexture;
+uniform sampler2D normalTexture;  // (sum of normals, sum of hit distance)
+
+// New view (as in testFragment.fs)
+uniform vec3 camera_origin;
+uniform vec3 viewport_top_left;
+uniform vec3 delta_u;
+uniform vec3 delta_v;
+
+// Old view
+uniform vec3 prev_origin;
+uniform vec3 prev_top_left;
+uniform vec3 prev_delta_u;
+uniform vec3 prev_delta_v;
+
+uniform float max_history; // samples a pixel keeps at most
+
+#define REPROJECT_ITERATIONS 4
+#define REPROJECT_MAX_OFFSET 1.0f // pixels
+
+ivec2 size;
+
+// Old view texel of pixel (x, y), y counted down from the top
+ivec2 texel(ivec2 p)
+{
+  return ivec2(p.x, size.y - 1 - p.y);
+}
+
+bool inside(ivec2 p)
+{
+  return all(greaterThanEqual(p, ivec2(0))) && all(lessThan(p, size));
+}
+
+// Average hit distance at old pixel p (0 for the sky, or no samples)
+float old_depth(ivec2 p)
+{
+  float n = texelFetch(accumTexture, texel(p), 0).a;
+  return n > 0.0f ? texelFetch(normalTexture, texel(p), 0).w / n : 0.0f;
+}
+
+// Where the offset v from origin lands on a camera's viewport, in pixels.
+// Behind the camera is far off screen.
+vec2 project(vec3 v, vec3 origin, vec3 top_left, vec3 du, vec3 dv)
+{
+  vec3 forward = cross(du, dv);
+  float along = dot(v, forward);
+  if (along <= 0.0f) return vec2(-1e6f);
+
+  vec3 on_viewport = origin + v * (dot(top_left - origin, forward) / along) - top_left;
+  return vec2(dot(on_viewport, du) / dot(du, du), dot(on_viewport, dv) / dot(dv, dv));
+}
+
+vec3 old_dir(ivec2 p)
+{
+  return normalize(prev_top_left + float(p.x) * prev_delta_u + float(p.y) * prev_delta_v - prev_origin);
+}
+
+// Where what old pixel p saw at depth d (0 for the sky) is in the new view
+vec2 new_position(ivec2 p, float d)
+{
+  vec3 v = d > 0.0f ? prev_origin + d * old_dir(p) - camera_origin : old_dir(p);
+  return project(v, camera_origin, viewport_top_left, delta_u, delta_v);
+}
+
+void main()
+{
+  size = textureSize(accumTexture, 0);
+  ivec2 p = ivec2(gl_FragCoord.xy);
+  vec3 dir = normalize(viewport_top_left + gl_FragCoord.x * delta_u + gl_FragCoord.y * delta_v - camera_origin);
+
+  // Distance along dir to the surface the pixel sees (0 for the sky)
+  float d = old_depth(p);
+  vec2 q = vec2(0.0f);
+  for (int i = 0; i < REPROJECT_ITERATIONS; i++)
+  {
+    q = project(d > 0.0f ? camera_origin + d * dir - prev_origin : dir, prev_origin, prev_top_left, prev_delta_u, prev_delta_v);
+    ivec2 nearest = ivec2(floor(q + 0.5f));
+    if (!inside(nearest)) break;
+
+    float old_d = old_depth(nearest);
+    d = old_d > 0.0f ? dot(prev_origin + old_d * old_dir(nearest) - camera_origin, dir) : 0.0f;
+  }
+
+  vec4 accum = vec4(0.0f);
+  vec2 moments = vec2(0.0f);
+  vec4 albedo = vec4(0.0f);
+  vec4 normal = vec4(0.0f);
+  float weight_sum = 0.0f;
+
+  ivec2 base = ivec2(floor(q));
+  vec2 f = q - vec2(base);
+  for (int j = 0; j <= 1; j++)
+  {
+    for (int i = 0; i <= 1; i++)
+    {
+      ivec2 t = base + ivec2(i, j);
+      if (!inside(t)) continue;
+
+      vec4 a = texelFetch(accumTexture, texel(t), 0);
+      if (a.a <= 0.0f) continue;
+      vec4 n = texelFetch(normalTexture, texel(t), 0);
+
+      if (distance(new_position(t, n.w / a.a), gl_FragCoord.xy) > REPROJECT_MAX_OFFSET) continue;
+
+      float w = (i == 1 ? f.x : 1.0f - f.x) * (j == 1 ? f.y : 1.0f - f.y);
+      accum += w * a;
+      moments += w * texelFetch(momentsTexture, texel(t), 0).xy;
+      albedo += w * texelFetch(albedoTexture, texel(t), 0);
+      normal += w * n;
+      weight_sum += w;
+    }
+  }
+
+  // Everything is a sum over the pixel's samples, so scaling it all keeps
+  // the averages and only shrinks how much the history counts
+  float scale = 0.0f;
+  if (weight_sum > 1e-3f) {
+    float count = accum.a / weight_sum;
+    scale = min(1.0f, max_history / count) / weight_sum;
+  }
+
+  FragColour = accum * scale;
+  FragMoments = moments * scale;
+  FragAlbedo = albedo * scale;
+  FragNormal = normal * scale;
+}
@@ -0,0 +1,16 @@
+#version 330 core
+
+out vec4 FragColour;
+
+in vec2 TexCoords;
+
+uniform sampler2D screenTexture; // accumulation buffer (rgb = sum of samples, a = count)
+
+void main()
+{
+    vec4 accum = texture(screenTexture, TexCoords);
+    vec3 colour = accum.rgb / max(accum.a, 1.0);
+
+    float gamma = 2.2;
+    FragColour = vec4(pow(colour, vec3(1.0/gamma)), 1.0);
+}
@@ -0,0 +1,357 @@
+#ifndef RESTIR_GLSL
+#define RESTIR_GLSL
+
+// Reservoir resampling for the direct light at each pixel's first hit
+// (ReSTIR, "Spatiotemporal reservoir resampling for real-time ray tracing
+// with dynamic direct lighting", Bitterli et al. 2020). testFragment.fs
+// includes this when raytrace.cpp is run with --restir (which defines
+// RESTIR), and it's also compiled twice more with RESTIR_PASS 1 and 2 for
+// the two passes that build the reservoirs, once per frame before the
+// shading pass:
+//
+//   1. trace the camera ray the shading pass is going to trace (same
+//      jitter, it only depends on the pixel and sample), stream
+//      RESTIR_CANDIDATES light tree samples through a reservoir, shadow
+//      test the one that's left, then merge in last frame's reservoir
+//   2. merge in the reservoirs of RESTIR_NEIGHBOURS nearby pixels that see
+//      a similar surface
+//
+// A reservoir keeps one light sample out of everything merged into it,
+// picked in proportion to the light it brings to this pixel (unshadowed,
+// restir_target()) over the chance of it being found, and W, which makes
+// that sample's light times W an estimate of the pixel's direct light.
+// The shading pass then just shadow tests the one sample (restir_direct())
+// but gets light as if picked out of hundreds of candidates.
+//
+// Reservoirs are kept in three float render targets (see raytrace.cpp):
+//
+//   0: point on the light (xyz), W
+//   1: light index, M (how many candidates it stands for)
+//   2: the surface it's for, point (xyz) and sphere (-1 if not lambertian)
+//
+// Like most real time versions it's biased: the neighbours' samples are
+// merged without checking they're visible from here (so shadow edges blur
+// a little), and the history is capped at RESTIR_HISTORY times the
+// candidates of one frame so it can still change.
+
+#define RESTIR_CANDIDATES 8
+#define RESTIR_NEIGHBOURS 5
+#define RESTIR_RADIUS 20.0f
+#define RESTIR_HISTORY 20.0f
+#define RESTIR_STREAM 0x10000u // rng bounce number for the reservoir passes
+
+uniform sampler2D reservoirSample;
+uniform sampler2D reservoirCount;
+uniform sampler2D reservoirSurface;
+
+#ifdef RESTIR_PASS
+layout (location = 0) out vec4 ReservoirSample;
+layout (location = 1) out vec2 ReservoirCount;
+layout (location = 2) out vec4 ReservoirSurface;
+#endif
+
+struct reservoir
+{
+  int light;    // -1 if nothing's been picked
+  vec3 point;   // on the light
+  float target; // restir_target() of the sample here
+  float w_sum;
+  float M;
+  float W;
+};
+
+struct surface
+{
+  vec3 point;
+  vec3 normal;
+  vec3 albedo;
+  int sphere;   // -1 if there's nothing to light
+};
+
+reservoir empty_reservoir()
+{
+  reservoir r;
+  r.light = -1;
+  r.point = vec3(0.0f);
+  r.target = 0.0f;
+  r.w_sum = 0.0f;
+  r.M = 0.0f;
+  r.W = 0.0f;
+  return r;
+}
+
+// Sphere s_index seen at point by the camera (the normal flipped towards
+// it like hit_any() does)
+surface make_surface(vec3 point, int s_index)
+{
+  surface s;
+  s.point = point;
+  s.normal = vec3(0.0f);
+  s.albedo = vec3(0.0f);
+  s.sphere = -1;
+  if (s_index < 0) return s;
+
+  sphere sp = get_sphere(s_index);
+  material m = get_material(sp.mat);
+  if (m.type != 1) return s;
+
+  s.normal = (point - sp.origin) / sp.radius;
+  if (dot(s.normal, point - camera_origin) >= 0.0f) {
+    s.normal = -s.normal;
+  }
+  s.albedo = m.albedo;
+  s.sphere = s_index;
+  return s;
+}
+
+// Reservoir targets are in texture rows, which go up the screen
+ivec2 reservoir_texel(ivec2 pixel)
+{
+  return ivec2(pixel.x, textureSize(reservoirSample, 0).y - 1 - pixel.y);
+}
+
+reservoir load_reservoir(ivec2 pixel)
+{
+  vec4 a = texelFetch(reservoirSample, reservoir_texel(pixel), 0);
+  vec2 b = texelFetch(reservoirCount, reservoir_texel(pixel), 0).xy;
+
+  reservoir r = empty_reservoir();
+  r.point = a.xyz;
+  r.W = a.w;
+  r.light = (b.y > 0.0f) ? int(b.x) : -1;
+  r.M = b.y;
+  return r;
+}
+
+surface load_surface(ivec2 pixel)
+{
+  vec4 a = texelFetch(reservoirSurface, reservoir_texel(pixel), 0);
+  return make_surface(a.xyz, int(a.w));
+}
+
+// Whether another pixel's reservoir is any use here: roughly the same
+// facing and distance from the camera
+bool similar_surface(surface a, surface b)
+{
+  if (a.sphere < 0 || b.sphere < 0) return false;
+  float da = length(a.point - camera_origin);
+  float db = length(b.point - camera_origin);
+  return dot(a.normal, b.normal) > 0.9f && abs(da - db) < 0.1f * da;
+}
+
+float luminance(vec3 c)
+{
+  return dot(c, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// Light reaching the camera from s off point y on light l, ignoring
+// shadows (in f, returns its luminance). That's what the samples are
+// picked by.
+float restir_target(surface s, int l, vec3 y, out vec3 f)
+{
+  f = vec3(0.0f);
+  light L = get_light(l);
+
+  vec3 w = y - s.point;
+  float d2 = dot(w, w);
+  vec3 dir = w / sqrt(d2);
+  float cos_n = dot(s.normal, dir);
+  float cos_l = -dot(y - L.centre, dir) / L.radius;
+  if (cos_n <= 0.0f || cos_l <= 0.0f) return 0.0f;
+
+  f = s.albedo * L.emit * (cos_n * cos_l / (WARP_PI * d2));
+  return luminance(f);
+}
+
+// Adds a sample standing for M candidates with resampling weight w, kept
+// with probability w / w_sum (u is a random number)
+void reservoir_add(inout reservoir r, int l, vec3 y, float target, float w, float M, float u)
+{
+  r.w_sum += w;
+  r.M += M;
+  if (w > 0.0f && u * r.w_sum < w) {
+    r.light = l;
+    r.point = y;
+    r.target = target;
+  }
+}
+
+void reservoir_finish(inout reservoir r)
+{
+  r.W = (r.target > 0.0f) ? r.w_sum / (r.M * r.target) : 0.0f;
+}
+
+// Merges reservoir q (from this pixel or another) into r, for surface s
+void reservoir_merge(inout reservoir r, surface s, reservoir q, float u)
+{
+  if (q.light < 0) {
+    r.M += q.M;
+    return;
+  }
+  vec3 f;
+  float target = restir_target(s, q.light, q.point, f);
+  reservoir_add(r, q.light, q.point, target, target * q.W * q.M, q.M, u);
+}
+
+// A light tree sample, like sample_light() takes: the point on the light
+// it hits and the pdf per unit area of finding it
+bool light_candidate(surface s, inout rng_state state, out int l, out vec3 y, out float pdf)
+{
+  y = vec3(0.0f);
+  pdf = 0.0f;
+
+  float pmf = 0.0f;
+  l = sample_light_tree(s.point, s.normal, rand_float(state), pmf);
+  if (l < 0) return false;
+  light L = get_light(l);
+
+  vec3 to_light = L.centre - s.point;
+  float d2 = dot(to_light, to_light);
+  float one_minus_cos = sphere_cone(L.radius * L.radius, d2);
+  if (one_minus_cos <= 0.0f) return false;
+
+  vec3 axis = to_light / sqrt(d2);
+  vec3 dir = vec3(0.0f);
+  uniform_cone(axis.x, axis.y, axis.z, one_minus_cos, rand_float(state), rand_float(state), dir.x, dir.y, dir.z);
+
+  float b = dot(dir, to_light);
+  float t = b - sqrt(max(0.0f, b*b - d2 + L.radius*L.radius));
+  y = s.point + t * dir;
+
+  // Solid angle to area: times cos at the light over distance squared
+  float cos_l = -dot(y - L.centre, dir) / L.radius;
+  pdf = pmf / (2.0f * WARP_PI * one_minus_cos) * cos_l / (t * t);
+  return pdf > 0.0f;
+}
+
+bool light_visible(vec3 p, vec3 y)
+{
+  vec3 to = y - p;
+  float d = length(to);
+  return !hit_shadow(p, to / d, 0.999f * d);
+}
+
+// The pixel's reservoir as the direct light at h, which has to be the
+// camera ray's first hit. False if the reservoir passes saw something
+// else there (it can happen at edges), then it's up to sample_light().
+bool restir_direct(material m, hit h, out vec3 direct)
+{
+  direct = vec3(0.0f);
+  if (num_lights == 0) return false;
+
+  ivec2 pixel = frag_pixel();
+  vec4 a = texelFetch(reservoirSurface, reservoir_texel(pixel), 0);
+  if (int(a.w) != h.sphere) return false;
+
+  reservoir r = load_reservoir(pixel);
+  if (r.light < 0 || r.W <= 0.0f) return true;
+
+  surface s;
+  s.point = h.point;
+  s.normal = h.normal;
+  s.albedo = m.albedo;
+  s.sphere = h.sphere;
+
+  vec3 f;
+  if (restir_target(s, r.light, r.point, f) > 0.0f && light_visible(h.point, r.point)) {
+    direct = f * r.W;
+  }
+  return true;
+}
+
+#ifdef RESTIR_PASS
+#if RESTIR_PASS == 1
+// Candidates and temporal reuse
+void main()
+{
+  ivec2 pixel = ivec2(gl_FragCoord.xy);
+  rng_state state = rng_init(uint(pixel.x), uint(pixel.y), frame_index);
+
+  vec3 origin, dir;
+  camera_ray(state, origin, dir);
+  hit h = hit_any(origin, dir);
+  surface s = make_surface(h.point, h.hit ? h.sphere : -1);
+
+  reservoir r = empty_reservoir();
+  if (s.sphere >= 0 && num_lights > 0)
+  {
+    s.normal = h.normal;
+    rng_set_bounce(state, RESTIR_STREAM);
+
+    for (int i = 0; i < RESTIR_CANDIDATES; i++)
+    {
+      int l;
+      vec3 y;
+      float pdf;
+      float target = 0.0f;
+      if (light_candidate(s, state, l, y, pdf)) {
+        vec3 f;
+        target = restir_target(s, l, y, f);
+      }
+      reservoir_add(r, l, y, target, (target > 0.0f) ? target / pdf : 0.0f, 1.0f, rand_float(state));
+    }
+    reservoir_finish(r);
+
+    // Only keep light that gets here (so occluded samples don't get
+    // passed on to the next frame or the neighbours either)
+    if (r.light >= 0 && !light_visible(s.point, r.point)) {
+      r.W = 0.0f;
+    }
+
+    reservoir prev = load_reservoir(pixel);
+    if (prev.M > 0.0f && similar_surface(s, load_surface(pixel)))
+    {
+      prev.M = min(prev.M, RESTIR_HISTORY * r.M);
+
+      reservoir merged = empty_reservoir();
+      reservoir_merge(merged, s, r, rand_float(state));
+      reservoir_merge(merged, s, prev, rand_float(state));
+      reservoir_finish(merged);
+      r = merged;
+    }
+  }
+
+  ReservoirSample = vec4(r.point, r.W);
+  ReservoirCount = vec2(float(r.light), r.M);
+  ReservoirSurface = vec4(s.point, float(s.sphere));
+}
+#elif RESTIR_PASS == 2
+// Spatial reuse
+void main()
+{
+  ivec2 pixel = ivec2(gl_FragCoord.xy);
+  ivec2 size = textureSize(reservoirSample, 0);
+  rng_state state = rng_init(uint(pixel.x), uint(pixel.y), frame_index);
+  rng_set_bounce(state, RESTIR_STREAM + 1u);
+
+  surface s = load_surface(pixel);
+  reservoir r = load_reservoir(pixel);
+
+  if (s.sphere >= 0)
+  {
+    reservoir merged = empty_reservoir();
+    reservoir_merge(merged, s, r, rand_float(state));
+
+    for (int i = 0; i < RESTIR_NEIGHBOURS; i++)
+    {
+      vec2 offset = vec2(0.0f);
+      concentric_disk(rand_float(state), rand_float(state), offset.x, offset.y);
+      ivec2 q = pixel + ivec2(RESTIR_RADIUS * offset);
+      if (q == pixel || any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size))) continue;
+
+      if (similar_surface(s, load_surface(q))) {
+        reservoir_merge(merged, s, load_reservoir(q), rand_float(state));
+      }
+    }
+    reservoir_finish(merged);
+    r = merged;
+  }
+
+  ReservoirSample = vec4(r.point, r.W);
+  ReservoirCount = vec2(float(r.light), r.M);
+  ReservoirSurface = vec4(s.point, float(s.sphere));
+}
+#endif
+#endif
+
+#endif
@@ -1,11 +1,27 @@
 #version 330 core
 
+#ifdef SCENE_SSBO
+#extension GL_ARB_shader_storage_buffer_object : require
+#endif
+
 layout(pixel_center_integer, origin_upper_left) in vec4 gl_FragCoord;
 
+#include "../rng.h"
+#include "../sampler.h"
+#include "../warp.h"
+#include "../refine.h"
+#ifdef FEATURES
+#include "../denoise.h"
+#endif
+
 in vec2 TexCoords;
-uniform sampler2D screenTexture;
+uniform sampler2D accumTexture; // previous pass (rgb = sum of samples, a = count)
+#ifdef SEED_BLUE_NOISE
+uniform sampler2D seedTexture;  // blue noise tile (see blue_noise.h)
+#endif
 
 uniform uint time_u32t;
+uniform uint frame_index;
 
 uniform int num_samples;
 
@@ -20,14 +36,48 @@ uniform vec3 defocus_disk_v;
 uniform float defocus_angle;
 
 uniform int num_spheres;
+uniform int num_nodes;
+uniform int num_lights;
 
 uniform uint bounce_limit;
-
-out vec4 FragColour;
-
-struct xorshift32_state {
-  uint a;
-};
+uniform uint rr_depth;
+
+#ifdef UPSCALE_JITTER
+// Every sample of a pass goes near the same point of the pixel, spread
+// over one screen pixel, so upscale_history.fs can put them on the screen
+// pixel they came from. The point moves every pass.
+uniform vec2 pixel_jitter;  // from the pixel centre, in pixels
+uniform vec2 jitter_spread; // a screen pixel, in pixels
+#endif
+
+// In the refinement ladder's pass the fragments are the pixels sorted by
+// phase (see refine.h), in blocks this many pixels across, 0 otherwise
+uniform vec2 refine_block;
+
+#if !defined(RESTIR_PASS) && !defined(GUIDE_PASS)
+layout (location = 0) out vec4 FragColour;
+#endif
+
+#ifdef MOMENTS
+uniform sampler2D momentsTexture; // previous pass (sum of luminance, sum of luminance squared)
+layout (location = 1) out vec2 FragMoments;
+#endif
+
+#if defined(FEATURES) && !defined(GUIDE_PASS)
+// The guides (see follow_features()), summed like the colour, for the
+// denoiser and reprojection
+uniform sampler2D albedoTexture;  // previous pass (sum of albedo, sum of depth)
+uniform sampler2D normalTexture;  // previous pass (sum of normals, sum of hit distance)
+layout (location = 2) out vec4 FragAlbedo;
+layout (location = 3) out vec4 FragNormal;
+#endif
+
+#ifdef GUIDE_PASS
+// The guides alone, averaged over num_samples, at screen resolution for
+// the upscaler (see upscale.fs)
+layout (location = 0) out vec4 GuideAlbedo; // (albedo, depth)
+layout (location = 1) out vec4 GuideNormal; // (normal, hit distance)
+#endif
 
 struct hit
 {
@@ -36,6 +86,7 @@ struct hit
   bool hit;
   bool interior;
   int mat;
+  int sphere;
 };
 
 struct ray
@@ -45,6 +96,10 @@ struct ray
   bool bounce;
   uint count;
   vec3 albedo;
+  float weight; // Russian roulette compensation
+  vec3 light;   // from emissive spheres so far
+  float pdf;    // of the last bounce direction, 0 if it wasn't sampled (-1, see lambertian())
+  vec3 normal;  // where that bounce left from (for the light tree's pmf)
 };
 
 struct material
@@ -58,86 +113,348 @@ struct material
 struct sphere 
 {
   int mat;
+  int light; // index in Lights, -1 if it isn't one
   float radius;
   vec3 origin;
 };
 
-layout (std140) uniform Materials
+struct light
 {
-  material[64] materials;
+  vec3 centre;
+  float radius;
+  vec3 emit;
 };
 
-layout (std140) uniform Spheres 
+struct light_node
 {
-  sphere[64] spheres;
+  vec3 centre;
+  float radius;
+  float power;
+  int right; // -1 for leaves
+  int first;
 };
 
-bool near_zero(vec3 v);
+// Scene storage: each sphere/material/light/light node is two vec4s (see
+// pack() in sphere.h and material.h, material_list.h and light_tree.h). SCENE_SSBO is defined by raytrace.cpp when GL 4.3 is
+// available, otherwise the data comes from buffer textures.
+#ifdef SCENE_SSBO
+layout (std430) readonly buffer Spheres
+{
+  vec4 sphere_data[];
+};
+
+layout (std430) readonly buffer Materials
+{
+  vec4 material_data[];
+};
+
+layout (std430) readonly buffer Nodes
+{
+  vec4 node_data[];
+};
+
+layout (std430) readonly buffer Lights
+{
+  vec4 light_data[];
+};
+
+layout (std430) readonly buffer LightNodes
+{
+  vec4 light_node_data[];
+};
+
+// How many paths roulette() stopped and let carry on, added up once per
+// pixel (raytrace.cpp reads them back after each pass)
+layout (std430) buffer RouletteStats
+{
+  uint rr_terminated;
+  uint rr_survived;
+};
+
+#define SPHERE_TEXEL(i) sphere_data[i]
+#define MATERIAL_TEXEL(i) material_data[i]
+#define NODE_TEXEL(i) node_data[i]
+#define LIGHT_TEXEL(i) light_data[i]
+#define LIGHT_NODE_TEXEL(i) light_node_data[i]
+#else
+uniform samplerBuffer Spheres;
+uniform samplerBuffer Materials;
+uniform samplerBuffer Nodes;
+uniform samplerBuffer Lights;
+uniform samplerBuffer LightNodes;
+
+#define SPHERE_TEXEL(i) texelFetch(Spheres, i)
+#define MATERIAL_TEXEL(i) texelFetch(Materials, i)
+#define NODE_TEXEL(i) texelFetch(Nodes, i)
+#define LIGHT_TEXEL(i) texelFetch(Lights, i)
+#define LIGHT_NODE_TEXEL(i) texelFetch(LightNodes, i)
+#endif
+
+sphere get_sphere(int i);
+material get_material(int i);
+light get_light(int i);
+light_node get_light_node(int i);
 
 float hit_sphere(vec3 origin, float radius, vec3 ray_dir, vec3 ray_orig);
+bool hit_box(vec3 bmin, vec3 bmax, vec3 ray_orig, vec3 inv_dir, float t_max);
 hit hit_any(vec3 ray_orig, vec3 ray_dir);
+bool hit_shadow(vec3 ray_orig, vec3 ray_dir, float t_max);
 
-ray bounce(ray r, inout xorshift32_state state);
-vec3 raycast(vec3 ray_orig, vec3 ray_dir, inout xorshift32_state state);
+void camera_ray(inout rng_state state, out vec3 origin, out vec3 dir);
+ray bounce(ray r, inout rng_state state);
+vec3 raycast(vec3 ray_orig, vec3 ray_dir, inout rng_state state);
 
 vec3 shade_sky(vec3 dir, vec3 albedo);
 float shlick(float cosine, float rel_refract_index);
 
-void material_shade(inout hit h, inout ray r, inout xorshift32_state state);
-void lambertian(material m, inout hit h, inout ray r, inout xorshift32_state state);
-void metallic(material m, inout hit h, inout ray r, inout xorshift32_state state);
-void dialectric(material m, inout hit h, inout ray r, inout xorshift32_state state);
-
-uint xorshift32(inout xorshift32_state state);
-float rand_float(inout xorshift32_state state);
-vec3 rand_vec(inout xorshift32_state state);
-vec3 random_unit_vector(inout xorshift32_state state);
-vec3 random_on_hemisphere(inout xorshift32_state state, vec3 normal);
-vec3 random_unit_disk(inout xorshift32_state state);
+void material_shade(material m, inout hit h, inout ray r, inout rng_state state);
+void roulette(inout ray r, inout rng_state state);
+float light_importance(light_node node, vec3 p, vec3 n);
+int sample_light_tree(vec3 p, vec3 n, float u, out float pmf);
+float light_tree_pmf(int l, vec3 p, vec3 n);
+float emitted_weight(hit h, ray r);
+vec3 sample_light(material m, hit h, inout rng_state state);
+void lambertian(material m, inout hit h, inout ray r, inout rng_state state);
+void metallic(material m, inout hit h, inout ray r, inout rng_state state);
+void dialectric(material m, inout hit h, inout ray r, inout rng_state state);
+
+ivec2 frag_pixel();
+float rand_float(inout rng_state state);
+vec2 sample_2d(rng_state state, uint pair);
+#ifdef SEED_BLUE_NOISE
+uint blue_noise(uint d);
+#endif
+vec3 random_unit_vector(inout rng_state state);
+vec3 random_cosine_direction(inout rng_state state, vec3 normal);
+vec3 random_unit_disk(inout rng_state state);
 
 float bad_rand(vec2 co);
 
-uint cantor(uint k1, uint k2);
-float lcg(uint x);
-
+uint num_terminated = 0u;
+uint num_survived = 0u;
+
+#ifdef FEATURES
+// Denoiser guides (see denoise.h) for the current sample: the albedo,
+// normal and distance of the first diffuse surface or light it sees,
+// following mirrors and glass on the way (and tinted by them), so what's
+// seen in those keeps its edges. The sky is white and at depth 0. Set by
+// bounce(), cpu_renderer::follow_features() does the same. Reprojection
+// wants the camera ray's own hit instead, so its distance is kept too.
+bool feature_path;
+vec3 feature_albedo;
+vec3 feature_normal;
+float feature_depth;
+float feature_hit_depth;
+
+void follow_features(hit h, material m, ray r);
+#endif
+
+#ifdef RESTIR
+#include "restir.glsl"
+#endif
+
+#if !defined(RESTIR_PASS) && !defined(GUIDE_PASS)
 void main()
 {
-  vec4 tex = texture(screenTexture, TexCoords);
-  uint seed = floatBitsToUint(tex.x + tex.y + tex.z);
-  seed ^= cantor(uint(gl_FragCoord.x), uint(gl_FragCoord.y));
-
-  xorshift32_state state;
-  state.a = seed;
-
-  vec3 frag_loc;
-  vec2 rand_square;
+  // (the phase sorted buffer has a few extra pixels at the edges)
+  ivec2 pixel = frag_pixel();
+  if (any(greaterThanEqual(pixel, textureSize(accumTexture, 0)))) discard;
 
   vec3 colour = vec3(0.0f, 0.0f, 0.0f);
+  vec2 moments = vec2(0.0f);
+#ifdef FEATURES
+  vec4 albedo_depth = vec4(0.0f);
+  vec4 normal_depth = vec4(0.0f);
+#endif
 
   for (int i=0;i<num_samples;i++)
   {
-    rand_square = vec2(rand_float(state) - 0.5, rand_float(state) - 0.5);
-    frag_loc = viewport_top_left + (gl_FragCoord.x + rand_square.x)*delta_u 
-                                  + (gl_FragCoord.y + rand_square.y)*delta_v;
+    // Random numbers are keyed by pixel and sample (see rng.h), each pass
+    // carries on from the last one's sample count
+    uint sample_index = frame_index * uint(num_samples) + uint(i);
+    rng_state state = rng_init(uint(pixel.x), uint(pixel.y), sample_index);
+
+    vec3 ray_origin, ray_dir;
+    camera_ray(state, ray_origin, ray_dir);
+#ifdef FEATURES
+    feature_path = true;
+    feature_albedo = vec3(1.0f);
+    feature_normal = -normalize(ray_dir);
+    feature_depth = 0.0f;
+    feature_hit_depth = 0.0f;
+#endif
+    vec3 sample_colour = raycast(ray_origin, ray_dir, state);
+    colour += sample_colour;
+
+    float l = dot(sample_colour, vec3(0.2126f, 0.7152f, 0.0722f));
+    moments += vec2(l, l * l);
+#ifdef FEATURES
+    albedo_depth += vec4(feature_albedo, feature_depth);
+    normal_depth += vec4(feature_normal, feature_hit_depth);
+#endif
+  }
+  
+#ifdef SCENE_SSBO
+  if (num_terminated + num_survived > 0u) {
+    atomicAdd(rr_terminated, num_terminated);
+    atomicAdd(rr_survived, num_survived);
+  }
+#endif
+
+  // Add to the running sum (averaging and gamma are done in resolve.fs).
+  // The ladder's pass is always a render's first, so prev is empty there.
+  vec4 prev = texture(accumTexture, TexCoords);
+  FragColour = prev + vec4(colour, float(num_samples));
+#ifdef MOMENTS
+  FragMoments = texture(momentsTexture, TexCoords).xy + moments;
+#endif
+#ifdef FEATURES
+  FragAlbedo = texture(albedoTexture, TexCoords) + albedo_depth;
+  FragNormal = texture(normalTexture, TexCoords) + normal_depth;
+#endif
+}
+#endif
 
-    vec3 ray_origin;
+#ifdef GUIDE_PASS
+// Only what follow_features() needs of each path: through mirrors and
+// glass to the first diffuse surface or light, with no lighting
+void main()
+{
+  vec4 albedo_depth = vec4(0.0f);
+  vec4 normal_depth = vec4(0.0f);
 
-    if(defocus_angle <= 0) {
-      ray_origin = camera_origin;
-    } else {
-      vec3 rand_disk = random_unit_disk(state);
-      ray_origin = camera_origin + rand_disk.x * defocus_disk_u + rand_disk.y * defocus_disk_v;
+  for (int i = 0; i < num_samples; i++)
+  {
+    rng_state state = rng_init(uint(gl_FragCoord.x), uint(gl_FragCoord.y), uint(i));
+
+    ray r;
+    camera_ray(state, r.origin, r.dir);
+    r.count = 0u;
+    r.albedo = vec3(1.0f);
+    r.weight = 1.0f;
+    r.light = vec3(0.0f);
+    r.pdf = 0.0f;
+    r.normal = vec3(0.0f);
+
+    feature_path = true;
+    feature_albedo = vec3(1.0f);
+    feature_normal = -normalize(r.dir);
+    feature_depth = 0.0f;
+    feature_hit_depth = 0.0f;
+
+    while (feature_path && r.count < bounce_limit)
+    {
+      hit h = hit_any(r.origin, r.dir);
+      if (!h.hit) {
+        feature_normal = -normalize(r.dir);
+        feature_depth = 0.0f;
+        break;
+      }
+
+      material m = get_material(h.mat);
+      follow_features(h, m, r);
+      if (!feature_path) break;
+
+      r.origin = h.point;
+      r.count = r.count + 1u;
+      rng_set_bounce(state, r.count);
+      material_shade(m, h, r, state);
     }
-    
-    colour += raycast(ray_origin, frag_loc - ray_origin, state);
+
+    albedo_depth += vec4(feature_albedo, feature_depth);
+    normal_depth += vec4(feature_normal, feature_hit_depth);
   }
-  
-  colour = colour/num_samples;
-  FragColour = vec4(colour, 0.0f);
 
-  float gamma = 2.2;
+  GuideAlbedo = albedo_depth / float(num_samples);
+  GuideNormal = normal_depth / float(num_samples);
+}
+#endif
+
+// The pixel this fragment traces (y counted down from the top, like
+// gl_FragCoord), which is somewhere else in the ladder's pass
+ivec2 frag_pixel()
+{
+  ivec2 f = ivec2(gl_FragCoord.xy);
+  if (refine_block.x <= 0.0f) return f;
+
+  ivec2 block = ivec2(refine_block);
+  ivec2 b = f / block;
+  int x, y;
+  refine_phase(b.y * REFINE_GRID + b.x, x, y);
+  return (f - b * block) * REFINE_GRID + ivec2(x, y);
+}
+
+// This pixel's camera ray for the sample state is for (jittered inside the
+// pixel, and from a point on the lens with defocus blur)
+void camera_ray(inout rng_state state, out vec3 origin, out vec3 dir)
+{
+  vec2 rand_square = sample_2d(state, SAMPLE_JITTER) - 0.5;
+#ifdef UPSCALE_JITTER
+  rand_square = pixel_jitter + rand_square * jitter_spread;
+#endif
+  vec2 pixel = vec2(frag_pixel());
+  vec3 frag_loc = viewport_top_left + (pixel.x + rand_square.x)*delta_u 
+                                    + (pixel.y + rand_square.y)*delta_v;
+
+  if(defocus_angle <= 0) {
+    origin = camera_origin;
+  } else {
+    vec3 rand_disk = random_unit_disk(state);
+    origin = camera_origin + rand_disk.x * defocus_disk_u + rand_disk.y * defocus_disk_v;
+  }
+  dir = frag_loc - origin;
+}
+
+sphere get_sphere(int i)
+{
+  vec4 a = SPHERE_TEXEL(2*i);
+  vec4 b = SPHERE_TEXEL(2*i + 1);
+
+  sphere s;
+  s.origin = a.xyz;
+  s.radius = a.w;
+  s.mat = int(b.x);
+  s.light = int(b.y);
+  return s;
+}
+
+light get_light(int i)
+{
+  vec4 a = LIGHT_TEXEL(2*i);
+  vec4 b = LIGHT_TEXEL(2*i + 1);
+
+  light l;
+  l.centre = a.xyz;
+  l.radius = a.w;
+  l.emit = b.xyz;
+  return l;
+}
+
+light_node get_light_node(int i)
+{
+  vec4 a = LIGHT_NODE_TEXEL(2*i);
+  vec4 b = LIGHT_NODE_TEXEL(2*i + 1);
+
+  light_node n;
+  n.centre = a.xyz;
+  n.radius = a.w;
+  n.power = b.x;
+  n.right = floatBitsToInt(b.y);
+  n.first = floatBitsToInt(b.z);
+  return n;
+}
 
-  FragColour.rgb = pow(FragColour.rgb, vec3(1.0/gamma));  
+material get_material(int i)
+{
+  vec4 a = MATERIAL_TEXEL(2*i);
+  vec4 b = MATERIAL_TEXEL(2*i + 1);
+
+  material m;
+  m.albedo = a.xyz;
+  m.param1 = a.w;
+  m.type = int(b.x);
+  m.id = int(b.y);
+  return m;
 }
 
 float hit_sphere(vec3 origin, float radius, vec3 ray_dir, vec3 ray_orig)
@@ -169,21 +486,46 @@ hit hit_any(vec3 ray_orig, vec3 ray_dir)
   h.normal = vec3(0.0f, 0.0f, 0.0f);
   h.hit = false;
   h.interior = false;
-  float t = -1.0f;
+  float t = 1e30f;
   float new_t;
   sphere s;
+  int s_index = -1;
 
-  for (int i=0; i<num_spheres; i++)
+  // Walk the BVH (see bvh.h): nodes are in depth first order, so on a hit
+  // we carry on to the next node and on a miss jump to its skip index
+  vec3 inv_dir = 1.0f / ray_dir;
+  int i = 0;
+  while (i < num_nodes)
   {
-    new_t = hit_sphere(spheres[i].origin, spheres[i].radius, ray_dir, ray_orig);
-    
-    if (t < 0 || (new_t < t && new_t > 0.001)) {
-      t = new_t;
-      s = spheres[i];
-    } 
+    vec4 a = NODE_TEXEL(2*i);
+    vec4 b = NODE_TEXEL(2*i + 1);
+
+    if (!hit_box(a.xyz, b.xyz, ray_orig, inv_dir, t)) {
+      i = floatBitsToInt(a.w);
+      continue;
+    }
+
+    int leaf = floatBitsToInt(b.w);
+    if (leaf >= 0) {
+      int start = leaf >> 2;
+      int end = start + (leaf & 3) + 1;
+
+      for (int j = start; j < end; j++)
+      {
+        sphere sj = get_sphere(j);
+        new_t = hit_sphere(sj.origin, sj.radius, ray_dir, ray_orig);
+
+        if (new_t > 0.001 && new_t < t) {
+          t = new_t;
+          s = sj;
+          s_index = j;
+        }
+      }
+    }
+    i = i + 1;
   }
 
-  if (t > 0.001f)
+  if (t < 1e30f)
   {
     h.point = ray_orig + ray_dir*t;
     h.normal = (h.point - s.origin) / s.radius;
@@ -192,13 +534,61 @@ hit hit_any(vec3 ray_orig, vec3 ray_dir)
       h.interior = true;
     }
     h.mat = s.mat;
+    h.sphere = s_index;
     h.hit = true;
   }
 
   return h;
 }
 
-ray bounce(ray r, inout xorshift32_state state)
+// hit_any() for shadow rays: whether anything is hit before t_max, so it
+// can stop at the first sphere instead of looking for the closest
+bool hit_shadow(vec3 ray_orig, vec3 ray_dir, float t_max)
+{
+  vec3 inv_dir = 1.0f / ray_dir;
+  int i = 0;
+  while (i < num_nodes)
+  {
+    vec4 a = NODE_TEXEL(2*i);
+    vec4 b = NODE_TEXEL(2*i + 1);
+
+    if (!hit_box(a.xyz, b.xyz, ray_orig, inv_dir, t_max)) {
+      i = floatBitsToInt(a.w);
+      continue;
+    }
+
+    int leaf = floatBitsToInt(b.w);
+    if (leaf >= 0) {
+      int start = leaf >> 2;
+      int end = start + (leaf & 3) + 1;
+
+      for (int j = start; j < end; j++)
+      {
+        sphere sj = get_sphere(j);
+        float t = hit_sphere(sj.origin, sj.radius, ray_dir, ray_orig);
+        if (t > 0.001 && t < t_max) {
+          return true;
+        }
+      }
+    }
+    i = i + 1;
+  }
+  return false;
+}
+
+bool hit_box(vec3 bmin, vec3 bmax, vec3 ray_orig, vec3 inv_dir, float t_max)
+{
+  vec3 t0 = (bmin - ray_orig) * inv_dir;
+  vec3 t1 = (bmax - ray_orig) * inv_dir;
+  vec3 t_near = min(t0, t1);
+  vec3 t_far = max(t0, t1);
+
+  float t_enter = max(max(t_near.x, t_near.y), max(t_near.z, 0.001));
+  float t_exit = min(min(t_far.x, t_far.y), min(t_far.z, t_max));
+  return t_enter <= t_exit;
+}
+
+ray bounce(ray r, inout rng_state state)
 {
   if (r.count >= bounce_limit) {
     r.albedo = vec3(0.0f, 0.0f, 0.0f);
@@ -208,13 +598,38 @@ ray bounce(ray r, inout xorshift32_state state)
 
     if (h.hit)
     {
+      material m = get_material(h.mat);
+#ifdef FEATURES
+      if (feature_path) {
+        follow_features(h, m, r);
+      }
+#endif
+
+      if (m.type == 4) {
+        // Emissive: pick up its light and stop there
+        r.light += r.weight * emitted_weight(h, r) * r.albedo * m.albedo * m.param1;
+        r.albedo = vec3(0.0f, 0.0f, 0.0f);
+        r.bounce = false;
+        return r;
+      }
+
       r.origin = h.point;
       r.count = r.count + 1u;
+      rng_set_bounce(state, r.count);
 
-      material_shade(h, r, state);
+      material_shade(m, h, r, state);
+      if (r.bounce && r.count >= rr_depth) {
+        roulette(r, state);
+      }
 
     } else {
-      r.albedo *= shade_sky(r.dir, r.albedo);
+#ifdef FEATURES
+      if (feature_path) {
+        feature_normal = -normalize(r.dir);
+        feature_depth = 0.0f;
+      }
+#endif
+      r.albedo *= shade_sky(r.dir, r.albedo) * r.weight;
       r.bounce = false;
     }
   }
@@ -222,9 +637,9 @@ ray bounce(ray r, inout xorshift32_state state)
   return r;
 }
 
-void material_shade(inout hit h, inout ray r, inout xorshift32_state state)
+void material_shade(material m, inout hit h, inout ray r, inout rng_state state)
 {
-  material m = materials[h.mat];
+  r.pdf = 0.0f;
 
   if(m.type == 1) {
     lambertian(m, h, r, state);
@@ -240,18 +655,185 @@ void material_shade(inout hit h, inout ray r, inout xorshift32_state state)
   return;
 }
 
-void lambertian(material m, inout hit h, inout ray r, inout xorshift32_state state)
+// Russian roulette: carry on with probability = the path's throughput,
+// and scale the survivors up by 1 / that so the average stays the same.
+// The scaling is kept apart from albedo in weight since the sky gets
+// multiplied by albedo twice (see shade_sky()).
+void roulette(inout ray r, inout rng_state state)
 {
-  r.dir = h.normal + random_on_hemisphere(state, h.normal);
-  if (near_zero(r.dir)) {
-    r.dir  = h.normal;
+  float p = min(1.0f, r.weight * max(r.albedo.r, max(r.albedo.g, r.albedo.b)));
+  if (rand_float(state) < p) {
+    r.weight /= p;
+    num_survived++;
+  } else {
+    r.albedo = vec3(0.0f, 0.0f, 0.0f);
+    r.bounce = false;
+    num_terminated++;
+  }
+}
+
+// How much light a light tree node could send to point p on a surface
+// facing n, up to a constant (see light_tree::importance())
+float light_importance(light_node node, vec3 p, vec3 n)
+{
+  vec3 w = node.centre - p;
+  float d2 = dot(w, w);
+  float r2 = node.radius * node.radius;
+  if (d2 <= r2) return node.power / r2;
+
+  // Angle from the normal to the centre, less the cone's half angle
+  float cos_n = dot(n, w) / sqrt(d2);
+  float sin2_u = r2 / d2;
+  float cos_u = sqrt(1.0f - sin2_u);
+  float cos_term = 1.0f;
+  if (cos_n < cos_u) {
+    float sin_n = sqrt(max(0.0f, 1.0f - cos_n * cos_n));
+    cos_term = max(0.0f, cos_n * cos_u + sin_n * sqrt(sin2_u));
+  }
+  return node.power * cos_term / d2;
+}
+
+// Walks down the light tree picking a child in proportion to its
+// importance, reusing u for every choice. Returns the light (-1 if none
+// can reach p) and its chance in pmf.
+int sample_light_tree(vec3 p, vec3 n, float u, out float pmf)
+{
+  pmf = 1.0f;
+  light_node node = get_light_node(0);
+  int i = 0;
+  while (node.right >= 0)
+  {
+    light_node left = get_light_node(i + 1);
+    light_node right = get_light_node(node.right);
+    float il = light_importance(left, p, n);
+    float ir = light_importance(right, p, n);
+    if (il + ir <= 0.0f) return -1;
+
+    float p_left = il / (il + ir);
+    if (u < p_left) {
+      u = u / p_left;
+      pmf *= p_left;
+      i = i + 1;
+      node = left;
+    } else {
+      u = (u - p_left) / (1.0f - p_left);
+      pmf *= 1.0f - p_left;
+      i = node.right;
+      node = right;
+    }
+    u = min(u, 0.99999994f);
+  }
+  return node.first;
+}
+
+// The chance sample_light_tree() picks light l for point p facing n
+float light_tree_pmf(int l, vec3 p, vec3 n)
+{
+  float pmf = 1.0f;
+  light_node node = get_light_node(0);
+  int i = 0;
+  while (node.right >= 0)
+  {
+    light_node left = get_light_node(i + 1);
+    light_node right = get_light_node(node.right);
+    float il = light_importance(left, p, n);
+    float ir = light_importance(right, p, n);
+    if (il + ir <= 0.0f) return 0.0f;
+
+    if (l < right.first) {
+      pmf *= il / (il + ir);
+      i = i + 1;
+      node = left;
+    } else {
+      pmf *= ir / (il + ir);
+      i = node.right;
+      node = right;
+    }
   }
+  return pmf;
+}
+
+// MIS weight for a light the last bounce ran into (r.origin and r.normal
+// are still where it came from). Light sampling could have found it too if
+// the bounce was lambertian, so that gets the power heuristic weight,
+// anything else (camera, mirror, glass) can only get here this way.
+float emitted_weight(hit h, ray r)
+{
+  if (r.pdf < 0.0f) return 0.0f; // already counted (see lambertian())
+  if (r.pdf <= 0.0f) return 1.0f;
+  sphere s = get_sphere(h.sphere);
+  if (s.light < 0) return 1.0f;
+
+  vec3 to_light = s.origin - r.origin;
+  float one_minus_cos = sphere_cone(s.radius * s.radius, dot(to_light, to_light));
+  if (one_minus_cos <= 0.0f) return 1.0f;
+
+  float light_pdf = light_tree_pmf(s.light, r.origin, r.normal) / (2.0f * WARP_PI * one_minus_cos);
+  return r.pdf * r.pdf / (r.pdf * r.pdf + light_pdf * light_pdf);
+}
+
+// Next event estimation at a lambertian hit: pick a light with the light
+// tree, aim at a point in the cone it covers and check nothing's in the
+// way with hit_shadow(). Returns the light reflected towards the ray
+// (before the path's throughput), weighted against the bounce finding the
+// same light (see emitted_weight()).
+vec3 sample_light(material m, hit h, inout rng_state state)
+{
+  if (num_lights == 0) return vec3(0.0f);
+
+  float pmf = 0.0f;
+  int i = sample_light_tree(h.point, h.normal, rand_float(state), pmf);
+  if (i < 0) return vec3(0.0f);
+  light l = get_light(i);
+
+  vec3 to_light = l.centre - h.point;
+  float d2 = dot(to_light, to_light);
+  float one_minus_cos = sphere_cone(l.radius * l.radius, d2);
+  if (one_minus_cos <= 0.0f) return vec3(0.0f);
+
+  vec2 u = sample_2d(state, SAMPLE_LIGHT);
+  vec3 axis = to_light / sqrt(d2);
+  vec3 dir = vec3(0.0f);
+  uniform_cone(axis.x, axis.y, axis.z, one_minus_cos, u.x, u.y, dir.x, dir.y, dir.z);
+
+  float cos_n = dot(dir, h.normal);
+  if (cos_n <= 0.0f) return vec3(0.0f);
+
+  // Distance to the light's surface, stop the shadow ray just short of it
+  float b = dot(dir, to_light);
+  float t = b - sqrt(max(0.0f, b*b - d2 + l.radius*l.radius));
+  if (hit_shadow(h.point, dir, 0.999f * t)) return vec3(0.0f);
+
+  float light_pdf = pmf / (2.0f * WARP_PI * one_minus_cos);
+  float bsdf_pdf = cos_n / WARP_PI;
+  float w = light_pdf * light_pdf / (light_pdf * light_pdf + bsdf_pdf * bsdf_pdf);
+  return (w * cos_n / (WARP_PI * light_pdf)) * m.albedo * l.emit;
+}
+
+void lambertian(material m, inout hit h, inout ray r, inout rng_state state)
+{
+  // With --restir the first hit's direct light comes from the pixel's
+  // reservoir instead, which covers all of it: the bounce gets pdf -1 so
+  // emitted_weight() doesn't count a light it runs into again.
+  vec3 direct = vec3(0.0f);
+  bool reused = false;
+#ifdef RESTIR
+  reused = r.count == 1u && restir_direct(m, h, direct);
+#endif
+  if (!reused) {
+    direct = sample_light(m, h, state);
+  }
+
+  r.light += r.weight * r.albedo * direct;
+  r.dir = random_cosine_direction(state, h.normal);
+  r.pdf = reused ? -1.0f : dot(r.dir, h.normal) / WARP_PI;
+  r.normal = h.normal;
   r.bounce = true;
   r.albedo *= m.albedo;
   return;
 }
 
-void metallic(material m, inout hit h, inout ray r, inout xorshift32_state state)
+void metallic(material m, inout hit h, inout ray r, inout rng_state state)
 {
   r.dir = reflect(r.dir, normalize(h.normal));
   r.dir = normalize(r.dir) + (m.param1 * random_unit_vector(state));
@@ -264,7 +846,7 @@ void metallic(material m, inout hit h, inout ray r, inout xorshift32_state state
   return;
 }
 
-void dialectric(material m, inout hit h, inout ray r, inout xorshift32_state state)
+void dialectric(material m, inout hit h, inout ray r, inout rng_state state)
 {
   float rel_refract_index = m.param1;
   if (!h.interior) {
@@ -282,20 +864,48 @@ void dialectric(material m, inout hit h, inout ray r, inout xorshift32_state sta
     r.dir = reflect(unit_dir, unit_normal);
   } else { 
     r.dir = refract(unit_dir, unit_normal, rel_refract_index);
+    // (grazing rays can still round to total internal reflection)
+    if (r.dir == vec3(0.0f)) {
+      r.dir = reflect(unit_dir, unit_normal);
+    }
   }
 
   r.bounce = true;
   return;
 }
 
+#ifdef FEATURES
+void follow_features(hit h, material m, ray r)
+{
+  float distance = length(h.point - r.origin);
+  if (feature_hit_depth == 0.0f) {
+    feature_hit_depth = distance;
+  }
+  feature_normal = h.normal;
+  feature_depth += distance;
+
+  if (m.type == 2 && m.param1 <= DENOISE_SPECULAR_FUZZ) {
+    feature_albedo *= m.albedo;
+  } else if (m.type != 3) {
+    if (m.type == 1 || m.type == 2) {
+      feature_albedo *= m.albedo;
+    }
+    feature_path = false;
+  }
+}
+#endif
 
-vec3 raycast(vec3 ray_orig, vec3 ray_dir, inout xorshift32_state state)
+vec3 raycast(vec3 ray_orig, vec3 ray_dir, inout rng_state state)
 {
   ray r;
   r.count = 0u;
   r.origin = ray_orig;
   r.dir = ray_dir;
   r.albedo = vec3(1.0f, 1.0f, 1.0f);
+  r.weight = 1.0f;
+  r.light = vec3(0.0f, 0.0f, 0.0f);
+  r.pdf = 0.0f;
+  r.normal = vec3(0.0f);
   r.bounce = true;
 
   while(true) 
@@ -304,7 +914,7 @@ vec3 raycast(vec3 ray_orig, vec3 ray_dir, inout xorshift32_state state)
     if (!r.bounce) break;
   }
 
-  return r.albedo;
+  return r.albedo + r.light;
 }
 
 float shlick(float cosine, float rel_refract_index)
@@ -323,83 +933,56 @@ vec3 shade_sky(vec3 dir, vec3 albedo) {
   return albedo;
 }
 
-uint xorshift32(inout xorshift32_state state) {
-  uint x = state.a;
-  x ^= x << 13;
-  x ^= x >> 17;
-  x ^= x << 5;
-  return state.a = x;
-}
-
-float rand_float(inout xorshift32_state state) {
-  uint x = xorshift32(state);
-  const uint ieeeMantissa = 0x007FFFFFu;
-  const uint ieeeOne      = 0x3F800000u;
-  x &= ieeeMantissa;
-  x |= ieeeOne;
-
-  float f = uintBitsToFloat(x);
-  f = f - 1.0f;
-
-  return f;
+float rand_float(inout rng_state state) {
+  return rng_next(state);
 }
 
-vec3 rand_vec(inout xorshift32_state state) {
-  return vec3(rand_float(state), rand_float(state), rand_float(state));
-}
-
-vec3 random_unit_vector(inout xorshift32_state state) {
-  vec3 p;
-  float lensq;
-  uint i = 0u;
-  while (true)
-  {
-    state.a += i;
-    p = rand_vec(state);
-    lensq = dot(p, p);
-    if (1e-160 < lensq && lensq <= 1)
-    {
-      return p / sqrt(lensq);
-    }
-    i += 1u;
-  }
+// Quasi random point for one of this bounce's SAMPLE_ pairs (see
+// sampler.h). With SEED_BLUE_NOISE every pixel gets the same points,
+// shifted by the blue noise tile, otherwise they're scrambled per pixel.
+vec2 sample_2d(rng_state state, uint pair) {
+  uint x, y;
+#ifdef SEED_BLUE_NOISE
+  sobol_2d(state.sample_index, sampler_seed(state, pair, false), x, y);
+  uint d = 2u * (state.bounce * SAMPLER_PAIRS + pair);
+  x += blue_noise(d);
+  y += blue_noise(d + 1u);
+#else
+  sobol_2d(state.sample_index, sampler_seed(state, pair, true), x, y);
+#endif
+  return vec2(rng_to_float(x), rng_to_float(y));
 }
 
-vec3 random_unit_disk(inout xorshift32_state state) {
-  vec3 p;
-  float lensq;
-  uint i = 0u;
-  while (true)
-  {
-    state.a += i;
-    p = vec3(rand_float(state), rand_float(state), 0);
-    lensq = dot(p, p);
-    if (lensq <= 1)
-    {
-      return p;
-    }
-    i += 1u;
-  }
+#ifdef SEED_BLUE_NOISE
+// Tile value for dimension d (read at a different offset per dimension),
+// scaled to 32 bits
+uint blue_noise(uint d) {
+  ivec2 tile = textureSize(seedTexture, 0);
+  ivec2 p = (frag_pixel() + int(d) * ivec2(23, 41)) % tile;
+  return uint(texelFetch(seedTexture, p, 0).r * 65535.0 + 0.5) << 16u;
 }
-
-vec3 random_on_hemisphere(inout xorshift32_state state, vec3 normal) {
-  vec3 on_unit_sphere = random_unit_vector(state);
-  if (dot(on_unit_sphere, normal) >= 0) {
-    return on_unit_sphere;
-  } else {
-    return -on_unit_sphere;
-  }
+#endif
+
+// Closed form warps of the quasi random points (see warp.h)
+vec3 random_unit_vector(inout rng_state state) {
+  vec2 u = sample_2d(state, SAMPLE_SCATTER);
+  vec3 p = vec3(0.0);
+  uniform_sphere(u.x, u.y, p.x, p.y, p.z);
+  return p;
 }
 
-uint cantor(uint k1, uint k2) {
-  uint x = (k1 + k2)*(k1 + k2 + 1u);
-  x = x >> 1;
-  return x + k2;
+vec3 random_unit_disk(inout rng_state state) {
+  vec2 u = sample_2d(state, SAMPLE_LENS);
+  vec3 p = vec3(0.0);
+  concentric_disk(u.x, u.y, p.x, p.y);
+  return p;
 }
 
-bool near_zero(vec3 v) {
-  float s = 1e-8;
-  return (abs(v.x) < s && abs(v.y) < s && abs(v.z) < s);
+vec3 random_cosine_direction(inout rng_state state, vec3 normal) {
+  vec2 u = sample_2d(state, SAMPLE_SCATTER);
+  vec3 d = vec3(0.0);
+  cosine_hemisphere(normal.x, normal.y, normal.z, u.x, u.y, d.x, d.y, d.z);
+  return d;
 }
 
 float bad_rand(vec2 co){
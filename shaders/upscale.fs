@@ -0,0 +1,113 @@
+#version 330 core
+layout(pixel_center_integer, origin_upper_left) in vec4 gl_FragCoord;
+
+// Reconstructs the window sized image from the render, instead of
+// stretching it (joint bilateral upsampling, Kopf et al. 2007, guided like
+// the denoiser, see denoise.h). The render's colour is divided by its
+// albedo guide, and the lighting that's left is interpolated from the
+// nearest 4x4 render pixels. Each one counts as much as its normal and
+// depth guides match this window pixel's own, which are traced at window
+// resolution (GUIDE_PASS in testFragment.fs). Then this pixel's albedo goes
+// back on. Edges and textures come out at window resolution, the lighting
+// is only as sharp as the render.
+//
+// With jitter there are also the samples that landed in this window pixel
+// itself (see upscale_history.fs). The interpolated colour counts as
+// UPSCALE_PRIOR samples on top of them, so a still view sharpens up as
+// they come in.
+
+out vec4 FragColour;
+
+in vec2 TexCoords;
+
+#include "../denoise.h"
+
+uniform sampler2D accumTexture;       // render (rgb = sum of samples, a = count)
+uniform sampler2D albedoTexture;      // render's sum of guide albedo, sum of depth
+uniform sampler2D normalTexture;      // render's sum of guide normals
+uniform sampler2D colourTexture;      // the denoiser's output, if denoised
+uniform sampler2D guideAlbedoTexture; // window's guide (albedo, depth)
+uniform sampler2D guideNormalTexture; // window's guide normal
+uniform sampler2D historyTexture;     // samples in each window pixel (rgb = sum, a = count)
+
+uniform bool denoised;
+uniform bool jitter;
+
+#define UPSCALE_SPATIAL_SIGMA 0.6f  // render pixels
+#define UPSCALE_NORMAL_POWER 32.0f
+#define UPSCALE_DEPTH_SIGMA 0.1f    // relative depth change allowed per render pixel of offset
+#define UPSCALE_PRIOR 64.0f         // samples the interpolated colour is worth
+
+// Texel of pixel p (y counted down from the top) in a texture of size
+ivec2 texel(ivec2 p, ivec2 size)
+{
+  return ivec2(p.x, size.y - 1 - p.y);
+}
+
+void main()
+{
+  ivec2 size = textureSize(accumTexture, 0);
+  ivec2 window_size = textureSize(guideAlbedoTexture, 0);
+  vec2 scale = vec2(size) / vec2(window_size);
+  ivec2 p = texel(ivec2(gl_FragCoord.xy), window_size);
+
+  vec4 guide_albedo = texelFetch(guideAlbedoTexture, p, 0);
+  vec3 albedo = max(guide_albedo.rgb, vec3(DENOISE_MIN_ALBEDO));
+  float depth = guide_albedo.a;
+  vec3 normal = texelFetch(guideNormalTexture, p, 0).xyz;
+  normal = dot(normal, normal) > 0.0f ? normalize(normal) : normal;
+
+  // This pixel's centre in render pixels (both have pixel 0's centre on
+  // the viewport's corner, see camera_ray())
+  vec2 c = gl_FragCoord.xy * scale;
+  ivec2 base = ivec2(floor(c));
+
+  vec3 sum = vec3(0.0f);
+  float weight_sum = 0.0f;
+
+  // (the one that matches best, for when none match at all, like thin
+  // things the render missed)
+  vec3 best = vec3(0.0f);
+  float best_weight = -1.0f;
+
+  for (int dy = -1; dy <= 2; dy++)
+  {
+    for (int dx = -1; dx <= 2; dx++)
+    {
+      ivec2 q = clamp(base + ivec2(dx, dy), ivec2(0), size - 1);
+      ivec2 t = texel(q, size);
+
+      vec4 accum = texelFetch(accumTexture, t, 0);
+      float n = max(accum.a, 1.0f);
+      vec4 q_albedo = texelFetch(albedoTexture, t, 0) / n;
+      vec3 q_normal = texelFetch(normalTexture, t, 0).xyz;
+      q_normal = dot(q_normal, q_normal) > 0.0f ? normalize(q_normal) : q_normal;
+
+      vec3 colour = denoised ? pow(texelFetch(colourTexture, t, 0).rgb, vec3(2.2f)) : accum.rgb / n;
+      vec3 lighting = colour / max(q_albedo.rgb, vec3(DENOISE_MIN_ALBEDO));
+
+      // (the sky has depth 0, so it never mixes with anything else)
+      float offset = distance(vec2(q), c);
+      float w_n = pow(max(0.0f, dot(normal, q_normal)), UPSCALE_NORMAL_POWER);
+      float w_z = exp(-abs(depth - q_albedo.a) / (UPSCALE_DEPTH_SIGMA * depth * max(offset, 1.0f) + 1e-3f));
+      float w_s = exp(-offset * offset / (2.0f * UPSCALE_SPATIAL_SIGMA * UPSCALE_SPATIAL_SIGMA));
+
+      sum += w_s * w_n * w_z * lighting;
+      weight_sum += w_s * w_n * w_z;
+      if (w_n * w_z > best_weight) {
+        best = lighting;
+        best_weight = w_n * w_z;
+      }
+    }
+  }
+
+  vec3 colour = albedo * (weight_sum > 1e-4f ? sum / weight_sum : best);
+
+  if (jitter) {
+    vec4 history = texelFetch(historyTexture, p, 0);
+    colour = (history.rgb + UPSCALE_PRIOR * colour) / (history.a + UPSCALE_PRIOR);
+  }
+
+  float gamma = 2.2;
+  FragColour = vec4(pow(colour, vec3(1.0/gamma)), 1.0);
+}
@@ -0,0 +1,39 @@
+#version 330 core
+layout(pixel_center_integer, origin_upper_left) in vec4 gl_FragCoord;
+
+// Adds the pass that just finished to the window pixels its samples landed
+// in, for upscale.fs, drawn with additive blending. With jitter, every
+// sample a render pixel took this pass was close to the same point (see
+// UPSCALE_JITTER in testFragment.fs). That point is in exactly one window
+// pixel, so the pass's samples for the render pixel go there. The pass is
+// what the accumulation buffer gained over the one before it. Over a few
+// passes the points cover every window pixel.
+
+out vec4 FragColour;
+
+in vec2 TexCoords;
+
+uniform sampler2D accumTexture; // after the pass (rgb = sum of samples, a = count)
+uniform sampler2D prevTexture;  // before it
+
+uniform vec2 pixel_jitter;  // as in testFragment.fs
+uniform vec2 jitter_spread; // a window pixel, in render pixels
+
+void main()
+{
+  ivec2 size = textureSize(accumTexture, 0);
+
+  // The render pixel whose samples were closest to this window pixel's
+  // centre (in render pixels, see upscale.fs), if they were inside it
+  vec2 c = gl_FragCoord.xy * jitter_spread;
+  ivec2 q = ivec2(floor(c - pixel_jitter + 0.5f));
+  vec2 landed = (vec2(q) + pixel_jitter) / jitter_spread;
+  if (any(notEqual(ivec2(floor(landed + 0.5f)), ivec2(gl_FragCoord.xy)))
+      || any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size))) {
+    discard;
+  }
+
+  // (texture rows go up)
+  ivec2 t = ivec2(q.x, size.y - 1 - q.y);
+  FragColour = texelFetch(accumTexture, t, 0) - texelFetch(prevTexture, t, 0);
+}
@@ -1,8 +1,7 @@
 #ifndef SPHERE_H
 #define SPHERE_H
 
-#include <glad/glad.h>
-#include <SDL2/SDL.h>
+#include <vector>
 
 #include "vec3.h"
 #include "hittable.h"
@@ -14,24 +13,17 @@ class sphere : public hittable
     float radius;
     vec3 origin;
     material *mat;
+    int mat_id; // filled in when added to a hittable_list
+    int light;  // index in material_list::lights, -1 if it isn't one
 
-    sphere() : radius{0.0f}, origin{vec3(0.0f, 0.0f, 0.0f)} {};
-    sphere(float my_radius, vec3 my_origin, material *my_material) : hittable{32},  
-                radius{my_radius}, origin{my_origin}, mat{my_material} {};
+    sphere() : radius{0.0f}, origin{vec3(0.0f, 0.0f, 0.0f)}, mat{nullptr}, mat_id{0}, light{-1} {};
+    sphere(float my_radius, vec3 my_origin, material *my_material) : hittable{8},  
+                radius{my_radius}, origin{my_origin}, mat{my_material}, mat_id{0}, light{-1} {};
 
-    virtual void add(unsigned int glBuffer, int offset) const override {
-
-        glBindBuffer(GL_UNIFORM_BUFFER, glBuffer);
-        glBufferSubData(GL_UNIFORM_BUFFER, offset, sizeof(int), &(mat->id));
-        glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
-        glBindBuffer(GL_UNIFORM_BUFFER, glBuffer);
-        glBufferSubData(GL_UNIFORM_BUFFER, offset + 4, sizeof(float), &radius);
-        glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
-        glBindBuffer(GL_UNIFORM_BUFFER, glBuffer);
-        glBufferSubData(GL_UNIFORM_BUFFER, offset + 16, sizeof(float) * 3, &origin);
-        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    // Two vec4s: (origin, radius), (material id, light, 0, 0)
+    virtual void pack(std::vector<float> &data) const override {
+        data.insert(data.end(), {origin[0], origin[1], origin[2], radius});
+        data.insert(data.end(), {float(mat_id), float(light), 0.0f, 0.0f});
     }
 };
 
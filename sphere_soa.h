@@ -0,0 +1,317 @@
+#ifndef SPHERE_SOA_H
+#define SPHERE_SOA_H
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE4_1__) || defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include "vec3.h"
+#include "sphere.h"
+#include "hittable_list.h"
+
+// Structure of arrays copy of the spheres for the CPU renderer's hot loop.
+//
+// Centres, radius squared and material ids live in separate 64 byte aligned
+// arrays, so closest_hit() can load 4/8/16 spheres at a time straight into
+// SSE/AVX2/AVX-512 registers and test one ray against all of them at once.
+// The width is picked at compile time from what the compiler is allowed to
+// use (the makefile builds with -march=native).
+
+#if defined(__AVX512F__)
+#define SPHERE_SIMD_WIDTH 16
+#elif defined(__AVX2__)
+#define SPHERE_SIMD_WIDTH 8
+#elif defined(__SSE4_1__)
+#define SPHERE_SIMD_WIDTH 4
+#else
+#define SPHERE_SIMD_WIDTH 1
+#endif
+
+class sphere_soa
+{
+    public:
+
+    int count;
+    float *cx;
+    float *cy;
+    float *cz;
+    float *r2;
+    float *radius;
+    int *mat;
+
+    sphere_soa() : count{0}, cx{nullptr}, cy{nullptr}, cz{nullptr}, r2{nullptr}, radius{nullptr}, mat{nullptr} {};
+
+    sphere_soa(const hittable_list &list) : sphere_soa()
+    {
+        build(list);
+    }
+
+    ~sphere_soa()
+    {
+        release();
+    }
+
+    sphere_soa(const sphere_soa&) = delete;
+    sphere_soa& operator=(const sphere_soa&) = delete;
+
+    // Copies the spheres in list order (so BVH leaf ranges still apply)
+    void build(const hittable_list &list)
+    {
+        release();
+        count = int(list.objects.size());
+
+        // Pad by a full register so the kernel can always do whole loads
+        size_t padded = size_t(count) + SPHERE_SIMD_WIDTH;
+        cx = alloc<float>(padded);
+        cy = alloc<float>(padded);
+        cz = alloc<float>(padded);
+        r2 = alloc<float>(padded);
+        radius = alloc<float>(padded);
+        mat = alloc<int>(padded);
+
+        for (int i = 0; i < count; i++) {
+            const sphere &s = list.objects[i];
+            cx[i] = s.origin[0];
+            cy[i] = s.origin[1];
+            cz[i] = s.origin[2];
+            r2[i] = s.radius * s.radius;
+            radius[i] = s.radius;
+            mat[i] = s.mat_id;
+        }
+    }
+
+    // Finds the closest sphere in [begin, end) hit by the ray at 0.001 < t < t_max
+    // (the same rules as hit_sphere() in the shader). Returns its index and
+    // sets t_max to the hit distance, or returns -1 and leaves t_max alone.
+    int closest_hit(int begin, int end, const point3 &orig, const vec3 &dir, float &t_max) const
+    {
+        // A BVH leaf of a few spheres doesn't fill a register, and the
+        // broadcasts and lane reduction cost more than they save
+        if (SPHERE_SIMD_WIDTH == 1 || end - begin <= SHORT_RANGE) {
+            return closest_hit_scalar(begin, end, orig, dir, t_max);
+        }
+
+#if SPHERE_SIMD_WIDTH > 1
+        float a = dot(dir, dir);
+        float inv_a = 1.0f / a;
+
+#if SPHERE_SIMD_WIDTH == 16
+        const __m512 ox = _mm512_set1_ps(orig[0]), oy = _mm512_set1_ps(orig[1]), oz = _mm512_set1_ps(orig[2]);
+        const __m512 dx = _mm512_set1_ps(dir[0]), dy = _mm512_set1_ps(dir[1]), dz = _mm512_set1_ps(dir[2]);
+        const __m512 va = _mm512_set1_ps(a), vinv_a = _mm512_set1_ps(inv_a);
+        const __m512 eps = _mm512_set1_ps(0.001f);
+        const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        const __m512i vend = _mm512_set1_epi32(end);
+
+        __m512 best_t = _mm512_set1_ps(t_max);
+        __m512i best_i = _mm512_set1_epi32(-1);
+
+        for (int i = begin; i < end; i += 16)
+        {
+            __m512 ocx = _mm512_sub_ps(_mm512_loadu_ps(cx + i), ox);
+            __m512 ocy = _mm512_sub_ps(_mm512_loadu_ps(cy + i), oy);
+            __m512 ocz = _mm512_sub_ps(_mm512_loadu_ps(cz + i), oz);
+
+            __m512 h = _mm512_fmadd_ps(dx, ocx, _mm512_fmadd_ps(dy, ocy, _mm512_mul_ps(dz, ocz)));
+            __m512 c = _mm512_fmadd_ps(ocx, ocx, _mm512_fmadd_ps(ocy, ocy, _mm512_fmsub_ps(ocz, ocz, _mm512_loadu_ps(r2 + i))));
+            __m512 disc = _mm512_fmsub_ps(h, h, _mm512_mul_ps(va, c));
+
+            __m512i idx = _mm512_add_epi32(_mm512_set1_epi32(i), lanes);
+            __mmask16 valid = _mm512_cmp_ps_mask(disc, _mm512_setzero_ps(), _CMP_GE_OQ)
+                            & _mm512_cmplt_epi32_mask(idx, vend);
+
+            __m512 sq = _mm512_sqrt_ps(_mm512_max_ps(disc, _mm512_setzero_ps()));
+            __m512 t0 = _mm512_mul_ps(_mm512_sub_ps(h, sq), vinv_a);
+            __m512 t1 = _mm512_mul_ps(_mm512_add_ps(h, sq), vinv_a);
+            __m512 t = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(t0, eps, _CMP_GE_OQ), t1, t0);
+
+            valid &= _mm512_cmp_ps_mask(t, eps, _CMP_GE_OQ) & _mm512_cmp_ps_mask(t, best_t, _CMP_LT_OQ);
+
+            best_t = _mm512_mask_blend_ps(valid, best_t, t);
+            best_i = _mm512_mask_blend_epi32(valid, best_i, idx);
+        }
+
+        alignas(64) float ts[16];
+        alignas(64) int is[16];
+        _mm512_store_ps(ts, best_t);
+        _mm512_store_si512((__m512i*)is, best_i);
+#elif SPHERE_SIMD_WIDTH == 8
+        const __m256 ox = _mm256_set1_ps(orig[0]), oy = _mm256_set1_ps(orig[1]), oz = _mm256_set1_ps(orig[2]);
+        const __m256 dx = _mm256_set1_ps(dir[0]), dy = _mm256_set1_ps(dir[1]), dz = _mm256_set1_ps(dir[2]);
+        const __m256 va = _mm256_set1_ps(a), vinv_a = _mm256_set1_ps(inv_a);
+        const __m256 eps = _mm256_set1_ps(0.001f);
+        const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m256i vend = _mm256_set1_epi32(end);
+
+        __m256 best_t = _mm256_set1_ps(t_max);
+        __m256i best_i = _mm256_set1_epi32(-1);
+
+        for (int i = begin; i < end; i += 8)
+        {
+            __m256 ocx = _mm256_sub_ps(_mm256_loadu_ps(cx + i), ox);
+            __m256 ocy = _mm256_sub_ps(_mm256_loadu_ps(cy + i), oy);
+            __m256 ocz = _mm256_sub_ps(_mm256_loadu_ps(cz + i), oz);
+
+            __m256 h = _mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_add_ps(_mm256_mul_ps(dy, ocy), _mm256_mul_ps(dz, ocz)));
+            __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_add_ps(_mm256_mul_ps(ocy, ocy), _mm256_mul_ps(ocz, ocz))),
+                                     _mm256_loadu_ps(r2 + i));
+            __m256 disc = _mm256_sub_ps(_mm256_mul_ps(h, h), _mm256_mul_ps(va, c));
+
+            __m256i idx = _mm256_add_epi32(_mm256_set1_epi32(i), lanes);
+            __m256 valid = _mm256_and_ps(_mm256_cmp_ps(disc, _mm256_setzero_ps(), _CMP_GE_OQ),
+                                         _mm256_castsi256_ps(_mm256_cmpgt_epi32(vend, idx)));
+
+            __m256 sq = _mm256_sqrt_ps(_mm256_max_ps(disc, _mm256_setzero_ps()));
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(h, sq), vinv_a);
+            __m256 t1 = _mm256_mul_ps(_mm256_add_ps(h, sq), vinv_a);
+            __m256 t = _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, eps, _CMP_GE_OQ));
+
+            valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, eps, _CMP_GE_OQ), _mm256_cmp_ps(t, best_t, _CMP_LT_OQ)));
+
+            best_t = _mm256_blendv_ps(best_t, t, valid);
+            best_i = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best_i), _mm256_castsi256_ps(idx), valid));
+        }
+
+        alignas(32) float ts[8];
+        alignas(32) int is[8];
+        _mm256_store_ps(ts, best_t);
+        _mm256_store_si256((__m256i*)is, best_i);
+#elif SPHERE_SIMD_WIDTH == 4
+        const __m128 ox = _mm_set1_ps(orig[0]), oy = _mm_set1_ps(orig[1]), oz = _mm_set1_ps(orig[2]);
+        const __m128 dx = _mm_set1_ps(dir[0]), dy = _mm_set1_ps(dir[1]), dz = _mm_set1_ps(dir[2]);
+        const __m128 va = _mm_set1_ps(a), vinv_a = _mm_set1_ps(inv_a);
+        const __m128 eps = _mm_set1_ps(0.001f);
+        const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+        const __m128i vend = _mm_set1_epi32(end);
+
+        __m128 best_t = _mm_set1_ps(t_max);
+        __m128i best_i = _mm_set1_epi32(-1);
+
+        for (int i = begin; i < end; i += 4)
+        {
+            __m128 ocx = _mm_sub_ps(_mm_loadu_ps(cx + i), ox);
+            __m128 ocy = _mm_sub_ps(_mm_loadu_ps(cy + i), oy);
+            __m128 ocz = _mm_sub_ps(_mm_loadu_ps(cz + i), oz);
+
+            __m128 h = _mm_add_ps(_mm_mul_ps(dx, ocx), _mm_add_ps(_mm_mul_ps(dy, ocy), _mm_mul_ps(dz, ocz)));
+            __m128 c = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_add_ps(_mm_mul_ps(ocy, ocy), _mm_mul_ps(ocz, ocz))),
+                                  _mm_loadu_ps(r2 + i));
+            __m128 disc = _mm_sub_ps(_mm_mul_ps(h, h), _mm_mul_ps(va, c));
+
+            __m128i idx = _mm_add_epi32(_mm_set1_epi32(i), lanes);
+            __m128 valid = _mm_and_ps(_mm_cmpge_ps(disc, _mm_setzero_ps()),
+                                      _mm_castsi128_ps(_mm_cmpgt_epi32(vend, idx)));
+
+            __m128 sq = _mm_sqrt_ps(_mm_max_ps(disc, _mm_setzero_ps()));
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(h, sq), vinv_a);
+            __m128 t1 = _mm_mul_ps(_mm_add_ps(h, sq), vinv_a);
+            __m128 t = _mm_blendv_ps(t1, t0, _mm_cmpge_ps(t0, eps));
+
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(t, eps), _mm_cmplt_ps(t, best_t)));
+
+            best_t = _mm_blendv_ps(best_t, t, valid);
+            best_i = _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(best_i), _mm_castsi128_ps(idx), valid));
+        }
+
+        alignas(16) float ts[4];
+        alignas(16) int is[4];
+        _mm_store_ps(ts, best_t);
+        _mm_store_si128((__m128i*)is, best_i);
+#endif
+
+        // Pick the closest of the lanes
+        int best = -1;
+        for (int l = 0; l < SPHERE_SIMD_WIDTH; l++) {
+            if (is[l] >= 0 && ts[l] < t_max) {
+                t_max = ts[l];
+                best = is[l];
+            }
+        }
+        return best;
+#endif
+    }
+
+    // Plain loop, for short ranges and builds without SSE4.1
+    int closest_hit_scalar(int begin, int end, const point3 &orig, const vec3 &dir, float &t_max) const
+    {
+        float a = dot(dir, dir);
+        float inv_a = 1.0f / a;
+        int best = -1;
+
+        for (int i = begin; i < end; i++)
+        {
+            float ocx = cx[i] - orig[0], ocy = cy[i] - orig[1], ocz = cz[i] - orig[2];
+            float h = dir[0]*ocx + dir[1]*ocy + dir[2]*ocz;
+            float c = ocx*ocx + ocy*ocy + ocz*ocz - r2[i];
+            float disc = h*h - a*c;
+            if (disc < 0) continue;
+
+            float sq = std::sqrt(disc);
+            float t = (h - sq) * inv_a;
+            if (t < 0.001f) t = (h + sq) * inv_a;
+
+            if (t >= 0.001f && t < t_max) {
+                t_max = t;
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    // Whether any sphere in [begin, end) is hit at 0.001 < t < t_max, for
+    // shadow rays: stops at the first one rather than finding the closest
+    bool any_hit(int begin, int end, const point3 &orig, const vec3 &dir, float t_max) const
+    {
+        float a = dot(dir, dir);
+        float inv_a = 1.0f / a;
+
+        for (int i = begin; i < end; i++)
+        {
+            float ocx = cx[i] - orig[0], ocy = cy[i] - orig[1], ocz = cz[i] - orig[2];
+            float h = dir[0]*ocx + dir[1]*ocy + dir[2]*ocz;
+            float c = ocx*ocx + ocy*ocy + ocz*ocz - r2[i];
+            float disc = h*h - a*c;
+            if (disc < 0) continue;
+
+            float sq = std::sqrt(disc);
+            float t = (h - sq) * inv_a;
+            if (t < 0.001f) t = (h + sq) * inv_a;
+
+            if (t >= 0.001f && t < t_max) return true;
+        }
+        return false;
+    }
+
+    private:
+
+    // Ranges this short go through the scalar loop
+    static const int SHORT_RANGE = 4;
+
+    template <typename T>
+    static T* alloc(size_t n)
+    {
+        size_t bytes = ((n * sizeof(T) + 63) / 64) * 64;
+        T *p = static_cast<T*>(std::aligned_alloc(64, bytes));
+        std::memset(p, 0, bytes);
+        return p;
+    }
+
+    void release()
+    {
+        std::free(cx);
+        std::free(cy);
+        std::free(cz);
+        std::free(r2);
+        std::free(radius);
+        std::free(mat);
+        cx = cy = cz = r2 = radius = nullptr;
+        mat = nullptr;
+        count = 0;
+    }
+};
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <vector>
+#include <algorithm>
+
+#include "vec3.h"
+
+// Splits the render target into tiles and hands out as many per frame as
+// fit in a time budget, so one pass can be spread over several frames.
+// Tile costs are remembered from the last pass (glass tiles are slower
+// than sky tiles) and used to predict whether the next tile still fits.
+
+struct tile {
+    vec2 c_min; // in pixels, bottom left (GL window coordinates)
+    vec2 c_max; // exclusive
+    float cost_ms; // measured last pass (< 0 if never measured)
+};
+
+class tile_scheduler
+{
+    public:
+
+    std::vector<tile> tiles;
+    float budget_ms;
+    float pass_ms; // time taken by this pass's tiles so far
+
+    tile_scheduler() : budget_ms{0.0f}, pass_ms{0.0f}, next{0}, frame_ms{0.0f}, frame_tiles{0}, mean_ms{-1.0f} {};
+
+    // (tiles covering width x height pixels from x0, y0)
+    tile_scheduler(int width, int height, int tile_size, float my_budget_ms, int x0 = 0, int y0 = 0) : tile_scheduler()
+    {
+        budget_ms = my_budget_ms;
+
+        // A budget of 0 means no tiling (one full screen draw per pass)
+        if (budget_ms <= 0) {
+            tile_size = (width > height) ? width : height;
+        }
+
+        for (int y = y0; y < y0 + height; y += tile_size)
+        {
+            for (int x = x0; x < x0 + width; x += tile_size)
+            {
+                tile t;
+                t.c_min = vec2{float(x), float(y)};
+                t.c_max = vec2{float(std::min(x + tile_size, x0 + width)), float(std::min(y + tile_size, y0 + height))};
+                t.cost_ms = -1.0f;
+                tiles.push_back(t);
+            }
+        }
+    }
+
+    // Call at the start of every frame
+    void begin_frame()
+    {
+        frame_ms = 0.0f;
+        frame_tiles = 0;
+    }
+
+    // True if the next tile is predicted to fit in what is left of the budget
+    // (the first tile of a frame is always allowed so a pass always progresses)
+    bool has_time() const
+    {
+        if (pass_done()) return false;
+        if (frame_tiles == 0) return true;
+
+        float predicted = tiles[next].cost_ms >= 0 ? tiles[next].cost_ms : mean_ms;
+        return frame_ms + predicted <= budget_ms;
+    }
+
+    const tile& next_tile() const { return tiles[next]; }
+
+    // Record how long the tile returned by next_tile() took and move on
+    void finish_tile(float ms)
+    {
+        tiles[next].cost_ms = ms;
+        mean_ms = (mean_ms < 0) ? ms : 0.9f*mean_ms + 0.1f*ms;
+        frame_ms += ms;
+        pass_ms += ms;
+        frame_tiles += 1;
+        next += 1;
+    }
+
+    bool pass_done() const { return next >= tiles.size(); }
+
+    void begin_pass()
+    {
+        next = 0;
+        pass_ms = 0.0f;
+    }
+
+    private:
+
+    size_t next;
+    float frame_ms;
+    int frame_tiles;
+    float mean_ms; // running mean used for tiles we haven't timed yet
+};
+
+#endif
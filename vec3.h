@@ -4,6 +4,9 @@
 #include <cmath>
 #include <cstdlib>
 #include <iostream>
+#include <atomic>
+
+#include "rng.h"
 
 // Constants
 
@@ -17,7 +20,12 @@ inline float degrees_to_radians(float degrees) {
 
 inline float random_float() {
     // Returns a random real in [0,1).
-    return std::rand() / (RAND_MAX + 1.0);
+    // Counter based (see rng.h), with a stream per thread numbered in the
+    // order they first ask, so there's no shared state and the main
+    // thread's numbers (scene setup) are the same every run.
+    static std::atomic<RNG_UINT> num_streams{0};
+    thread_local rng_state stream = rng_init(0u, 0u, num_streams++);
+    return rng_next(stream);
 }
 
 inline float random_float(float min, float max) {
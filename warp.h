@@ -0,0 +1,139 @@
+#ifndef WARP_H
+#define WARP_H
+
+// Closed form maps from a point in [0, 1)^2 (a sampler.h point) to the
+// shapes the renderer samples, shared by the shader and the CPU renderer
+// like rng.h. They replace the old rejection loops: every call costs the
+// same, so no lane in a warp (or SIMD loop) waits on an unlucky neighbour,
+// and a stratified input point stays stratified on the disk or sphere.
+//
+// Results go through out parameters, one float each, since GLSL's vec3 and
+// the C++ one don't share any syntax for components.
+
+#include "rng.h"
+
+#define WARP_PI 3.14159265f
+
+#ifdef __cplusplus
+#include <cmath>
+#define WARP_SQRT std::sqrt
+#define WARP_ABS std::fabs
+#define WARP_MAX warp_max
+
+inline float warp_max(float a, float b)
+{
+  return a > b ? a : b;
+}
+
+// sin(2 pi x) for x in [-0.25, 0.25], Taylor series to x^11 (error < 1e-7)
+inline float warp_sin_quarter(float t)
+{
+  float x = 2.0f * WARP_PI * t;
+  float x2 = x * x;
+  return x * (1.0f + x2 * (-1.0f / 6.0f + x2 * (1.0f / 120.0f + x2 * (-1.0f / 5040.0f
+           + x2 * (1.0f / 362880.0f + x2 * (-1.0f / 39916800.0f))))));
+}
+
+// sin and cos of t turns. libm's sinf/cosf branch on the size of the
+// argument, which mispredicts all the time with random angles, so reduce
+// to a quarter turn without branching and use a polynomial instead.
+inline void warp_sincos(float t, float &s, float &c)
+{
+  t -= std::floor(t + 0.5f);    // [-0.5, 0.5)
+  float a = std::fabs(t);
+  float b = 0.5f - a;           // sin(pi - x) = sin(x)
+  s = warp_sin_quarter(std::copysign(a < b ? a : b, t));
+  c = warp_sin_quarter(0.25f - a);
+}
+#else
+#define WARP_SQRT sqrt
+#define WARP_ABS abs
+#define WARP_MAX max
+
+void warp_sincos(float t, out float s, out float c)
+{
+  s = sin(2.0f * WARP_PI * t);
+  c = cos(2.0f * WARP_PI * t);
+}
+#endif
+
+// Shirley & Chiu's concentric map: squares around the centre go to
+// circles, so it doesn't squash strata like the polar map does
+RNG_FN void concentric_disk(float u, float v, RNG_INOUT(float) x, RNG_INOUT(float) y)
+{
+  float a = 2.0f * u - 1.0f;
+  float b = 2.0f * v - 1.0f;
+  bool wide = WARP_ABS(a) > WARP_ABS(b);
+  float r = wide ? a : b;
+  float q = (wide ? b : a) / (r != 0.0f ? r : 1.0f);
+  float turns = wide ? 0.125f * q : 0.25f - 0.125f * q;
+  float s = 0.0f;
+  float c = 0.0f;
+  warp_sincos(turns, s, c);
+  x = r * c;
+  y = r * s;
+}
+
+// z uniform in [-1, 1] and phi uniform around it (Archimedes: equal
+// heights cut equal areas off a sphere)
+RNG_FN void uniform_sphere(float u, float v, RNG_INOUT(float) x, RNG_INOUT(float) y, RNG_INOUT(float) z)
+{
+  z = 1.0f - 2.0f * u;
+  float r = WARP_SQRT(WARP_MAX(0.0f, 1.0f - z * z));
+  float s = 0.0f;
+  float c = 0.0f;
+  warp_sincos(v, s, c);
+  x = r * c;
+  y = r * s;
+}
+
+// (dx, dy, dz) turned so that z points along the unit vector n, with the
+// branchless basis from Duff et al. 2017
+RNG_FN void to_basis(float nx, float ny, float nz, float dx, float dy, float dz,
+                     RNG_INOUT(float) x, RNG_INOUT(float) y, RNG_INOUT(float) z)
+{
+  float s = (nz >= 0.0f) ? 1.0f : -1.0f;
+  float a = -1.0f / (s + nz);
+  float b = nx * ny * a;
+  // tangent (1 + s*nx*nx*a, s*b, -s*nx), bitangent (b, s + ny*ny*a, -ny)
+  x = dx * (1.0f + s * nx * nx * a) + dy * b + dz * nx;
+  y = dx * (s * b) + dy * (s + ny * ny * a) + dz * ny;
+  z = dx * (-s * nx) + dy * (-ny) + dz * nz;
+}
+
+// Cosine weighted direction around the unit normal n: a disk point lifted
+// up onto the hemisphere (Malley's method)
+RNG_FN void cosine_hemisphere(float nx, float ny, float nz, float u, float v,
+                              RNG_INOUT(float) x, RNG_INOUT(float) y, RNG_INOUT(float) z)
+{
+  float dx = 0.0f;
+  float dy = 0.0f;
+  concentric_disk(u, v, dx, dy);
+  float dz = WARP_SQRT(WARP_MAX(0.0f, 1.0f - dx * dx - dy * dy));
+  to_basis(nx, ny, nz, dx, dy, dz, x, y, z);
+}
+
+// 1 - cos of the half angle of the cone a sphere of radius^2 r2 covers,
+// seen from distance^2 d2 (0 from inside it). Written so it doesn't
+// cancel out to 0 for small far away spheres like 1 - sqrt(1 - x) does.
+RNG_FN float sphere_cone(float r2, float d2)
+{
+  float x = r2 / d2;
+  return (x < 1.0f) ? x / (1.0f + WARP_SQRT(1.0f - x)) : 0.0f;
+}
+
+// Uniform direction in the cone around the unit vector n whose half angle
+// has 1 - cos = one_minus_cos (see sphere_cone()). The pdf is
+// 1 / (2 pi one_minus_cos).
+RNG_FN void uniform_cone(float nx, float ny, float nz, float one_minus_cos, float u, float v,
+                         RNG_INOUT(float) x, RNG_INOUT(float) y, RNG_INOUT(float) z)
+{
+  float h = u * one_minus_cos; // 1 - cos theta
+  float r = WARP_SQRT(WARP_MAX(0.0f, h * (2.0f - h)));
+  float s = 0.0f;
+  float c = 0.0f;
+  warp_sincos(v, s, c);
+  to_basis(nx, ny, nz, r * c, r * s, 1.0f - h, x, y, z);
+}
+
+#endif
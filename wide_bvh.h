@@ -0,0 +1,386 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#include "vec3.h"
+#include "bvh.h"
+#include "sphere_soa.h"
+#include "ray_packet.h"
+
+// 8-wide (4-wide without AVX2) BVH for the CPU renderer.
+//
+// Made by collapsing the binary bvh: each node takes the children of
+// its binary node, and keeps opening up whichever child has the biggest
+// surface area until it has WIDE_BVH_WIDTH of them. The child bounds are
+// stored as structure of arrays, so a ray is tested against every child
+// of a node with one set of SIMD instructions. Leaves are the binary
+// tree's leaves (runs of spheres in list order), so sphere_soa indexes
+// still apply.
+//
+// Traversal uses a stack and visits the children nearest first, so once a
+// hit is found anything further away gets skipped (any_hit(), for shadow
+// rays, just stops at the first hit). The stack is sized from the tree's
+// depth, so nothing is ever left off it.
+
+#if defined(__AVX2__)
+#define WIDE_BVH_WIDTH 8
+#else
+#define WIDE_BVH_WIDTH 4
+#endif
+
+struct wide_bvh_node {
+    alignas(32) float min_x[WIDE_BVH_WIDTH];
+    alignas(32) float min_y[WIDE_BVH_WIDTH];
+    alignas(32) float min_z[WIDE_BVH_WIDTH];
+    alignas(32) float max_x[WIDE_BVH_WIDTH];
+    alignas(32) float max_y[WIDE_BVH_WIDTH];
+    alignas(32) float max_z[WIDE_BVH_WIDTH];
+    int child[WIDE_BVH_WIDTH]; // node index, or first sphere for leaves
+    int count[WIDE_BVH_WIDTH]; // number of spheres, 0 for inner nodes
+    int num_children;
+};
+
+class wide_bvh
+{
+    public:
+
+    // Deepest stack that fits in the traversal's own frame, deeper trees
+    // get theirs from the heap (see traversal_stack)
+    static const int STACK_SIZE = 64 * WIDE_BVH_WIDTH;
+
+    std::vector<wide_bvh_node> nodes;
+    int depth;
+    int stack_size; // the most a traversal can ever push
+
+    wide_bvh() : depth{0}, stack_size{1} {};
+
+    wide_bvh(const bvh &tree) : depth{0}, stack_size{1}
+    {
+        build(tree);
+    }
+
+    void build(const bvh &tree)
+    {
+        nodes.clear();
+        depth = 0;
+        stack_size = 1;
+        if (tree.nodes.empty()) return;
+
+        nodes.reserve(tree.nodes.size() / (WIDE_BVH_WIDTH / 2) + 1);
+        if (tree.nodes[0].count > 0) {
+            // Tiny scene, the root is a leaf
+            nodes.push_back(wide_bvh_node());
+            nodes[0].num_children = 1;
+            set_child(nodes[0], 0, tree, 0);
+            depth = 1;
+        } else {
+            collapse(tree, 0, 1);
+        }
+
+        // Worst case stack use is a node's worth of children per level
+        stack_size = depth * (WIDE_BVH_WIDTH - 1) + 1;
+    }
+
+    // Finds the closest sphere hit by the ray at 0.001 < t < t_max, same
+    // contract as sphere_soa::closest_hit()
+    int closest_hit(const sphere_soa &s, const point3 &orig, const vec3 &dir, float &t_max) const
+    {
+        if (nodes.empty()) return -1;
+
+        float o[3] = {orig[0], orig[1], orig[2]};
+        float inv[3] = {1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]};
+
+        traversal_stack<int> stack(stack_size);
+        traversal_stack<float> stack_t(stack_size);
+        int top = 0;
+        stack[top] = 0;
+        stack_t[top] = 0.0f;
+        top++;
+
+        int best = -1;
+        while (top > 0)
+        {
+            top--;
+            if (stack_t[top] >= t_max) continue;
+            const wide_bvh_node &n = nodes[stack[top]];
+
+            alignas(32) float t_enter[WIDE_BVH_WIDTH];
+            uint32_t mask = hit_children(n, o, inv, t_max, t_enter);
+
+            // Leaves get tested straight away, inner nodes go on the stack
+            // furthest first so the nearest comes off next
+            int order[WIDE_BVH_WIDTH];
+            int num_inner = 0;
+            while (mask)
+            {
+                int c = __builtin_ctz(mask);
+                mask &= mask - 1;
+
+                if (n.count[c] > 0) {
+                    int h = s.closest_hit(n.child[c], n.child[c] + n.count[c], orig, dir, t_max);
+                    if (h >= 0) best = h;
+                } else {
+                    int k = num_inner++;
+                    while (k > 0 && t_enter[order[k - 1]] < t_enter[c]) {
+                        order[k] = order[k - 1];
+                        k--;
+                    }
+                    order[k] = c;
+                }
+            }
+
+            for (int k = 0; k < num_inner; k++) {
+                int c = order[k];
+                if (t_enter[c] >= t_max) continue;
+                stack[top] = n.child[c];
+                stack_t[top] = t_enter[c];
+                top++;
+            }
+        }
+        return best;
+    }
+
+    // Whether anything is hit at 0.001 < t < t_max, for shadow rays. Any
+    // hit will do, so children go on the stack in whatever order and the
+    // walk stops at the first one.
+    bool any_hit(const sphere_soa &s, const point3 &orig, const vec3 &dir, float t_max) const
+    {
+        if (nodes.empty()) return false;
+
+        float o[3] = {orig[0], orig[1], orig[2]};
+        float inv[3] = {1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]};
+
+        traversal_stack<int> stack(stack_size);
+        int top = 0;
+        stack[top++] = 0;
+
+        while (top > 0)
+        {
+            const wide_bvh_node &n = nodes[stack[--top]];
+
+            alignas(32) float t_enter[WIDE_BVH_WIDTH];
+            uint32_t mask = hit_children(n, o, inv, t_max, t_enter);
+            while (mask)
+            {
+                int c = __builtin_ctz(mask);
+                mask &= mask - 1;
+
+                if (n.count[c] > 0) {
+                    if (s.any_hit(n.child[c], n.child[c] + n.count[c], orig, dir, t_max)) return true;
+                } else {
+                    stack[top++] = n.child[c];
+                }
+            }
+        }
+        return false;
+    }
+
+    // The same walk for a packet. A child is visited if any of the rays
+    // that reached its parent hit it, in order along the first ray.
+    void closest_hit(const sphere_soa &s, ray_packet &p) const
+    {
+        if (nodes.empty() || !p.active) return;
+
+        int lead = __builtin_ctz(p.active);
+        float o[3] = {p.ox[lead], p.oy[lead], p.oz[lead]};
+        float d[3] = {p.dx[lead], p.dy[lead], p.dz[lead]};
+
+        traversal_stack<int> stack(stack_size);
+        traversal_stack<uint32_t> stack_mask(stack_size);
+        int top = 0;
+        stack[top] = 0;
+        stack_mask[top] = p.active;
+        top++;
+
+        while (top > 0)
+        {
+            top--;
+            const wide_bvh_node &n = nodes[stack[top]];
+            uint32_t parent_mask = stack_mask[top];
+
+            float key[WIDE_BVH_WIDTH];
+            uint32_t child_mask[WIDE_BVH_WIDTH];
+            int order[WIDE_BVH_WIDTH];
+            int num_inner = 0;
+
+            for (int c = 0; c < n.num_children; c++)
+            {
+                aabb b;
+                b.min = vec3(n.min_x[c], n.min_y[c], n.min_z[c]);
+                b.max = vec3(n.max_x[c], n.max_y[c], n.max_z[c]);
+                uint32_t mask = p.hit_box(b, parent_mask);
+                if (!mask) continue;
+
+                if (n.count[c] > 0) {
+                    p.closest_hit(s, n.child[c], n.child[c] + n.count[c], mask);
+                    continue;
+                }
+
+                child_mask[c] = mask;
+                key[c] = 0.0f;
+                for (int a = 0; a < 3; a++) {
+                    key[c] += (0.5f * (b.min[a] + b.max[a]) - o[a]) * d[a];
+                }
+
+                int k = num_inner++;
+                while (k > 0 && key[order[k - 1]] < key[c]) {
+                    order[k] = order[k - 1];
+                    k--;
+                }
+                order[k] = c;
+            }
+
+            for (int k = 0; k < num_inner; k++) {
+                stack[top] = n.child[order[k]];
+                stack_mask[top] = child_mask[order[k]];
+                top++;
+            }
+        }
+    }
+
+    private:
+
+    // A traversal's stack, in its own frame when stack_size fits (it does
+    // for any sensible scene) and on the heap when it doesn't
+    template <typename T>
+    struct traversal_stack {
+        T local[STACK_SIZE];
+        std::vector<T> heap;
+        T *items;
+
+        traversal_stack(int size) : items{local}
+        {
+            if (size > STACK_SIZE) {
+                heap.resize(size);
+                items = heap.data();
+            }
+        }
+
+        T &operator[](int i) { return items[i]; }
+    };
+
+    // Fills in child c of node n from binary node b
+    void set_child(wide_bvh_node &n, int c, const bvh &tree, int b)
+    {
+        const bvh_node &bn = tree.nodes[b];
+        n.min_x[c] = bn.bounds.min[0];
+        n.min_y[c] = bn.bounds.min[1];
+        n.min_z[c] = bn.bounds.min[2];
+        n.max_x[c] = bn.bounds.max[0];
+        n.max_y[c] = bn.bounds.max[1];
+        n.max_z[c] = bn.bounds.max[2];
+        n.child[c] = bn.start;
+        n.count[c] = bn.count;
+    }
+
+    // Builds the wide node for binary interior node b and returns its index
+    int collapse(const bvh &tree, int b, int level)
+    {
+        depth = std::max(depth, level);
+
+        int index = int(nodes.size());
+        nodes.push_back(wide_bvh_node());
+
+        // In the flattened binary tree the left child is b+1 and the right
+        // child is wherever the left one skips to
+        std::vector<int> children = {b + 1, tree.nodes[b + 1].skip};
+        while (int(children.size()) < WIDE_BVH_WIDTH)
+        {
+            int widest = -1;
+            float widest_area = -1.0f;
+            for (int i = 0; i < int(children.size()); i++) {
+                const bvh_node &cn = tree.nodes[children[i]];
+                if (cn.count == 0 && cn.bounds.area() > widest_area) {
+                    widest = i;
+                    widest_area = cn.bounds.area();
+                }
+            }
+            if (widest < 0) break;
+
+            int open = children[widest];
+            children[widest] = open + 1;
+            children.push_back(tree.nodes[open + 1].skip);
+        }
+
+        // Empty slots get an inside-out box, but they're masked off by
+        // num_children anyway
+        wide_bvh_node &n = nodes[index];
+        n.num_children = int(children.size());
+        for (int c = 0; c < WIDE_BVH_WIDTH; c++) {
+            n.min_x[c] = n.min_y[c] = n.min_z[c] = 1e30f;
+            n.max_x[c] = n.max_y[c] = n.max_z[c] = -1e30f;
+            n.child[c] = 0;
+            n.count[c] = 0;
+        }
+        for (int c = 0; c < n.num_children; c++) {
+            set_child(n, c, tree, children[c]);
+        }
+
+        for (int c = 0; c < int(children.size()); c++) {
+            if (tree.nodes[children[c]].count == 0) {
+                int child = collapse(tree, children[c], level + 1);
+                nodes[index].child[c] = child;
+            }
+        }
+        return index;
+    }
+
+    // Slab test of one ray against all the children of n. Returns a bit
+    // per child that was hit, with the entry distances in t_enter.
+    static uint32_t hit_children(const wide_bvh_node &n, const float o[3], const float inv[3], float t_max,
+                                 float *t_enter)
+    {
+        uint32_t valid = (1u << n.num_children) - 1u;
+#if WIDE_BVH_WIDTH == 8
+        __m256 t_in = _mm256_set1_ps(0.001f);
+        __m256 t_out = _mm256_set1_ps(t_max);
+        const float *lo[3] = {n.min_x, n.min_y, n.min_z};
+        const float *hi[3] = {n.max_x, n.max_y, n.max_z};
+        for (int a = 0; a < 3; a++) {
+            __m256 vo = _mm256_set1_ps(o[a]), vinv = _mm256_set1_ps(inv[a]);
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(lo[a]), vo), vinv);
+            __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(hi[a]), vo), vinv);
+            t_in = _mm256_max_ps(t_in, _mm256_min_ps(t0, t1));
+            t_out = _mm256_min_ps(t_out, _mm256_max_ps(t0, t1));
+        }
+        _mm256_store_ps(t_enter, t_in);
+        return valid & uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(t_in, t_out, _CMP_LE_OQ)));
+#elif defined(__SSE4_1__)
+        __m128 t_in = _mm_set1_ps(0.001f);
+        __m128 t_out = _mm_set1_ps(t_max);
+        const float *lo[3] = {n.min_x, n.min_y, n.min_z};
+        const float *hi[3] = {n.max_x, n.max_y, n.max_z};
+        for (int a = 0; a < 3; a++) {
+            __m128 vo = _mm_set1_ps(o[a]), vinv = _mm_set1_ps(inv[a]);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(lo[a]), vo), vinv);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(hi[a]), vo), vinv);
+            t_in = _mm_max_ps(t_in, _mm_min_ps(t0, t1));
+            t_out = _mm_min_ps(t_out, _mm_max_ps(t0, t1));
+        }
+        _mm_store_ps(t_enter, t_in);
+        return valid & uint32_t(_mm_movemask_ps(_mm_cmple_ps(t_in, t_out)));
+#else
+        uint32_t result = 0;
+        const float *lo[3] = {n.min_x, n.min_y, n.min_z};
+        const float *hi[3] = {n.max_x, n.max_y, n.max_z};
+        for (int c = 0; c < n.num_children; c++) {
+            float t_in = 0.001f;
+            float t_out = t_max;
+            for (int a = 0; a < 3; a++) {
+                float t0 = (lo[a][c] - o[a]) * inv[a];
+                float t1 = (hi[a][c] - o[a]) * inv[a];
+                t_in = std::max(t_in, std::min(t0, t1));
+                t_out = std::min(t_out, std::max(t0, t1));
+            }
+            t_enter[c] = t_in;
+            if (t_in <= t_out) result |= 1u << c;
+        }
+        return valid & result;
+#endif
+    }
+};
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+// Work stealing over a fixed list of items (the CPU renderer's tiles).
+//
+// Every thread starts a pass with its own contiguous run of items and
+// takes them from the front. A thread that runs out steals one item at a
+// time from the back of whichever run has the most left, so the owner and
+// the thief stay at opposite ends (and in different parts of the image).
+//
+// Each run is just (begin, end) packed into one 64 bit atomic, so popping
+// and stealing are a compare and swap each. Nothing gets pushed during a
+// pass, which is what lets it be that simple. Every run sits on its own
+// cache line so threads don't fight over each other's counters.
+
+class work_queue
+{
+    public:
+
+    int num_queues;
+    int num_items;
+
+    work_queue(int my_num_queues) : num_queues{my_num_queues}, num_items{0},
+                                    ranges{new range[my_num_queues]}
+    {
+        reset(0);
+    }
+
+    // Splits items [0, n) evenly between the queues
+    void reset(int n)
+    {
+        num_items = n;
+        for (int q = 0; q < num_queues; q++) {
+            ranges[q].bits.store(pack(first(q), first(q + 1)), std::memory_order_relaxed);
+        }
+    }
+
+    // Start of queue q's share after a reset (first(num_queues) is the end)
+    int first(int q) const
+    {
+        return int(int64_t(num_items) * q / num_queues);
+    }
+
+    // Next item for queue q's owner, or -1 if it's empty
+    int pop(int q)
+    {
+        uint64_t bits = ranges[q].bits.load(std::memory_order_relaxed);
+        while (true)
+        {
+            int begin = lo(bits), end = hi(bits);
+            if (begin >= end) return -1;
+            if (ranges[q].bits.compare_exchange_weak(bits, pack(begin + 1, end), std::memory_order_acq_rel)) {
+                return begin;
+            }
+        }
+    }
+
+    // Takes the last item from the fullest queue other than q, or -1 once
+    // everything has been handed out
+    int steal(int q)
+    {
+        while (true)
+        {
+            int victim = -1;
+            int most = 0;
+            for (int v = 0; v < num_queues; v++) {
+                if (v == q) continue;
+                uint64_t bits = ranges[v].bits.load(std::memory_order_relaxed);
+                int left = hi(bits) - lo(bits);
+                if (left > most) {
+                    most = left;
+                    victim = v;
+                }
+            }
+            if (victim < 0) return -1;
+
+            uint64_t bits = ranges[victim].bits.load(std::memory_order_relaxed);
+            int begin = lo(bits), end = hi(bits);
+            if (begin >= end) continue;
+            if (ranges[victim].bits.compare_exchange_weak(bits, pack(begin, end - 1), std::memory_order_acq_rel)) {
+                return end - 1;
+            }
+        }
+    }
+
+    private:
+
+    struct alignas(64) range {
+        std::atomic<uint64_t> bits;
+    };
+
+    std::unique_ptr<range[]> ranges;
+
+    static uint64_t pack(int begin, int end)
+    {
+        return (uint64_t(uint32_t(end)) << 32) | uint32_t(begin);
+    }
+
+    static int lo(uint64_t bits) { return int(uint32_t(bits)); }
+    static int hi(uint64_t bits) { return int(uint32_t(bits >> 32)); }
+};
+
+#endif